@@ -0,0 +1,507 @@
+/*
+ * shellax benchmark suite.
+ * Builds the shell itself into the benchmark (without its main) and times the
+ * paths we care about. Prints one JSON document on stdout:
+ *
+ *   {"suite": "shellax", "timestamp": ..., "results": [
+ *     {"name": ..., "value": ..., "unit": ..., "iterations": ...}, ...]}
+ *
+ * Sizes can be tuned from the environment:
+ *   BENCH_DIR       scratch directory for generated inputs (default /tmp)
+ *   BENCH_PIPE_MB   data pushed through the pipeline benchmark (default 256)
+ *   BENCH_UNIQ_LINES lines of the myuniq input (default 1000000)
+ *   BENCH_BIG_MB    size of the first/last input (default 2048)
+ *   BENCH_GLOB_FILES files in the glob tree (default 1000000)
+ *   BENCH_MANY_FILES logs read by the multi-file last (default 4000)
+ *   BENCH_MATCH_MB  size of the match input (default 256)
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+
+struct bench_result {
+  const char *name;
+  double value;
+  const char *unit;
+  long iterations;
+};
+
+struct bench_result results[32];
+int result_count = 0;
+
+double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, double value, const char *unit, long iterations) {
+  results[result_count++] = (struct bench_result){name, value, unit, iterations};
+  fprintf(stderr, "%-24s %14.2f %s\n", name, value, unit);
+}
+
+long env_long(const char *name, long fallback) {
+  char *value = getenv(name);
+  return value ? atol(value) : fallback;
+}
+
+/**
+ * Path of a generated input, created by `fill` unless it already exists with
+ * the expected size (generated inputs are reused between runs)
+ */
+const char *bench_input(const char *name, off_t size,
+                        void (*fill)(FILE *, off_t)) {
+  static char paths[8][PATH_MAX];
+  static int used = 0;
+  char *path = paths[used++];
+  const char *dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/tmp";
+  snprintf(path, PATH_MAX, "%s/shellax-bench-%s", dir, name);
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size == size)
+    return path;
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    exit(1);
+  }
+  fill(file, size);
+  fclose(file);
+  return path;
+}
+
+void fill_random(FILE *file, off_t size) {
+  char buf[1 << 16];
+  for (off_t done = 0; done < size; done += sizeof(buf)) {
+    for (size_t i = 0; i < sizeof(buf); i += 8) {
+      uint64_t r = prng_next();
+      memcpy(buf + i, &r, 8);
+    }
+    off_t n = size - done < (off_t)sizeof(buf) ? size - done : (off_t)sizeof(buf);
+    fwrite(buf, 1, n, file);
+  }
+}
+
+// fixed-width log lines, so the size of the file is known up front
+#define LOG_LINE 64
+
+void fill_log(FILE *file, off_t size) {
+  char line[LOG_LINE + 1];
+  for (off_t i = 0; i < size / LOG_LINE; i++) {
+    int len = snprintf(line, sizeof(line), "%012ld INFO request served in %6lu us",
+                       (long)i, (unsigned long)prng_below(1000000));
+    memset(line + len, ' ', LOG_LINE - 1 - len);
+    line[LOG_LINE - 1] = '\n';
+    fwrite(line, 1, LOG_LINE, file);
+  }
+}
+
+void fill_uniq(FILE *file, off_t size) {
+  // 16-byte lines drawn from 4096 distinct values
+  for (off_t i = 0; i < size / 16; i++)
+    fprintf(file, "key-%010lu\n", (unsigned long)prng_below(4096));
+}
+
+void fill_sort(FILE *file, off_t size) {
+  // 32-byte lines: a random hex key and a random number
+  for (off_t i = 0; i < size / 32; i++)
+    fprintf(file, "%016lx %14lu\n", (unsigned long)prng_next(),
+            (unsigned long)prng_below(1000000000));
+}
+
+struct command_t *parse(const char *line) {
+  struct command_t *command = calloc(1, sizeof(struct command_t));
+  char *buf = strdup(line);
+  parse_command(buf, command);
+  free(buf);
+  return command;
+}
+
+void bench_parse() {
+  const char *line = "cat <access.log | str lower | match -c 'GET /api' | "
+                     "myuniq -c >>report.txt";
+  long n = 200000;
+  double start = now_seconds();
+  for (long i = 0; i < n; i++)
+    free_command(parse(line));
+  double elapsed = now_seconds() - start;
+  report("parse_command", elapsed / n * 1e9, "ns/op", n);
+}
+
+/**
+ * Drawing the prompt, stdout sent to /dev/null (the branch lookup runs on
+ * the prompt's own thread)
+ */
+void bench_prompt() {
+  int saved = dup(STDOUT_FILENO), devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDOUT_FILENO);
+  long n = 200000;
+  double start = now_seconds();
+  for (long i = 0; i < n; i++)
+    show_prompt();
+  double elapsed = now_seconds() - start;
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(devnull);
+  report("prompt_draw", elapsed / n * 1e9, "ns/op", n);
+}
+
+void bench_resolve() {
+  char path[PATH_MAX];
+  long n = 100000;
+  double start = now_seconds();
+  for (long i = 0; i < n; i++)
+    resolve_command("sh", path, sizeof(path));
+  double elapsed = now_seconds() - start;
+  report("path_resolve", elapsed / n * 1e9, "ns/op", n);
+}
+
+void bench_fork_exec() {
+  struct command_t *command = parse("true");
+  long n = 500;
+  double start = now_seconds();
+  for (long i = 0; i < n; i++)
+    process_command(command);
+  double elapsed = now_seconds() - start;
+  free_command(command);
+  report("fork_exec", elapsed / n * 1e6, "us/op", n);
+}
+
+/**
+ * A command line run through `shellax --server` against a fresh shell per
+ * command (the way tools ran commands before the server)
+ */
+void bench_server() {
+  char path[PATH_MAX];
+  const char *dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/tmp";
+  snprintf(path, sizeof(path), "%s/shellax-bench.sock", dir);
+  pid_t server = fork();
+  if (server == 0)
+    _exit(run_server(path));
+  struct sockaddr_un addr;
+  socket_address(path, &addr);
+  for (int i = 0; i < 1000; i++) { // until it listens
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int up = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(probe);
+    if (up)
+      break;
+    usleep(1000);
+  }
+  char *line[] = {"true"};
+  long n = 500;
+  double start = now_seconds();
+  for (long i = 0; i < n; i++)
+    run_client(path, 1, line);
+  double elapsed = now_seconds() - start;
+  report("server_request", elapsed / n * 1e6, "us/op", n);
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  unlink(path);
+
+  start = now_seconds();
+  for (long i = 0; i < n; i++) {
+    int input[2];
+    if (pipe(input) == -1)
+      break;
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(input[0], STDIN_FILENO);
+      int devnull = open("/dev/null", O_WRONLY);
+      dup2(devnull, STDOUT_FILENO);
+      execl("./shellax", "shellax", NULL);
+      _exit(127);
+    }
+    close(input[0]);
+    if (write(input[1], "true\nexit\n", 10) == -1)
+      perror("write");
+    close(input[1]);
+    waitpid(pid, NULL, 0);
+  }
+  elapsed = now_seconds() - start;
+  report("fresh_shell_request", elapsed / n * 1e6, "us/op", n);
+}
+
+void bench_pipeline() {
+  long mb = env_long("BENCH_PIPE_MB", 256);
+  const char *input = bench_input("pipe", mb << 20, fill_random);
+  char line[PATH_MAX + 64];
+  snprintf(line, sizeof(line), "cat %s | /bin/cat | /bin/cat >/dev/null", input);
+  struct command_t *command = parse(line);
+  double start = now_seconds();
+  process_command(command);
+  double elapsed = now_seconds() - start;
+  free_command(command);
+  report("pipeline_throughput", mb / elapsed, "MB/s", 1);
+}
+
+void bench_myuniq() {
+  long lines = env_long("BENCH_UNIQ_LINES", 1000000);
+  const char *input = bench_input("uniq", lines * 16, fill_uniq);
+  struct command_t *command = parse("myuniq -c");
+  FILE *in = fopen(input, "r"), *out = fopen("/dev/null", "w");
+  double start = now_seconds();
+  myUniq(command, in, out);
+  double elapsed = now_seconds() - start;
+  fclose(in);
+  fclose(out);
+  free_command(command);
+  report("myuniq_lines", lines / elapsed / 1e6, "Mlines/s", lines);
+
+  // 4096 equally frequent lines for 1024 counters: every miss evicts
+  command = parse("myuniq -top 10");
+  in = fopen(input, "r");
+  out = fopen("/dev/null", "w");
+  FILE *err = stderr;
+  stderr = out; // the error bound summary
+  start = now_seconds();
+  myUniq(command, in, out);
+  elapsed = now_seconds() - start;
+  stderr = err;
+  fclose(in);
+  fclose(out);
+  free_command(command);
+  report("myuniq_top_lines", lines / elapsed / 1e6, "Mlines/s", lines);
+}
+
+/**
+ * mysort on random keys, numerically on a field, and with a memory budget
+ * small enough to spill sorted runs to disk
+ */
+void bench_mysort() {
+  long lines = env_long("BENCH_SORT_LINES", 2000000);
+  const char *input = bench_input("sort", lines * 32, fill_sort);
+  const char *modes[3][2] = {{"mysort_lines", "mysort %s"},
+                             {"mysort_numeric_lines", "mysort -n -k 2 %s"},
+                             {"mysort_spill_lines", "mysort -S 8m %s"}};
+  for (int i = 0; i < 3; i++) {
+    char line[PATH_MAX + 32];
+    snprintf(line, sizeof(line), modes[i][1], input);
+    struct command_t *command = parse(line);
+    FILE *out = fopen("/dev/null", "w");
+    double start = now_seconds();
+    run_stream_builtin(command, stdin, out);
+    double elapsed = now_seconds() - start;
+    fclose(out);
+    free_command(command);
+    report(modes[i][0], lines / elapsed / 1e6, "Mlines/s", lines);
+  }
+}
+
+void bench_first_last() {
+  long mb = env_long("BENCH_BIG_MB", 2048);
+  const char *input = bench_input("log", (mb << 20) / LOG_LINE * LOG_LINE, fill_log);
+  const char *names[2] = {"first_1000_lines", "last_1000_lines"};
+  for (int last = 0; last < 2; last++) {
+    char line[PATH_MAX + 32];
+    snprintf(line, sizeof(line), "%s %s 1000", last ? "last" : "first", input);
+    struct command_t *command = parse(line);
+    FILE *out = fopen("/dev/null", "w");
+    long n = 100;
+    double start = now_seconds();
+    for (long i = 0; i < n; i++)
+      run_stream_builtin(command, stdin, out);
+    double elapsed = now_seconds() - start;
+    fclose(out);
+    free_command(command);
+    report(names[last], elapsed / n * 1e6, "us/op", n);
+  }
+}
+
+/**
+ * match throughput for one literal, several literals and a regular
+ * expression, and the cost of one small match against an external grep
+ */
+void bench_match() {
+  long mb = env_long("BENCH_MATCH_MB", 256);
+  const char *input = bench_input("match", (mb << 20) / LOG_LINE * LOG_LINE, fill_log);
+  const char *names[3] = {"match_literal", "match_multi", "match_regex"};
+  const char *options[3] = {"'in 123456 us'",
+                            "-e 'in 123456 us' -e 'in 654321 us' -e 000042",
+                            "'0042 INFO .* [0-9]+9 us'"};
+  FILE *out = fopen("/dev/null", "w");
+  for (int i = 0; i < 3; i++) {
+    char line[PATH_MAX + 128];
+    snprintf(line, sizeof(line), "match -c %s %s", options[i], input);
+    struct command_t *command = parse(line);
+    expand_globs(command); // removes the escapes left by quoting
+    double start = now_seconds();
+    run_stream_builtin(command, stdin, out);
+    double elapsed = now_seconds() - start;
+    free_command(command);
+    report(names[i], mb / elapsed, "MB/s", 1);
+  }
+  fclose(out);
+
+  const char *small = bench_input("loop", 64 * LOG_LINE, fill_log);
+  const char *tools[2] = {"match", "grep"};
+  const char *small_names[2] = {"match_small_builtin", "match_small_grep"};
+  for (int i = 0; i < 2; i++) {
+    char line[PATH_MAX + 64];
+    snprintf(line, sizeof(line), "%s INFO %s >/dev/null", tools[i], small);
+    struct command_t *command = parse(line);
+    long n = 500;
+    double start = now_seconds();
+    for (long k = 0; k < n; k++)
+      process_command(command);
+    double elapsed = now_seconds() - start;
+    free_command(command);
+    report(small_names[i], elapsed / n * 1e6, "us/op", n);
+  }
+}
+
+/**
+ * `last *.log 20` over many small logs, with the pool held to one CPU and
+ * with every allowed CPU
+ */
+void bench_last_many() {
+  long files = env_long("BENCH_MANY_FILES", 4000);
+  const char *dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/tmp";
+  char root[PATH_MAX], path[PATH_MAX + 32], cwd[PATH_MAX];
+  snprintf(root, sizeof(root), "%s/shellax-bench-logs-%ld", dir, files);
+  mkdir(root, 0755);
+  for (long i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "%s/app.%05ld.log", root, i);
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_size == 256 * LOG_LINE)
+      continue;
+    FILE *file = fopen(path, "w");
+    fill_log(file, 256 * LOG_LINE);
+    fclose(file);
+  }
+  if (!getcwd(cwd, sizeof(cwd)) || chdir(root) != 0)
+    return;
+  struct command_t *command = parse("last *.log 20");
+  expand_globs(command);
+  cpu_set_t all, one;
+  sched_getaffinity(0, sizeof(all), &all);
+  CPU_ZERO(&one);
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &all)) {
+      CPU_SET(cpu, &one);
+      break;
+    }
+  const char *names[2] = {"last_many_1cpu", "last_many_all"};
+  FILE *out = fopen("/dev/null", "w");
+  for (int i = 0; i < 2; i++) {
+    sched_setaffinity(0, sizeof(cpu_set_t), i == 0 ? &one : &all);
+    long n = 5;
+    double start = now_seconds();
+    for (long k = 0; k < n; k++)
+      run_stream_builtin(command, stdin, out);
+    double elapsed = now_seconds() - start;
+    report(names[i], elapsed / n * 1e3, "ms/op", files);
+  }
+  fclose(out);
+  free_command(command);
+  if (chdir(cwd) != 0)
+    perror(cwd);
+}
+
+/**
+ * Expand a recursive "*.log" glob over a generated tree of 100 x 100
+ * directories, once with an empty directory cache and once with a warm one
+ */
+void bench_glob() {
+  long files = env_long("BENCH_GLOB_FILES", 1000000);
+  const char *dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/tmp";
+  char root[PATH_MAX], path[PATH_MAX + 64], marker[PATH_MAX + 16];
+  snprintf(root, sizeof(root), "%s/shellax-bench-tree-%ld", dir, files);
+  snprintf(marker, sizeof(marker), "%s/.complete", root);
+  if (access(marker, F_OK) != 0) {
+    fprintf(stderr, "creating %ld files under %s\n", files, root);
+    mkdir(root, 0755);
+    long per_dir = files / 10000 > 0 ? files / 10000 : 1;
+    for (long i = 0; i < files; i++) {
+      long d = i / per_dir;
+      snprintf(path, sizeof(path), "%s/d%02ld", root, d / 100 % 100);
+      mkdir(path, 0755);
+      snprintf(path, sizeof(path), "%s/d%02ld/e%02ld", root, d / 100 % 100,
+               d % 100);
+      mkdir(path, 0755);
+      snprintf(path, sizeof(path), "%s/d%02ld/e%02ld/f%06ld.%s", root,
+               d / 100 % 100, d % 100, i, i % 2 ? "log" : "txt");
+      close(open(path, O_WRONLY | O_CREAT, 0644));
+    }
+    close(open(marker, O_WRONLY | O_CREAT, 0644));
+  }
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)) || chdir(root) != 0)
+    return;
+  const char *names[2] = {"glob_cold", "glob_warm"};
+  glob_cache_flush();
+  for (int warm = 0; warm < 2; warm++) {
+    int count;
+    double start = now_seconds();
+    char **paths = glob_expand("**/*.log", &count);
+    double elapsed = now_seconds() - start;
+    for (int i = 0; i < count; i++)
+      free(paths[i]);
+    free(paths);
+    report(names[warm], elapsed * 1e3, "ms/op", count);
+  }
+  glob_cache_flush();
+  if (chdir(cwd) != 0)
+    perror(cwd);
+}
+
+/**
+ * A 100k-iteration loop of a builtin, run from the parsed tree
+ */
+void bench_loop() {
+  const char *input = bench_input("loop", 64 * LOG_LINE, fill_log);
+  char line[PATH_MAX + 96];
+  snprintf(line, sizeof(line),
+           "for i in {1..100000}; do first %s 1 >/dev/null; done", input);
+  struct node_t *tree;
+  parse_line(line, &tree);
+  double start = now_seconds();
+  run_node(tree);
+  double elapsed = now_seconds() - start;
+  free_node(tree);
+  report("loop_iteration", elapsed / 100000 * 1e6, "us/op", 100000);
+}
+
+/**
+ * $(...) of a builtin, which runs in-process, and of an external command
+ */
+void bench_substitution() {
+  const char *input = bench_input("loop", 64 * LOG_LINE, fill_log);
+  char text[PATH_MAX + 32];
+  snprintf(text, sizeof(text), "first %s 1", input);
+  const char *names[2] = {"subst_builtin", "subst_external"};
+  const char *texts[2] = {text, "/bin/true"};
+  long counts[2] = {100000, 500};
+  for (int i = 0; i < 2; i++) {
+    double start = now_seconds();
+    for (long n = 0; n < counts[i]; n++)
+      free(command_substitution(texts[i], strlen(texts[i])));
+    double elapsed = now_seconds() - start;
+    report(names[i], elapsed / counts[i] * 1e6, "us/op", counts[i]);
+  }
+}
+
+int main() {
+  bench_parse();
+  bench_prompt();
+  bench_resolve();
+  bench_fork_exec();
+  bench_server();
+  bench_loop();
+  bench_substitution();
+  bench_pipeline();
+  bench_myuniq();
+  bench_mysort();
+  bench_first_last();
+  bench_last_many();
+  bench_match();
+  bench_glob();
+
+  printf("{\"suite\": \"shellax\", \"timestamp\": %ld, \"results\": [",
+         (long)time(NULL));
+  for (int i = 0; i < result_count; i++)
+    printf("%s\n  {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", "
+           "\"iterations\": %ld}",
+           i ? "," : "", results[i].name, results[i].value, results[i].unit,
+           results[i].iterations);
+  printf("\n]}\n");
+  return 0;
+}
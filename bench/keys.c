@@ -0,0 +1,546 @@
+/*
+ * Interactive latency harness: runs shellax on a pseudo-terminal, replays
+ * keystroke scripts with human timing and measures how fast the prompt
+ * answers. Needs no terminal of its own, so it runs on a headless build box.
+ *
+ *   shellax-keys [-b baseline] [-s baseline] [-t percent] [-m ms] [-n rounds]
+ *                [-v] [-x shellax] script.keys...
+ *   shellax-keys -r script.keys    record a script from the terminal
+ *
+ * Every key is timed from the write to the pty to the shell's answer:
+ *   echo     printable keys and backspace, until the first byte comes back
+ *   repaint  arrows and other escape sequences, until the first byte
+ *   enter    Enter, until the next prompt is drawn
+ *   tab      Tab, until the next prompt (the prompt treats Tab as the end of
+ *            the line, with `?` appended)
+ * Results go to stdout as JSON (p50/p90/p99/max per class, milliseconds),
+ * like bench/shellax-bench. -n replays the scripts several rounds in the same
+ * session; the gate looks at the median over the rounds of each round's p99,
+ * so that one round disturbed by the machine does not fail it. With -b, the
+ * run fails (exit 1) when that p99 exceeds the baseline by more than -t
+ * percent (default 25) plus -m ms of scheduling noise (default 0.5); -s saves
+ * it as the new baseline. -v copies the session to stderr.
+ *
+ * Script lines (# starts a comment):
+ *   type TEXT       one key per character, at the typing pace
+ *   enter | tab | backspace | up | down | left | right | ctrl-d
+ *   raw TEXT        one key sending TEXT (\e, \t, \r, \\ and \xHH escapes)
+ *   pause MS        think time
+ *   pace MS JITTER  typing pace: MS between keys, +/- JITTER (default 60 30)
+ * KEYS_PACE_SCALE scales every delay (0 replays as fast as the shell answers).
+ * The shell runs in a scratch directory, so that no git branch lookup redraws
+ * the prompt behind the harness's back.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROMPT_MARK "shellax$ "
+#define ANSWER_TIMEOUT 5000 // ms a key may wait for its answer
+#define NOISE_MS 0.5
+#define ROUNDS_MAX 64
+
+enum key_class { CLASS_ECHO, CLASS_REPAINT, CLASS_ENTER, CLASS_TAB, CLASSES };
+const char *class_names[CLASSES] = {"echo", "repaint", "enter", "tab"};
+
+struct samples {
+  double *ms;
+  int count, cap;
+  double round_p99[ROUNDS_MAX];
+  int rounds, round_start; // first sample of the current round
+} samples[CLASSES];
+
+struct session {
+  int master;
+  pid_t pid;
+  char tail[64]; // last output bytes, to spot the prompt
+  int tail_len;
+  double pace, jitter, scale;
+  uint64_t seed;
+  bool verbose;
+};
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+void sleep_ms(double ms) {
+  if (ms <= 0)
+    return;
+  struct timespec ts = {(time_t)(ms / 1e3), (long)(ms * 1e6) % 1000000000};
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+/**
+ * Read what the shell wrote, keeping the tail for prompt detection
+ * @param timeout ms to wait for the first byte, 0 to only drain
+ * @return bytes read, 0 on timeout, -1 when the shell is gone
+ */
+int read_output(struct session *s, int timeout) {
+  struct pollfd p = {s->master, POLLIN, 0};
+  if (poll(&p, 1, timeout) <= 0)
+    return 0;
+  char buf[4096];
+  ssize_t n = read(s->master, buf, sizeof(buf));
+  if (n <= 0)
+    return -1;
+  if (s->verbose && write(STDERR_FILENO, buf, n) == -1)
+    s->verbose = false;
+  for (ssize_t i = 0; i < n; i++) {
+    if (s->tail_len == sizeof(s->tail)) {
+      memmove(s->tail, s->tail + 1, sizeof(s->tail) - 1);
+      s->tail_len--;
+    }
+    s->tail[s->tail_len++] = buf[i];
+  }
+  return n;
+}
+
+bool at_prompt(struct session *s) {
+  int mark = strlen(PROMPT_MARK);
+  return s->tail_len >= mark &&
+         memcmp(s->tail + s->tail_len - mark, PROMPT_MARK, mark) == 0;
+}
+
+/**
+ * Wait until the prompt is drawn
+ * @return 0, -1 on timeout or when the shell is gone
+ */
+int wait_prompt(struct session *s) {
+  double deadline = now_ms() + ANSWER_TIMEOUT;
+  while (!at_prompt(s)) {
+    int left = deadline - now_ms();
+    if (left <= 0 || read_output(s, left) <= 0)
+      return -1;
+  }
+  return 0;
+}
+
+void add_sample(enum key_class class, double ms) {
+  struct samples *v = &samples[class];
+  if (v->count == v->cap)
+    v->ms = realloc(v->ms, (v->cap = v->cap ? v->cap * 2 : 256) * sizeof(double));
+  v->ms[v->count++] = ms;
+}
+
+/**
+ * Send one key and time the answer
+ * @return 0, -1 if the shell did not answer
+ */
+int press(struct session *s, const char *key, size_t len, enum key_class class) {
+  while (read_output(s, 0) > 0) // late output is not this key's answer
+    ;
+  s->tail_len = 0;
+  double start = now_ms();
+  if (write(s->master, key, len) != (ssize_t)len)
+    return -1;
+  if (class == CLASS_ENTER || class == CLASS_TAB) {
+    if (wait_prompt(s) == -1)
+      return -1;
+  } else if (read_output(s, ANSWER_TIMEOUT) <= 0) {
+    return -1;
+  }
+  add_sample(class, now_ms() - start);
+  return 0;
+}
+
+/**
+ * Think time between keys: the pace, give or take the jitter
+ */
+void think(struct session *s) {
+  s->seed = s->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  double unit = (s->seed >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+  sleep_ms((s->pace + s->jitter * (2 * unit - 1)) * s->scale);
+}
+
+/**
+ * Decode \e, \t, \r, \n, \\ and \xHH
+ * @return length of the decoded key
+ */
+size_t unescape(const char *in, char *out) {
+  size_t n = 0;
+  for (; *in; in++) {
+    if (*in != '\\' || !in[1]) {
+      out[n++] = *in;
+      continue;
+    }
+    switch (*++in) {
+    case 'e': out[n++] = 27; break;
+    case 't': out[n++] = '\t'; break;
+    case 'r': out[n++] = '\r'; break;
+    case 'n': out[n++] = '\n'; break;
+    case 'x': {
+      unsigned value;
+      if (sscanf(in + 1, "%2x", &value) == 1) {
+        out[n++] = value;
+        in += 2;
+      }
+      break;
+    }
+    default: out[n++] = *in;
+    }
+  }
+  return n;
+}
+
+struct named_key {
+  const char *name, *bytes;
+  enum key_class class;
+} named_keys[] = {
+    {"enter", "\r", CLASS_ENTER},      {"tab", "\t", CLASS_TAB},
+    {"backspace", "\177", CLASS_ECHO}, {"up", "\033[A", CLASS_REPAINT},
+    {"down", "\033[B", CLASS_REPAINT}, {"right", "\033[C", CLASS_REPAINT},
+    {"left", "\033[D", CLASS_REPAINT}, {"ctrl-d", "\004", CLASS_ENTER},
+    {NULL, NULL, 0}};
+
+/**
+ * Replay a script
+ * @return 0, -1 on a script error or when the shell stopped answering
+ */
+int replay(struct session *s, const char *path) {
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    fprintf(stderr, "shellax-keys: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  char line[4096], key[4096];
+  int number = 0, status = 0;
+  while (status == 0 && fgets(line, sizeof(line), file)) {
+    number++;
+    line[strcspn(line, "\n")] = 0;
+    char *word = line + strspn(line, " \t"), *arg = strchr(word, ' ');
+    if (arg)
+      *arg++ = 0;
+    if (!*word || *word == '#')
+      continue;
+    if (strcmp(word, "type") == 0 && arg) {
+      for (char *c = arg; *c && status == 0; c++) {
+        think(s);
+        status = press(s, c, 1, CLASS_ECHO);
+      }
+    } else if (strcmp(word, "raw") == 0 && arg) {
+      think(s);
+      size_t len = unescape(arg, key);
+      status = press(s, key, len, key[0] == 27 ? CLASS_REPAINT : CLASS_ECHO);
+    } else if (strcmp(word, "pause") == 0 && arg) {
+      sleep_ms(atof(arg) * s->scale);
+    } else if (strcmp(word, "pace") == 0 && arg) {
+      char *jitter;
+      s->pace = strtod(arg, &jitter);
+      s->jitter = *jitter ? atof(jitter) : 0;
+    } else {
+      struct named_key *k = named_keys;
+      while (k->name && strcmp(k->name, word) != 0)
+        k++;
+      if (!k->name) {
+        fprintf(stderr, "shellax-keys: %s:%d: unknown action '%s'\n", path,
+                number, word);
+        status = -1;
+        break;
+      }
+      think(s);
+      status = press(s, k->bytes, strlen(k->bytes), k->class);
+    }
+    if (status == -1)
+      fprintf(stderr, "shellax-keys: %s:%d: no answer from the shell\n", path,
+              number);
+  }
+  fclose(file);
+  return status;
+}
+
+/**
+ * Start the shell on a new pseudo-terminal, in a scratch directory
+ * @return 0, -1 on error
+ */
+int start_shell(struct session *s, const char *shellax, const char *dir) {
+  s->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (s->master == -1 || grantpt(s->master) == -1 || unlockpt(s->master) == -1) {
+    perror("shellax-keys: posix_openpt");
+    return -1;
+  }
+  struct winsize ws = {.ws_row = 50, .ws_col = 200};
+  ioctl(s->master, TIOCSWINSZ, &ws);
+  char *slave = ptsname(s->master);
+  s->pid = fork();
+  if (s->pid == -1) {
+    perror("shellax-keys: fork");
+    return -1;
+  }
+  if (s->pid == 0) {
+    setsid(); // the pty becomes the controlling terminal
+    int fd = open(slave, O_RDWR);
+    if (fd == -1 || chdir(dir) == -1)
+      _exit(127);
+    for (int i = 0; i < 3; i++)
+      dup2(fd, i);
+    if (fd > 2)
+      close(fd);
+    setenv("USER", "keys", 1);
+    setenv("TERM", "xterm", 1);
+    execl(shellax, "shellax", (char *)NULL);
+    _exit(127);
+  }
+  if (wait_prompt(s) == -1) {
+    fprintf(stderr, "shellax-keys: %s: no prompt\n", shellax);
+    return -1;
+  }
+  return 0;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Nearest-rank percentile of sorted values
+ */
+double percentile(const double *sorted, int count, double p) {
+  int rank = (int)(p / 100 * count + 0.999999);
+  return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+/**
+ * Close a round: keep the p99 of the samples it added
+ */
+void end_round() {
+  for (int c = 0; c < CLASSES; c++) {
+    struct samples *v = &samples[c];
+    int n = v->count - v->round_start;
+    if (n == 0 || v->rounds == ROUNDS_MAX)
+      continue;
+    double *round = malloc(n * sizeof(double));
+    memcpy(round, v->ms + v->round_start, n * sizeof(double));
+    qsort(round, n, sizeof(double), compare_doubles);
+    v->round_p99[v->rounds++] = percentile(round, n, 99);
+    v->round_start = v->count;
+    free(round);
+  }
+}
+
+/**
+ * The p99 the gate uses: median over the rounds
+ */
+double gate_p99(struct samples *v) {
+  double sorted[ROUNDS_MAX];
+  memcpy(sorted, v->round_p99, v->rounds * sizeof(double));
+  qsort(sorted, v->rounds, sizeof(double), compare_doubles);
+  return percentile(sorted, v->rounds, 50);
+}
+
+/**
+ * Compare p99s against a baseline file ("class p99_ms" per line)
+ * @return number of regressions, -1 if the baseline cannot be read
+ */
+int check_baseline(const char *path, double tolerance, double noise) {
+  FILE *file = fopen(path, "re");
+  if (!file) {
+    fprintf(stderr, "shellax-keys: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  char name[32];
+  double base;
+  int regressions = 0;
+  while (fscanf(file, "%31s %lf", name, &base) == 2) {
+    for (int c = 0; c < CLASSES; c++) {
+      if (strcmp(name, class_names[c]) != 0 || samples[c].rounds == 0)
+        continue;
+      double p99 = gate_p99(&samples[c]);
+      double limit = base * (1 + tolerance / 100) + noise;
+      bool bad = p99 > limit;
+      fprintf(stderr, "shellax-keys: %-8s p99 %8.3f ms, baseline %8.3f ms, limit %8.3f ms%s\n",
+              name, p99, base, limit, bad ? "  REGRESSION" : "");
+      regressions += bad;
+    }
+  }
+  fclose(file);
+  return regressions;
+}
+
+int save_baseline(const char *path) {
+  FILE *file = fopen(path, "we");
+  if (!file) {
+    fprintf(stderr, "shellax-keys: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  for (int c = 0; c < CLASSES; c++)
+    if (samples[c].rounds)
+      fprintf(file, "%s %.3f\n", class_names[c], gate_p99(&samples[c]));
+  fclose(file);
+  return 0;
+}
+
+/**
+ * Record a script: relay the terminal to a shell on a pty and write each key
+ * with the think time before it
+ */
+int record(const char *path, const char *shellax) {
+  FILE *out = fopen(path, "we");
+  struct termios saved, raw;
+  if (!out || tcgetattr(STDIN_FILENO, &saved) == -1) {
+    fprintf(stderr, "shellax-keys: %s: %s\n", out ? "stdin" : path,
+            out ? "not a terminal" : strerror(errno));
+    return 1;
+  }
+  char dir[] = "/tmp/shellax-keys-XXXXXX";
+  struct session s = {0};
+  if (!mkdtemp(dir) || start_shell(&s, shellax, dir) == -1)
+    return 1;
+  fprintf(stderr, "recording to %s; exit the shell to stop\n", path);
+  if (write(STDOUT_FILENO, s.tail, s.tail_len) == -1)
+    return 1;
+  raw = saved;
+  cfmakeraw(&raw);
+  tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+  fprintf(out, "# recorded by shellax-keys -r\npace 0 0\n");
+  double last = now_ms();
+  struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {s.master, POLLIN, 0}};
+  while (poll(fds, 2, -1) > 0) {
+    char buf[256];
+    if (fds[1].revents & (POLLIN | POLLHUP)) {
+      ssize_t n = read(s.master, buf, sizeof(buf));
+      if (n <= 0 || write(STDOUT_FILENO, buf, n) == -1)
+        break;
+    }
+    if (!(fds[0].revents & POLLIN))
+      continue;
+    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    if (n <= 0 || write(s.master, buf, n) != n)
+      break;
+    double now = now_ms();
+    fprintf(out, "pause %.0f\n", now - last);
+    last = now;
+    if (n == 1 && buf[0] >= ' ' && buf[0] < 127) {
+      fprintf(out, "type %c\n", buf[0]);
+      continue;
+    }
+    struct named_key *k = named_keys;
+    while (k->name && (strlen(k->bytes) != (size_t)n || memcmp(k->bytes, buf, n)))
+      k++;
+    if (k->name) {
+      fprintf(out, "%s\n", k->name);
+      continue;
+    }
+    fprintf(out, "raw ");
+    for (ssize_t i = 0; i < n; i++)
+      fprintf(out, buf[i] == 27 ? "\\e" : buf[i] == '\\' ? "\\\\" : "\\x%02x",
+              (unsigned char)buf[i]);
+    fprintf(out, "\n");
+  }
+  tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+  fclose(out);
+  waitpid(s.pid, NULL, 0);
+  rmdir(dir);
+  return 0;
+}
+
+int usage() {
+  fprintf(stderr, "usage: shellax-keys [-b baseline] [-s baseline] [-t percent] "
+                  "[-m ms] [-n rounds] [-v] [-x shellax] script.keys...\n"
+                  "       shellax-keys [-x shellax] -r script.keys\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  const char *baseline = NULL, *save = NULL, *recording = NULL,
+             *shellax = "./shellax";
+  double tolerance = 25, noise = NOISE_MS;
+  int opt, rounds = 1;
+  bool verbose = false;
+  while ((opt = getopt(argc, argv, "b:s:t:m:n:vx:r:")) != -1) {
+    switch (opt) {
+    case 'n': rounds = atoi(optarg); break;
+    case 'v': verbose = true; break;
+    case 'b': baseline = optarg; break;
+    case 's': save = optarg; break;
+    case 't': tolerance = atof(optarg); break;
+    case 'm': noise = atof(optarg); break;
+    case 'x': shellax = optarg; break;
+    case 'r': recording = optarg; break;
+    default: return usage();
+    }
+  }
+  char binary[4096];
+  if (!realpath(shellax, binary)) { // the shell runs in a scratch directory
+    fprintf(stderr, "shellax-keys: %s: %s\n", shellax, strerror(errno));
+    return 2;
+  }
+  if (recording)
+    return record(recording, binary);
+  if (optind == argc)
+    return usage();
+
+  char dir[] = "/tmp/shellax-keys-XXXXXX";
+  struct session s = {
+      .pace = 60, .jitter = 30, .scale = 1, .seed = 42, .verbose = verbose};
+  if (getenv("KEYS_PACE_SCALE"))
+    s.scale = atof(getenv("KEYS_PACE_SCALE"));
+  signal(SIGPIPE, SIG_IGN);
+  if (!mkdtemp(dir) || start_shell(&s, binary, dir) == -1)
+    return 2;
+  int status = 0;
+  for (int round = 0; round < rounds && status == 0; round++) {
+    for (int i = optind; i < argc && status == 0; i++) {
+      fprintf(stderr, "shellax-keys: %s\n", argv[i]);
+      status = replay(&s, argv[i]);
+    }
+    end_round();
+  }
+  if (status == 0 && write(s.master, "exit\r", 5) == 5)
+    while (read_output(&s, ANSWER_TIMEOUT) > 0) // until the pty hangs up
+      ;
+  kill(s.pid, SIGKILL);
+  waitpid(s.pid, NULL, 0);
+  close(s.master);
+  char clean[64];
+  snprintf(clean, sizeof(clean), "rm -rf %s", dir);
+  if (system(clean) != 0)
+    fprintf(stderr, "shellax-keys: could not remove %s\n", dir);
+  if (status == -1)
+    return 2;
+
+  printf("{\"suite\": \"shellax-keys\", \"timestamp\": %ld, \"results\": [",
+         (long)time(NULL));
+  const char *sep = "";
+  for (int c = 0; c < CLASSES; c++) {
+    struct samples *v = &samples[c];
+    if (!v->count)
+      continue;
+    qsort(v->ms, v->count, sizeof(double), compare_doubles);
+    const char *stats[4] = {"p50", "p90", "p99", "max"};
+    double values[4] = {percentile(v->ms, v->count, 50),
+                        percentile(v->ms, v->count, 90),
+                        percentile(v->ms, v->count, 99), v->ms[v->count - 1]};
+    for (int k = 0; k < 4; k++) {
+      printf("%s\n  {\"name\": \"%s_%s\", \"value\": %.3f, \"unit\": \"ms\", "
+             "\"iterations\": %d}",
+             sep, class_names[c], stats[k], values[k], v->count);
+      sep = ",";
+    }
+  }
+  printf("\n]}\n");
+  if (save && save_baseline(save) == -1)
+    return 2;
+  if (baseline) {
+    int regressions = check_baseline(baseline, tolerance, noise);
+    if (regressions != 0)
+      return regressions > 0 ? 1 : 2;
+  }
+  return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Pipeline throughput against stage placement (the pin builtin).
+#
+#   bench/pin.sh [size_mb]
+#
+# Streams size_mb MiB (default 512) through `cat | /bin/cat | /bin/cat` with
+# the scheduler's own placement, automatic placement (pin -a), stages spread
+# over the first and last allowed CPU (usually another core or socket), all
+# stages on one CPU, and SCHED_BATCH. Prints MB/s for each.
+# SHELLAX selects the binary (default ./shellax, built on demand).
+set -e
+
+cd "$(dirname "$0")/.."
+SHELLAX=${SHELLAX:-./shellax}
+SIZE_MB=${1:-512}
+
+if [ ! -x "$SHELLAX" ]; then
+  ${CC:-cc} -O2 -pthread -o "$SHELLAX" shellax-skeleton.c
+fi
+
+DATA=$(mktemp)
+trap 'rm -f "$DATA"' EXIT
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom >"$DATA"
+cat "$DATA" >/dev/null # warm the page cache
+
+FIRST=$(awk '/^Cpus_allowed_list/ { split($2, a, /[-,]/); print a[1] }' /proc/self/status)
+LAST=$(awk '/^Cpus_allowed_list/ { n = split($2, a, /[-,]/); print a[n] }' /proc/self/status)
+
+run() {
+  label=$1
+  shift
+  start=$(date +%s%N)
+  printf '%s cat %s | /bin/cat | /bin/cat >/dev/null\nexit\n' "$*" "$DATA" |
+    "$SHELLAX" >/dev/null
+  end=$(date +%s%N)
+  awk -v l="$label" -v mb="$SIZE_MB" -v ns=$((end - start)) \
+    'BEGIN { printf "%-12s %10.1f\n", l, mb / (ns / 1e9) }'
+}
+
+printf '%-12s %10s\n' placement MB/s
+run default ""
+run auto "pin -a"
+run spread "pin -c $FIRST:$LAST:$FIRST"
+run one-cpu "pin -c $FIRST"
+run batch "pin -s batch"
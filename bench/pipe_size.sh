@@ -0,0 +1,34 @@
+#!/bin/sh
+# Pipeline throughput against pipe capacity (SHELLAX_PIPE_SIZE).
+#
+#   bench/pipe_size.sh [size_mb] [pipe sizes...]
+#
+# Streams size_mb MiB (default 512) through `cat | /bin/cat | /bin/cat`, so
+# every byte crosses two kernel pipes, once per pipe size, and prints MB/s.
+# SHELLAX selects the binary (default ./shellax, built on demand).
+set -e
+
+cd "$(dirname "$0")/.."
+SHELLAX=${SHELLAX:-./shellax}
+SIZE_MB=${1:-512}
+[ $# -gt 0 ] && shift
+SIZES=${*:-"4k 16k 64k 256k 1M"}
+
+if [ ! -x "$SHELLAX" ]; then
+  ${CC:-cc} -O2 -pthread -o "$SHELLAX" shellax-skeleton.c
+fi
+
+DATA=$(mktemp)
+trap 'rm -f "$DATA"' EXIT
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom >"$DATA"
+cat "$DATA" >/dev/null # warm the page cache
+
+printf '%-10s %10s\n' pipe_size MB/s
+for size in $SIZES; do
+  start=$(date +%s%N)
+  printf 'cat %s | /bin/cat | /bin/cat >/dev/null\nexit\n' "$DATA" |
+    SHELLAX_PIPE_SIZE=$size "$SHELLAX" >/dev/null
+  end=$(date +%s%N)
+  awk -v s="$size" -v mb="$SIZE_MB" -v ns=$((end - start)) \
+    'BEGIN { printf "%-10s %10.1f\n", s, mb / (ns / 1e9) }'
+done
@@ -0,0 +1,67 @@
+#!/bin/sh
+# Long-session soak test: run many pipelines in one shell and check that it
+# does not leak descriptors or memory.
+#
+#   bench/soak.sh [pipelines]
+#
+# Runs `pipelines` (default 100000) pipelines in a single shellax session, a
+# mix of in-process builtin pipelines, forked pipelines, command substitution
+# and here-strings. After a warm-up round, `fdstat -s` is sampled before and
+# after the run: the open descriptor count must not change, no descriptor may
+# be inherited by children, and the resident set may grow by at most
+# SOAK_RSS_SLACK_KB (default 1024). Malformed glob words (an unclosed '[')
+# must come through as themselves. Exits non-zero on failure.
+# SHELLAX selects the binary (default ./shellax, built on demand).
+set -e
+
+cd "$(dirname "$0")/.."
+SHELLAX=${SHELLAX:-./shellax}
+PIPELINES=${1:-100000}
+SLACK_KB=${SOAK_RSS_SLACK_KB:-1024}
+
+if [ ! -x "$SHELLAX" ]; then
+  ${CC:-cc} -O2 -pthread -o "$SHELLAX" shellax-skeleton.c
+fi
+
+DATA=$(mktemp)
+OUT=$(mktemp)
+trap 'rm -f "$DATA" "$OUT"' EXIT
+seq 1 200 | sed 's/^/line /' >"$DATA"
+
+# four pipelines per iteration
+body="cat $DATA | str upper | myuniq -c >/dev/null; \
+cat $DATA | /bin/cat | str lower >/dev/null; \
+echo \$(first $DATA 1) >/dev/null; \
+str upper <<< soak | /bin/cat >/dev/null"
+
+start=$(date +%s)
+# the warm-up also walks a range as long as the real one, so that the heap
+# already holds the loop's word list when the baseline is taken
+printf '%s\n' \
+  "for i in {1..$((PIPELINES / 4))}; do str upper <<< warm >/dev/null; done" \
+  "for i in {1..250}; do $body; done" \
+  "fdstat -s" \
+  "for i in {1..$((PIPELINES / 4))}; do $body; done" \
+  "fdstat -s" \
+  "echo glob: a[b foo[" \
+  exit | "$SHELLAX" >"$OUT" 2>&1
+end=$(date +%s)
+
+if ! grep -q 'glob: a\[b foo\[$' "$OUT"; then
+  echo "soak: FAIL unclosed '[' in a word"
+  exit 1
+fi
+
+grep -o 'fds=[0-9]* inherited=[0-9]* rss_kb=[0-9]*' "$OUT" | tr '=' ' ' |
+  awk -v pipelines="$PIPELINES" -v slack="$SLACK_KB" -v secs=$((end - start)) '
+    { fds[NR] = $2; inherited[NR] = $4; rss[NR] = $6 }
+    END {
+      if (NR != 2) { print "soak: shell did not report fdstat"; exit 1 }
+      printf "soak: %d pipelines in %ds\n", pipelines, secs
+      printf "soak: fds %d -> %d, inherited %d, rss %d KiB -> %d KiB\n",
+             fds[1], fds[2], inherited[2], rss[1], rss[2]
+      if (fds[2] != fds[1]) { print "soak: FAIL descriptor count changed"; exit 1 }
+      if (inherited[2] > 0) { print "soak: FAIL descriptors leak into children"; exit 1 }
+      if (rss[2] - rss[1] > slack) { print "soak: FAIL resident set grew"; exit 1 }
+      print "soak: ok"
+    }'
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,10 +12,29 @@
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <limits.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <linux/module.h>    /* Definition of MODULE_* constants */
 #include <sys/syscall.h>     /* Definition of SYS_* constants */
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 const char *sysname = "shellax";
 
 enum return_codes {
@@ -29,6 +50,8 @@ struct command_t {
   int arg_count;
   char **args;
   char *redirects[3];     // in/out redirection
+  char *here_doc;         // input of << and <<<
+  bool here_expand;       // expand variables in here_doc
   struct command_t *next; // for piping
 };
 
@@ -67,6 +90,7 @@ int free_command(struct command_t *command) {
   for (int i = 0; i < 3; ++i)
     if (command->redirects[i])
       free(command->redirects[i]);
+  free(command->here_doc);
   if (command->next) {
     free_command(command->next);
     command->next = NULL;
@@ -76,16 +100,144 @@ int free_command(struct command_t *command) {
   return 0;
 }
 /**
- * Show the command prompt
- * @return [description]
+ * Deep copy of a pipeline
+ * @param  command pipeline to copy
+ * @param  from    leading arguments of the first stage to leave out, so that
+ *                 `time cmd args` can run a copy of `cmd args`
+ * @return         the copy
  */
-int show_prompt() {
-  char cwd[1024], hostname[1024];
-  gethostname(hostname, sizeof(hostname));
-  getcwd(cwd, sizeof(cwd));
-  printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-  return 0;
+struct command_t *copy_command(struct command_t *command, int from) {
+  struct command_t *copy = calloc(1, sizeof(struct command_t));
+  copy->background = command->background;
+  copy->auto_complete = command->auto_complete;
+  copy->arg_count = command->arg_count - from;
+  copy->args = calloc(copy->arg_count, sizeof(char *));
+  for (int i = 0; i < copy->arg_count - 1; i++)
+    copy->args[i] = strdup(command->args[i + from]);
+  copy->name = strdup(copy->args[0] ? copy->args[0] : "");
+  for (int i = 0; i < 3; i++)
+    if (command->redirects[i])
+      copy->redirects[i] = strdup(command->redirects[i]);
+  if (command->here_doc)
+    copy->here_doc = strdup(command->here_doc);
+  copy->here_expand = command->here_expand;
+  if (command->next)
+    copy->next = copy_command(command->next, 0);
+  return copy;
+}
+/*
+ * Bodies of the here-documents of the line being parsed, in order of
+ * appearance, read by the prompt before the line is parsed
+ */
+struct here_docs {
+  char **bodies;
+  int count, next;
+};
+
+struct here_docs pending_here_docs = {0};
+
+/**
+ * Skip a quoted string or a $(...) substitution
+ * @param  p start of the quote or of "$("
+ * @return   position right after it (the end of the string if it is open)
+ */
+const char *skip_quoted(const char *p) {
+  if (*p == '"' || *p == '\'') {
+    const char *close = strchr(p + 1, *p);
+    return close ? close + 1 : p + strlen(p);
+  }
+  int depth = 0;
+  for (p++; *p;) {
+    if (*p == '"' || *p == '\'') {
+      p = skip_quoted(p);
+      continue;
+    }
+    if (*p == '(')
+      depth++;
+    else if (*p == ')' && --depth == 0)
+      return p + 1;
+    p++;
+  }
+  return p;
+}
+
+bool starts_quoted(const char *p) {
+  return *p == '"' || *p == '\'' || (p[0] == '$' && p[1] == '(');
+}
+
+/**
+ * Split the next blank-separated word off a line, like strtok(), but keep
+ * quoted strings and $(...) in one word
+ * @param  cursor position in the line, moved past the word
+ * @return        the word, terminated in place; NULL at the end of the line
+ */
+char *next_word(char **cursor) {
+  char *p = *cursor;
+  while (*p == ' ' || *p == '\t')
+    p++;
+  if (*p == 0) {
+    *cursor = p;
+    return NULL;
+  }
+  char *word = p;
+  while (*p && *p != ' ' && *p != '\t') {
+    if (*p == '\\' && p[1])
+      p += 2; // escaped character
+    else
+      p = starts_quoted(p) ? (char *)skip_quoted(p) : p + 1;
+  }
+  if (*p)
+    *p++ = 0;
+  *cursor = p;
+  return word;
+}
+
+bool is_name_char(char c, bool first) {
+  return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (!first && c >= '0' && c <= '9');
+}
+
+/**
+ * Drop the quotes of a word. What expansion would act on inside them is
+ * escaped with a backslash (expand_globs removes the escapes); "$NAME" becomes
+ * ${NAME} so that the closing quote still ends the name.
+ * @return malloc'd word
+ */
+char *unquote_word(const char *word) {
+  char *unquoted = malloc(3 * strlen(word) + 1), *e = unquoted;
+  for (const char *a = word; *a;) {
+    if (*a == '"' || *a == '\'') {
+      const char *end = skip_quoted(a);
+      bool single = *a == '\'';
+      const char *special = single ? "\\$*?[" : "\\*?[";
+      const char *stop = end > a + 1 && end[-1] == *a ? end - 1 : end;
+      for (a++; a < stop; a++) {
+        if (!single && *a == '$' && is_name_char(a[1], true)) {
+          *e++ = '$';
+          *e++ = '{';
+          for (a++; a < stop && is_name_char(*a, false); a++)
+            *e++ = *a;
+          *e++ = '}';
+          a--;
+          continue;
+        }
+        if (strchr(special, *a))
+          *e++ = '\\';
+        *e++ = *a;
+      }
+      a = end;
+    } else {
+      const char *end = starts_quoted(a)          ? skip_quoted(a)
+                        : *a == '\\' && a[1] != 0 ? a + 2
+                                                  : a + 1;
+      while (a < end)
+        *e++ = *a++;
+    }
+  }
+  *e = 0;
+  return unquoted;
 }
+
 /**
  * Parse a command string into a command struct
  * @param  buf     [description]
@@ -94,7 +246,7 @@ int show_prompt() {
  */
 int parse_command(char *buf, struct command_t *command) {
   const char *splitters = " \t"; // split at whitespace
-  int index, len;
+  int len;
   len = strlen(buf);
   while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
   {
@@ -109,7 +261,8 @@ int parse_command(char *buf, struct command_t *command) {
   if (len > 0 && buf[len - 1] == '&') // background
     command->background = true;
 
-  char *pch = strtok(buf, splitters);
+  char *cursor = buf;
+  char *pch = next_word(&cursor);
   if (pch == NULL) {
     command->name = (char *)malloc(1);
     command->name[0] = 0;
@@ -122,14 +275,13 @@ int parse_command(char *buf, struct command_t *command) {
 
   int redirect_index;
   int arg_index = 0;
-  char temp_buf[1024], *arg;
+  char *arg;
   while (1) {
     // tokenize input on splitters
-    pch = strtok(NULL, splitters);
+    pch = next_word(&cursor);
     if (!pch)
       break;
-    arg = temp_buf;
-    strcpy(arg, pch);
+    arg = pch;
     len = strlen(arg);
 
     if (len == 0)
@@ -146,23 +298,49 @@ int parse_command(char *buf, struct command_t *command) {
 
     // piping to another command
     if (strcmp(arg, "|") == 0) {
-      struct command_t *c = malloc(sizeof(struct command_t));
-      int l = strlen(pch);
-      pch[l] = splitters[0]; // restore strtok termination
-      index = 1;
-      while (pch[index] == ' ' || pch[index] == '\t')
-        index++; // skip whitespaces
-
-      parse_command(pch + index, c);
-      pch[l] = 0; // put back strtok termination
+      struct command_t *c = calloc(1, sizeof(struct command_t));
+      parse_command(cursor, c); // the rest of the line
       command->next = c;
-      continue;
+      break;
     }
 
     // background process
     if (strcmp(arg, "&") == 0)
       continue; // handled before
 
+    // here-string (<<< word) and here-document (<< DELIMITER): the body of a
+    // here-document was read by the prompt and is queued in pending_here_docs
+    if (strncmp(arg, "<<", 2) == 0) {
+      bool here_string = arg[2] == '<';
+      const char *word = arg + 2 + here_string;
+      if (*word == 0) {
+        pch = next_word(&cursor);
+        if (!pch)
+          break;
+        word = pch;
+      }
+      free(command->here_doc);
+      free(command->redirects[0]);
+      command->redirects[0] = NULL;
+      if (here_string) {
+        size_t n = strlen(word);
+        if (n > 1 && (word[0] == '"' || word[0] == '\'') && word[n - 1] == word[0]) {
+          word++;
+          n -= 2;
+        }
+        command->here_doc = malloc(n + 2);
+        memcpy(command->here_doc, word, n);
+        strcpy(command->here_doc + n, "\n");
+        command->here_expand = true;
+      } else {
+        // a quoted delimiter keeps the body literal
+        command->here_expand = strpbrk(word, "\"'") == NULL;
+        struct here_docs *q = &pending_here_docs;
+        command->here_doc = strdup(q->next < q->count ? q->bodies[q->next++] : "");
+      }
+      continue;
+    }
+
     // handle input redirection
     redirect_index = -1;
     if (arg[0] == '<')
@@ -176,23 +354,26 @@ int parse_command(char *buf, struct command_t *command) {
         redirect_index = 1;
     }
     if (redirect_index != -1) {
-      command->redirects[redirect_index] = malloc(len);
-      strcpy(command->redirects[redirect_index], arg + 1);
+      const char *target = arg + 1;
+      if (*target == 0) { // "< file": the target is the next word
+        pch = next_word(&cursor);
+        if (!pch)
+          break;
+        target = pch;
+      }
+      free(command->redirects[redirect_index]);
+      command->redirects[redirect_index] = unquote_word(target);
+      if (redirect_index == 0) {
+        free(command->here_doc);
+        command->here_doc = NULL;
+      }
       continue;
     }
 
     // normal arguments
-    if (len > 2 &&
-        ((arg[0] == '"' && arg[len - 1] == '"') ||
-         (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-    {
-      arg[--len] = 0;
-      arg++;
-    }
     command->args =
         (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-    command->args[arg_index] = (char *)malloc(len + 1);
-    strcpy(command->args[arg_index++], arg);
+    command->args[arg_index++] = unquote_word(arg);
   }
   command->arg_count = arg_index;
 
@@ -212,564 +393,7294 @@ int parse_command(char *buf, struct command_t *command) {
   return 0;
 }
 
-void prompt_backspace() {
-  putchar(8);   // go back 1
-  putchar(' '); // write empty over
-  putchar(8);   // go back 1 again
+/*
+ * Execution tracing: SHELLAX_TRACE=file.json writes Chrome trace events
+ * (viewable in Perfetto or chrome://tracing). Events are formatted into one
+ * buffer and written with a single write() to a file opened with O_APPEND, so
+ * forked children can add their own events (resolve, exec) safely.
+ */
+int trace_fd = -1;
+pid_t trace_owner = 0; // the shell process, which closes the trace
+
+/**
+ * Microseconds on the monotonic clock (the trace's time base)
+ */
+uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
+
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Copy a string into a JSON string body, escaping as needed
  */
-int prompt(struct command_t *command) {
-  int index = 0;
-  char c;
-  char buf[4096];
-  static char oldbuf[4096];
+void json_escape(const char *in, char *out, size_t size) {
+  size_t n = 0;
+  for (; *in && n + 7 < size; in++) {
+    unsigned char c = *in;
+    if (c == '"' || c == '\\') {
+      out[n++] = '\\';
+      out[n++] = c;
+    } else if (c < 0x20) {
+      n += snprintf(out + n, size - n, "\\u%04x", c);
+    } else {
+      out[n++] = c;
+    }
+  }
+  out[n] = 0;
+}
 
-  // tcgetattr gets the parameters of the current terminal
-  // STDIN_FILENO will tell tcgetattr that it should write the settings
-  // of stdin to oldt
-  static struct termios backup_termios, new_termios;
-  tcgetattr(STDIN_FILENO, &backup_termios);
-  new_termios = backup_termios;
-  // ICANON normally takes care that one line at a time will be processed
-  // that means it will return if it sees a "\n" or an EOF or an EOL
-  new_termios.c_lflag &=
-      ~(ICANON |
-        ECHO); // Also disable automatic echo. We manually echo each char.
-  // Those new settings will be set to STDIN
-  // TCSANOW tells tcsetattr to change attributes immediately.
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+/**
+ * Record an event
+ * @param name  event name (escaped here)
+ * @param cat   category
+ * @param start start time from trace_now()
+ * @param dur   duration in microseconds, or -1 for an instant event
+ * @param args  JSON object body for "args" (without braces), or NULL
+ */
+void trace_event(const char *name, const char *cat, uint64_t start,
+                 int64_t dur, const char *args) {
+  if (trace_fd == -1)
+    return;
+  char escaped[256], event[1024];
+  json_escape(name, escaped, sizeof(escaped));
+  int n = snprintf(event, sizeof(event),
+                   "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%s\", "
+                   "\"ts\": %llu, ",
+                   escaped, cat, dur < 0 ? "i" : "X",
+                   (unsigned long long)start);
+  if (dur >= 0)
+    n += snprintf(event + n, sizeof(event) - n, "\"dur\": %lld, ",
+                  (long long)dur);
+  else
+    n += snprintf(event + n, sizeof(event) - n, "\"s\": \"t\", ");
+  n += snprintf(event + n, sizeof(event) - n,
+                "\"pid\": %d, \"tid\": %d, \"args\": {%s}},\n", trace_owner,
+                gettid(), args ? args : "");
+  if (n >= (int)sizeof(event))
+    return; // oversized arguments: drop the event rather than corrupt the file
+  write(trace_fd, event, n);
+}
 
-  show_prompt();
-  buf[0] = 0;
-  while (1) {
-    c = getchar();
-    // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+/**
+ * Record a span that ends now
+ */
+void trace_span(const char *name, const char *cat, uint64_t start,
+                const char *args) {
+  if (trace_fd != -1)
+    trace_event(name, cat, start, trace_now() - start, args);
+}
 
-    if (c == 9) // handle tab
-    {
-      buf[index++] = '?'; // autocomplete
-      break;
+/**
+ * Format the resource usage of a finished stage as trace arguments
+ */
+void trace_rusage_args(char *args, size_t size, pid_t pid, int status,
+                       const struct rusage *ru) {
+  snprintf(args, size,
+           "\"pid\": %d, \"status\": %d, \"user_ms\": %.3f, \"sys_ms\": %.3f, "
+           "\"max_rss_kb\": %ld, \"voluntary_cs\": %ld, "
+           "\"involuntary_cs\": %ld",
+           pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+           ru->ru_utime.tv_sec * 1e3 + ru->ru_utime.tv_usec / 1e3,
+           ru->ru_stime.tv_sec * 1e3 + ru->ru_stime.tv_usec / 1e3,
+           ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+}
+
+void trace_close() {
+  if (trace_fd == -1 || getpid() != trace_owner)
+    return;
+  // the final event carries no trailing comma, which closes the array
+  char end[256];
+  int n = snprintf(end, sizeof(end),
+                   "{\"name\": \"exit\", \"cat\": \"shell\", \"ph\": \"i\", "
+                   "\"ts\": %llu, \"s\": \"g\", \"pid\": %d, \"tid\": %d}\n]\n",
+                   (unsigned long long)trace_now(), trace_owner, gettid());
+  write(trace_fd, end, n);
+  close(trace_fd);
+  trace_fd = -1;
+}
+
+/**
+ * Start tracing if SHELLAX_TRACE names an output file
+ */
+void trace_open() {
+  char *path = getenv("SHELLAX_TRACE");
+  if (!path || !*path)
+    return;
+  trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (trace_fd == -1) {
+    fprintf(stderr, "-%s: SHELLAX_TRACE: %s: %s\n", sysname, path,
+            strerror(errno));
+    return;
+  }
+  trace_owner = getpid();
+  write(trace_fd, "[\n", 2);
+  char args[64];
+  snprintf(args, sizeof(args), "\"name\": \"%s\"", sysname);
+  char meta[256];
+  int n = snprintf(meta, sizeof(meta),
+                   "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+                   "\"args\": {%s}},\n",
+                   trace_owner, args);
+  write(trace_fd, meta, n);
+  atexit(trace_close);
+}
+
+int process_command(struct command_t *command);
+bool is_stream_builtin(struct command_t *command);
+struct node_t;
+int parse_line(const char *line, struct node_t **tree);
+int run_node(struct node_t *node);
+
+/**
+ * Rebuild a command line from a parsed command, so that it can be stored and
+ * parsed again later. Arguments before `from` in the first command are
+ * skipped (e.g. the builtin name and its options).
+ * @param  command pipeline head
+ * @param  from    index of the first argument of `command` to keep
+ * @return         malloc'd command line
+ */
+char *command_to_string(struct command_t *command, int from) {
+  size_t len = 0, cap = 256;
+  char *line = malloc(cap);
+  const char *redirect_ops[3] = {"<", ">", ">>"};
+  line[0] = 0;
+  for (struct command_t *c = command; c; c = c->next) {
+    const char *parts[2];
+    char *quoted = NULL;
+    for (int i = (c == command ? from : 0); i < c->arg_count + 3; i++) {
+      int n = 0;
+      free(quoted);
+      quoted = NULL;
+      const char *word = NULL;
+      if (i < c->arg_count - 1 && c->args[i]) {
+        word = c->args[i];
+      } else if (i >= c->arg_count && c->redirects[i - c->arg_count]) {
+        parts[n++] = redirect_ops[i - c->arg_count];
+        word = c->redirects[i - c->arg_count];
+      }
+      if (!word)
+        continue;
+      if (strpbrk(word, " \t;&|<>\"'")) {
+        // escape what would split the word when it is parsed again
+        char *e = quoted = malloc(2 * strlen(word) + 1);
+        for (const char *w = word; *w; w++) {
+          if (*w == '\\' && w[1])
+            *e++ = *w++;
+          else if (strchr(" \t;&|<>\"'", *w))
+            *e++ = '\\';
+          *e++ = *w;
+        }
+        *e = 0;
+        word = quoted;
+      }
+      parts[n++] = word;
+      size_t need = len + strlen(parts[0]) + (n > 1 ? strlen(parts[1]) : 0) + 4;
+      if (need > cap) {
+        cap = need * 2;
+        line = realloc(line, cap);
+      }
+      if (len > 0)
+        line[len++] = ' ';
+      for (int k = 0; k < n; k++) {
+        strcpy(line + len, parts[k]);
+        len += strlen(parts[k]);
+      }
     }
+    free(quoted);
+    if (c->next) {
+      if (len + 4 > cap)
+        line = realloc(line, cap = cap * 2 + 4);
+      strcpy(line + len, " |");
+      len += 2;
+    }
+  }
+  return line;
+}
 
-    if (c == 127) // handle backspace
-    {
-      if (index > 0) {
-        prompt_backspace();
-        index--;
+/**
+ * Growable byte buffer
+ */
+struct buffer {
+  char *data;
+  size_t len, cap;
+};
+
+void buffer_append(struct buffer *b, const char *data, size_t len) {
+  if (b->len + len > b->cap) {
+    b->cap = (b->len + len) * 2;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+}
+
+/**
+ * Hash a byte string (64-bit multiply-xorshift over 8-byte words)
+ */
+uint64_t hash_bytes(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len, k;
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&k, p, 8);
+    h = (h ^ k) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  k = 0;
+  memcpy(&k, p, len);
+  h = (h ^ k) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 29);
+}
+
+/*
+ * Session statistics: every command's latency goes into a log-linear
+ * (HDR-style) histogram kept per command name. Values are microseconds;
+ * buckets below 64us are exact and every power of two above is split into 32
+ * sub-buckets, so any value is recorded within ~3% at O(1) cost.
+ */
+#define HIST_HALF 32
+#define HIST_BUCKETS ((64 - 6 + 1) * HIST_HALF + HIST_HALF)
+#define STATS_SLOTS 256
+
+struct histogram {
+  char *name;
+  uint64_t count, max;
+  uint32_t buckets[HIST_BUCKETS];
+};
+
+struct histogram *command_stats[STATS_SLOTS];
+
+int hist_index(uint64_t v) {
+  if (v < 2 * HIST_HALF)
+    return v;
+  int shift = 63 - __builtin_clzll(v) - 5; // log2(HIST_HALF)
+  return shift * HIST_HALF + (int)(v >> shift);
+}
+
+/**
+ * Lowest value that falls into a bucket
+ */
+uint64_t hist_value(int index) {
+  if (index < 2 * HIST_HALF)
+    return index;
+  int shift = index / HIST_HALF - 1;
+  return (uint64_t)(index - shift * HIST_HALF) << shift;
+}
+
+/**
+ * Record one latency for a command name
+ */
+void record_latency(const char *name, uint64_t us) {
+  if (!*name)
+    return;
+  size_t slot = hash_bytes(name, strlen(name)) % STATS_SLOTS;
+  while (command_stats[slot] && strcmp(command_stats[slot]->name, name) != 0)
+    slot = (slot + 1) % STATS_SLOTS;
+  struct histogram *h = command_stats[slot];
+  if (!h) {
+    for (size_t used = 0, i = 0; i < STATS_SLOTS; i++)
+      if (command_stats[i] && ++used == STATS_SLOTS - 1)
+        return; // table full, keep the last slot free for probing
+    h = command_stats[slot] = calloc(1, sizeof(struct histogram));
+    h->name = strdup(name);
+  }
+  h->buckets[hist_index(us)]++;
+  h->count++;
+  if (us > h->max)
+    h->max = us;
+}
+
+/**
+ * Value at a percentile (0-100), as the midpoint of its bucket
+ */
+uint64_t hist_percentile(struct histogram *h, double percentile) {
+  uint64_t rank = (uint64_t)(h->count * percentile / 100.0 + 0.5), seen = 0;
+  if (rank == 0)
+    rank = 1;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      uint64_t low = hist_value(i);
+      uint64_t high = i + 1 < HIST_BUCKETS ? hist_value(i + 1) : h->max;
+      uint64_t mid = low + (high - low) / 2;
+      return mid < h->max ? mid : h->max;
+    }
+  }
+  return h->max;
+}
+
+/**
+ * Format a duration in microseconds with a readable unit
+ */
+void format_duration(char *buf, size_t size, double us) {
+  if (us < 1000)
+    snprintf(buf, size, "%.0fus", us);
+  else if (us < 1000000)
+    snprintf(buf, size, "%.2fms", us / 1e3);
+  else
+    snprintf(buf, size, "%.3fs", us / 1e6);
+}
+
+void format_size(char *buf, size_t size, double bytes) {
+  if (bytes < 1024)
+    snprintf(buf, size, "%.0fB", bytes);
+  else if (bytes < 1 << 20)
+    snprintf(buf, size, "%.1fKiB", bytes / 1024);
+  else if (bytes < 1 << 30)
+    snprintf(buf, size, "%.1fMiB", bytes / (1 << 20));
+  else
+    snprintf(buf, size, "%.2fGiB", bytes / (1 << 30));
+}
+
+int compare_by_count(const void *a, const void *b) {
+  const struct histogram *x = *(struct histogram **)a, *y = *(struct histogram **)b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : strcmp(x->name, y->name);
+}
+
+/**
+ * stats [-r]: latency percentiles of every command run in this session,
+ * most frequent first; -r resets them
+ */
+int stats_command(struct command_t *command, FILE *in, FILE *out) {
+  if (command->args[1] && strcmp(command->args[1], "-r") == 0) {
+    for (int i = 0; i < STATS_SLOTS; i++) {
+      if (command_stats[i]) {
+        free(command_stats[i]->name);
+        free(command_stats[i]);
+        command_stats[i] = NULL;
       }
+    }
+    return 0;
+  }
+  struct histogram *sorted[STATS_SLOTS];
+  int n = 0;
+  for (int i = 0; i < STATS_SLOTS; i++)
+    if (command_stats[i])
+      sorted[n++] = command_stats[i];
+  qsort(sorted, n, sizeof(sorted[0]), compare_by_count);
+  fprintf(out, "%-16s %8s %10s %10s %10s %10s\n", "command", "count", "p50",
+          "p90", "p99", "max");
+  for (int i = 0; i < n; i++) {
+    char p50[16], p90[16], p99[16], max[16];
+    format_duration(p50, sizeof(p50), hist_percentile(sorted[i], 50));
+    format_duration(p90, sizeof(p90), hist_percentile(sorted[i], 90));
+    format_duration(p99, sizeof(p99), hist_percentile(sorted[i], 99));
+    format_duration(max, sizeof(max), sorted[i]->max);
+    fprintf(out, "%-16s %8llu %10s %10s %10s %10s\n", sorted[i]->name,
+            (unsigned long long)sorted[i]->count, p50, p90, p99, max);
+  }
+  return 0;
+}
+
+/*
+ * Per-stage timings for the `time` builtin. While collecting, the executor
+ * reports every stage it reaps (and every builtin thread it joins) here.
+ */
+struct stage_time {
+  char name[64];
+  double wall, user, sys; // seconds
+  long max_rss_kb;
+};
+
+struct stage_time *stage_times = NULL; // non-NULL while `time` is collecting
+int stage_time_count = 0, stage_time_capacity = 0;
+pthread_mutex_t stage_time_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void record_stage_time(const char *name, uint64_t start,
+                       const struct rusage *ru) {
+  pthread_mutex_lock(&stage_time_lock);
+  if (stage_times && stage_time_count < stage_time_capacity) {
+    struct stage_time *t = &stage_times[stage_time_count++];
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->wall = (trace_now() - start) / 1e6;
+    t->user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    t->sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    t->max_rss_kb = ru->ru_maxrss;
+  }
+  pthread_mutex_unlock(&stage_time_lock);
+}
+
+void print_stage_time(const char *name, double wall, double user, double sys,
+                      long max_rss_kb) {
+  fprintf(stderr, "%-16s %9.3fs %9.3fs %9.3fs %10.1f MB\n", name, wall, user,
+          sys, max_rss_kb / 1024.0);
+}
+
+/**
+ * time <command...>: run a command or pipeline and report wall, user and sys
+ * time and max RSS, per stage and in total, on stderr
+ */
+int time_command(struct command_t *command) {
+  if (command->arg_count < 3) {
+    fprintf(stderr, "usage: time <command...>\n");
+    return SUCCESS;
+  }
+  struct command_t *inner = copy_command(command, 1);
+
+  struct stage_time times[64];
+  struct rusage self_before, self_after, children_before, children_after;
+  pthread_mutex_lock(&stage_time_lock);
+  stage_times = times;
+  stage_time_count = 0;
+  stage_time_capacity = 64;
+  pthread_mutex_unlock(&stage_time_lock);
+  getrusage(RUSAGE_SELF, &self_before);
+  getrusage(RUSAGE_CHILDREN, &children_before);
+  uint64_t start = trace_now();
+
+  int code = process_command(inner);
+
+  double wall = (trace_now() - start) / 1e6;
+  getrusage(RUSAGE_SELF, &self_after);
+  getrusage(RUSAGE_CHILDREN, &children_after);
+  pthread_mutex_lock(&stage_time_lock);
+  stage_times = NULL;
+  pthread_mutex_unlock(&stage_time_lock);
+
+#define TV(tv) ((tv).tv_sec + (tv).tv_usec / 1e6)
+  double user = TV(self_after.ru_utime) - TV(self_before.ru_utime) +
+                TV(children_after.ru_utime) - TV(children_before.ru_utime);
+  double sys = TV(self_after.ru_stime) - TV(self_before.ru_stime) +
+               TV(children_after.ru_stime) - TV(children_before.ru_stime);
+#undef TV
+  long max_rss = 0;
+  fprintf(stderr, "%-16s %10s %10s %10s %13s\n", "stage", "wall", "user",
+          "sys", "max rss");
+  for (int i = 0; i < stage_time_count; i++) {
+    print_stage_time(times[i].name, times[i].wall, times[i].user, times[i].sys,
+                     times[i].max_rss_kb);
+    if (times[i].max_rss_kb > max_rss)
+      max_rss = times[i].max_rss_kb;
+  }
+  if (stage_time_count == 0) // ran inside the shell
+    max_rss = self_after.ru_maxrss;
+  print_stage_time("total", wall, user, sys, max_rss);
+  free_command(inner);
+  return code;
+}
+
+/**
+ * Search PATH for a command, the way execvp() does
+ * @param  dirs PATH value
+ * @param  name command name, without '/'
+ * @return      0 if an executable was found, -1 otherwise
+ */
+int search_path(const char *dirs, const char *name, char *path, size_t size) {
+  struct stat st;
+  while (1) {
+    const char *end = strchrnul(dirs, ':');
+    int len = end - dirs;
+    // an empty PATH entry means the current directory
+    snprintf(path, size, "%.*s/%s", len ? len : 1, len ? dirs : ".", name);
+    if (access(path, X_OK) == 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode))
+      return 0;
+    if (*end == 0)
+      break;
+    dirs = end + 1;
+  }
+  return -1;
+}
+
+/*
+ * Resolved commands, by PATH and name, like the hash table of other shells.
+ * A hit costs no system call: the parent resolves each command before it
+ * forks, so the entry outlives the child, and exec_command searches PATH
+ * again when exec fails on a cached path (the command moved or went away).
+ * `hash` lists the table, `hash -r` empties it.
+ */
+#define PATH_CACHE_SLOTS 1024
+#define PATH_CACHE_MAX 8192 // flush the table beyond this
+
+struct path_entry {
+  struct path_entry *next; // hash chain
+  char *dirs;              // the PATH it was found with
+  char *name, *path;
+  long hits;
+};
+
+struct path_entry *path_cache[PATH_CACHE_SLOTS];
+int path_cache_count = 0;
+
+void path_cache_flush() {
+  for (int i = 0; i < PATH_CACHE_SLOTS; i++) {
+    while (path_cache[i]) {
+      struct path_entry *e = path_cache[i];
+      path_cache[i] = e->next;
+      free(e->dirs);
+      free(e->name);
+      free(e->path);
+      free(e);
+    }
+  }
+  path_cache_count = 0;
+}
+
+/**
+ * Resolve a command name against a PATH value, through the cache
+ * @return 0 if an executable was found, -1 otherwise (errno is set)
+ */
+int resolve_in(const char *dirs, const char *name, char *path, size_t size) {
+  if (strchr(name, '/')) {
+    snprintf(path, size, "%s", name);
+    return access(path, X_OK);
+  }
+  size_t slot = (hash_bytes(name, strlen(name)) ^ hash_bytes(dirs, strlen(dirs))) %
+                PATH_CACHE_SLOTS;
+  for (struct path_entry *e = path_cache[slot]; e; e = e->next) {
+    // the key is compared in full: a hash collision is only a miss
+    if (strcmp(e->name, name) == 0 && strcmp(e->dirs, dirs) == 0) {
+      e->hits++;
+      snprintf(path, size, "%s", e->path);
+      return 0;
+    }
+  }
+  if (search_path(dirs, name, path, size) == -1) {
+    errno = ENOENT; // misses are not cached: the command may be installed
+    return -1;
+  }
+  if (path_cache_count >= PATH_CACHE_MAX)
+    path_cache_flush();
+  struct path_entry *e = calloc(1, sizeof(struct path_entry));
+  if (!e || !(e->dirs = strdup(dirs)) || !(e->name = strdup(name)) ||
+      !(e->path = strdup(path))) {
+    if (e) { // found all the same, just not remembered
+      free(e->dirs);
+      free(e->name);
+    }
+    free(e);
+    return 0;
+  }
+  e->next = path_cache[slot];
+  path_cache[slot] = e;
+  path_cache_count++;
+  return 0;
+}
+
+/**
+ * Resolve a command name against PATH
+ * @param  name command name; a name containing '/' is used as it is
+ * @param  path buffer for the resolved path
+ * @param  size size of the buffer
+ * @return      0 if an executable was found, -1 otherwise (errno is set)
+ */
+int resolve_command(const char *name, char *path, size_t size) {
+  const char *dirs = getenv("PATH");
+  return resolve_in(dirs ? dirs : "/usr/local/bin:/usr/bin:/bin", name, path,
+                    size);
+}
+
+/**
+ * Resolve a command in the parent before forking it, so that the entry stays
+ * in this process's cache for the next time
+ */
+void prime_command(struct command_t *command) {
+  char path[PATH_MAX];
+  if (command->name[0] && !strchr(command->name, '$'))
+    resolve_command(command->name, path, sizeof(path));
+}
+
+int hash_command(struct command_t *command) {
+  if (command->arg_count > 2 && strcmp(command->args[1], "-r") == 0) {
+    path_cache_flush();
+    return SUCCESS;
+  }
+  if (path_cache_count == 0) {
+    printf("hash: hash table empty\n");
+    return SUCCESS;
+  }
+  printf("hits\tcommand\n");
+  for (int i = 0; i < PATH_CACHE_SLOTS; i++)
+    for (struct path_entry *e = path_cache[i]; e; e = e->next)
+      printf("%4ld\t%s\n", e->hits, e->path);
+  return SUCCESS;
+}
+
+/**
+ * Replace the current (child) process with an external command
+ * @param command command to run; does not return
+ */
+void exec_command(struct command_t *command) {
+  char path[PATH_MAX], args[PATH_MAX + 16] = "";
+  uint64_t start = trace_now();
+  int r = resolve_command(command->args[0], path, sizeof(path));
+  if (trace_fd != -1) {
+    char escaped[PATH_MAX];
+    json_escape(path, escaped, sizeof(escaped));
+    snprintf(args, sizeof(args), "\"path\": \"%s\"", escaped);
+  }
+  trace_span("resolve", "exec", start, args);
+  if (r == 0) {
+    trace_event("exec", "exec", trace_now(), -1, args);
+    execv(path, command->args);
+    // a stale cache entry: search again
+    const char *dirs = getenv("PATH");
+    if (!strchr(command->args[0], '/') &&
+        search_path(dirs ? dirs : "/usr/local/bin:/usr/bin:/bin",
+                    command->args[0], path, sizeof(path)) == 0)
+      execv(path, command->args);
+    else
+      errno = ENOENT;
+  }
+  if (errno == ENOENT)
+    fprintf(stderr, "-%s: %s: command not found\n", sysname, command->name);
+  else
+    fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(errno));
+  exit(127);
+}
+
+// exit status of the last foreground command (128 + signal if it was killed)
+int last_status = 0;
+
+/**
+ * Exit status of a command from a wait() status
+ */
+int exit_code(int status) {
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * Wait for a child and record its stage in the trace
+ * @param  pid   child to wait for, -1 for any
+ * @param  start fork time of the child (trace_now())
+ * @param  name  stage name
+ * @return       pid of the reaped child, -1 on error
+ */
+pid_t wait_stage(pid_t pid, int *status, uint64_t start, const char *name) {
+  struct rusage ru;
+  pid_t r;
+  while ((r = wait4(pid, status, 0, &ru)) == -1 && errno == EINTR)
+    ;
+  if (r > 0 && trace_fd != -1) {
+    char args[256];
+    trace_rusage_args(args, sizeof(args), r, *status, &ru);
+    trace_span(name, "stage", start, args);
+  }
+  if (r > 0 && stage_times)
+    record_stage_time(name, start, &ru);
+  return r;
+}
+
+/*
+ * Anonymous in-memory files (memfd) for here-documents and scratch data, so
+ * the shell never writes temporary files to disk or to the user's directory.
+ */
+
+/**
+ * An in-memory file holding `data`, sealed against any further change and
+ * positioned at its start
+ * @return descriptor (close-on-exec), -1 on error
+ */
+int sealed_memfd(const char *name, const char *data, size_t len) {
+  int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return -1;
+  for (size_t done = 0; done < len;) {
+    ssize_t n = write(fd, data + done, len - done);
+    if (n < 0 && errno == EINTR)
       continue;
+    if (n < 0) {
+      close(fd);
+      return -1;
     }
+    done += n;
+  }
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+/**
+ * Run a /bin/sh command line with its output captured in memory
+ * @return stream over the sealed output, NULL on error
+ */
+FILE *capture_output(const char *cmdline) {
+  int fd = memfd_create("shellax-scratch", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return NULL;
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fd, STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", cmdline, (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  lseek(fd, 0, SEEK_SET);
+  return fdopen(fd, "r");
+}
+
+/**
+ * Run a /bin/sh command line reading its stdin from a descriptor
+ * @return exit status of the command
+ */
+int run_with_input(const char *cmdline, int fd) {
+  int status = 0;
+  lseek(fd, 0, SEEK_SET);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fd, STDIN_FILENO);
+    execl("/bin/sh", "sh", "-c", cmdline, (char *)NULL);
+    _exit(127);
+  }
+  if (pid > 0)
+    waitpid(pid, &status, 0);
+  return exit_code(status);
+}
+
+/**
+ * Open the input of a stage: its here-document or its `<` file
+ * @return descriptor (close-on-exec), -1 on error (reported on stderr)
+ */
+int open_input(struct command_t *command) {
+  int fd;
+  if (command->here_doc)
+    fd = sealed_memfd("shellax-heredoc", command->here_doc,
+                      strlen(command->here_doc));
+  else
+    fd = open(command->redirects[0], O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    fprintf(stderr, "-%s: %s: %s\n", sysname,
+            command->here_doc ? "here-document" : command->redirects[0],
+            strerror(errno));
+  return fd;
+}
+
+bool has_input(struct command_t *command) {
+  return command->here_doc || command->redirects[0];
+}
+
+/**
+ * Replace stdin with the input of a stage (in a forked child)
+ * @return 0 on success, -1 on error
+ */
+int redirect_input(struct command_t *command) {
+  int fd = open_input(command);
+  if (fd == -1)
+    return -1;
+  dup2(fd, STDIN_FILENO);
+  close(fd);
+  return 0;
+}
+
+/*
+ * Glob expansion (*, ?, [...] and recursive **).
+ * Directory listings are read with getdents64 and cached by absolute path;
+ * a cached listing is reused as long as the directory's mtime and ctime are
+ * unchanged, so repeated expansions in the same tree only cost one stat per
+ * directory. Each pattern is split into path components and compiled once.
+ */
+#define GLOB_CACHE_SLOTS 4096
+#define GLOB_CACHE_MAX_NAMES (4 << 20) // flush the cache beyond this
+#define GETDENTS_BUFFER (256 * 1024)
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct glob_dir {
+  struct glob_dir *next; // hash chain
+  char *path;
+  struct timespec mtime, ctime;
+  int count;
+  char **names; // sorted, point into arena; names[i][-1] is the d_type
+  char *arena;
+};
+
+struct glob_dir *glob_cache[GLOB_CACHE_SLOTS];
+long glob_cache_names = 0;
+
+void glob_cache_flush() {
+  for (int i = 0; i < GLOB_CACHE_SLOTS; i++) {
+    while (glob_cache[i]) {
+      struct glob_dir *d = glob_cache[i];
+      glob_cache[i] = d->next;
+      free(d->path);
+      free(d->names);
+      free(d->arena);
+      free(d);
+    }
+  }
+  glob_cache_names = 0;
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char **)a, *(char **)b);
+}
+
+/**
+ * Read a directory listing into a cache entry
+ * @return 0 on success, -1 if the directory cannot be read
+ */
+int glob_read_dir(struct glob_dir *d) {
+  int fd = open(d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  char *buf = malloc(GETDENTS_BUFFER);
+  // arena records are the d_type byte followed by the NUL-terminated name
+  size_t arena_len = 0, arena_cap = 4096;
+  char *arena = malloc(arena_cap);
+  int count = 0, cap = 64;
+  size_t *offsets = malloc(cap * sizeof(size_t));
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUFFER)) > 0) {
+    for (long pos = 0; pos < n;) {
+      struct linux_dirent64 *e = (struct linux_dirent64 *)(buf + pos);
+      pos += e->d_reclen;
+      if (e->d_name[0] == '.' &&
+          (e->d_name[1] == 0 || (e->d_name[1] == '.' && e->d_name[2] == 0)))
+        continue;
+      size_t len = strlen(e->d_name) + 1;
+      if (arena_len + len + 1 > arena_cap)
+        arena = realloc(arena, arena_cap = (arena_len + len + 1) * 2);
+      arena[arena_len] = e->d_type;
+      memcpy(arena + arena_len + 1, e->d_name, len);
+      if (count == cap)
+        offsets = realloc(offsets, (cap *= 2) * sizeof(size_t));
+      offsets[count++] = arena_len + 1;
+      arena_len += len + 1;
+    }
+  }
+  close(fd);
+  free(buf);
+  // pointers are taken once the arena has stopped moving
+  d->names = malloc((count ? count : 1) * sizeof(char *));
+  for (int i = 0; i < count; i++)
+    d->names[i] = arena + offsets[i];
+  free(offsets);
+  qsort(d->names, count, sizeof(char *), compare_strings);
+  d->arena = arena;
+  d->count = count;
+  glob_cache_names += count;
+  return n < 0 ? -1 : 0;
+}
+
+/**
+ * Listing of a directory, from the cache when it is still valid
+ * @param  path absolute directory path
+ * @return      listing, or NULL if the directory cannot be read
+ */
+struct glob_dir *glob_scan(const char *path) {
+  struct stat st;
+  if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+    return NULL;
+  size_t slot = hash_bytes(path, strlen(path)) % GLOB_CACHE_SLOTS;
+  struct glob_dir **link = &glob_cache[slot];
+  for (struct glob_dir *d = *link; d; link = &d->next, d = d->next) {
+    if (strcmp(d->path, path) != 0)
+      continue;
+    if (d->mtime.tv_sec == st.st_mtim.tv_sec &&
+        d->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        d->ctime.tv_sec == st.st_ctim.tv_sec &&
+        d->ctime.tv_nsec == st.st_ctim.tv_nsec)
+      return d;
+    // stale: drop it and read the directory again
+    *link = d->next;
+    glob_cache_names -= d->count;
+    free(d->path);
+    free(d->names);
+    free(d->arena);
+    free(d);
+    break;
+  }
+  if (glob_cache_names > GLOB_CACHE_MAX_NAMES)
+    glob_cache_flush();
+  struct glob_dir *d = calloc(1, sizeof(struct glob_dir));
+  d->path = strdup(path);
+  d->mtime = st.st_mtim;
+  d->ctime = st.st_ctim;
+  if (glob_read_dir(d) == -1) {
+    free(d->path);
+    free(d->names);
+    free(d->arena);
+    free(d);
+    return NULL;
+  }
+  d->next = glob_cache[slot];
+  glob_cache[slot] = d;
+  return d;
+}
+
+/*
+ * Compiled pattern: one token list per path component
+ */
+enum glob_token_type { GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_token {
+  enum glob_token_type type;
+  const char *text; // GLOB_LITERAL
+  int len;
+  uint64_t set[4]; // GLOB_CLASS: bitmap of accepted bytes
+};
+
+struct glob_part {
+  char *text;   // component as written (unescaped for literals)
+  bool literal; // no wildcards: appended without a directory scan
+  bool globstar;
+  bool dot;     // may match names starting with '.'
+  int count;
+  struct glob_token *tokens;
+};
+
+struct glob_pattern {
+  bool absolute, dirs_only;
+  int count;
+  struct glob_part *parts;
+};
+
+/**
+ * Whether a word has a wildcard that is not escaped with a backslash
+ */
+bool has_glob_chars(const char *s) {
+  for (s = strpbrk(s, "\\*?["); s; s = strpbrk(s + 1, "\\*?[")) {
+    if (*s != '\\')
+      return true;
+    if (*++s == 0)
+      break;
+  }
+  return false;
+}
+
+/**
+ * Remove backslash escapes in place
+ */
+void unescape(char *s) {
+  char *out = s;
+  for (; *s; s++) {
+    if (*s == '\\' && s[1])
+      s++;
+    *out++ = *s;
+  }
+  *out = 0;
+}
+
+void glob_compile_part(struct glob_part *part) {
+  const char *p = part->text;
+  part->dot = p[0] == '.';
+  part->tokens = malloc((strlen(p) + 1) * sizeof(struct glob_token));
+  part->count = 0;
+  while (*p) {
+    struct glob_token *t = &part->tokens[part->count++];
+    memset(t, 0, sizeof(*t));
+    if (*p == '*') {
+      t->type = GLOB_STAR;
+      while (*p == '*')
+        p++;
+    } else if (*p == '?') {
+      t->type = GLOB_ANY;
+      p++;
+    } else if (*p == '[' && p[1] && strchr(p + 2, ']')) {
+      t->type = GLOB_CLASS;
+      p++;
+      bool negate = *p == '!' || *p == '^';
+      if (negate)
+        p++;
+      // a ']' right after the opening bracket is a member
+      do {
+        unsigned char lo = *p, hi = lo;
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+          hi = p[2];
+          p += 2;
+        }
+        for (unsigned c = lo; c <= hi; c++)
+          t->set[c >> 6] |= 1ULL << (c & 63);
+        p++;
+      } while (*p && *p != ']');
+      if (*p == ']')
+        p++;
+      if (negate)
+        for (int i = 0; i < 4; i++)
+          t->set[i] = ~t->set[i];
+      t->set[0] &= ~1ULL; // never NUL
+    } else if (*p == '\\' && p[1]) {
+      t->type = GLOB_LITERAL; // escaped character
+      t->text = p + 1;
+      t->len = 1;
+      p += 2;
+    } else {
+      // the first character is taken as is: it may be a '[' that is never
+      // closed or a trailing backslash
+      t->type = GLOB_LITERAL;
+      t->text = p++;
+      while (*p && *p != '*' && *p != '?' && *p != '[' && *p != '\\')
+        p++;
+      t->len = p - t->text;
+    }
+  }
+}
+
+/**
+ * Match one compiled component against a name. Stars backtrack to the most
+ * recent one only, which is enough for glob patterns.
+ */
+bool glob_match_tokens(const struct glob_token *tokens, int count,
+                       const char *name) {
+  int ti = 0, star = -1;
+  const char *n = name, *star_name = NULL;
+  while (1) {
+    if (ti < count) {
+      const struct glob_token *t = &tokens[ti];
+      if (t->type == GLOB_STAR) {
+        star = ti++;
+        star_name = n;
+        continue;
+      }
+      if (*n) {
+        unsigned char c = *n;
+        if (t->type == GLOB_ANY ||
+            (t->type == GLOB_CLASS && (t->set[c >> 6] >> (c & 63)) & 1)) {
+          ti++;
+          n++;
+          continue;
+        }
+        if (t->type == GLOB_LITERAL && strncmp(n, t->text, t->len) == 0) {
+          ti++;
+          n += t->len;
+          continue;
+        }
+      }
+    } else if (*n == 0) {
+      return true;
+    }
+    if (star < 0 || *star_name == 0)
+      return false;
+    // let the last star swallow one more character and retry
+    ti = star + 1;
+    n = ++star_name;
+  }
+}
+
+struct glob_pattern *glob_compile(const char *pattern) {
+  struct glob_pattern *g = calloc(1, sizeof(struct glob_pattern));
+  g->absolute = pattern[0] == '/';
+  size_t len = strlen(pattern);
+  g->dirs_only = len > 1 && pattern[len - 1] == '/';
+  char *copy = strdup(pattern), *save, *tok;
+  g->parts = calloc(len + 1, sizeof(struct glob_part));
+  for (tok = strtok_r(copy, "/", &save); tok; tok = strtok_r(NULL, "/", &save)) {
+    struct glob_part *part = &g->parts[g->count++];
+    part->text = strdup(tok);
+    part->globstar = strcmp(tok, "**") == 0;
+    part->literal = !part->globstar && !has_glob_chars(tok);
+    if (part->literal)
+      unescape(part->text);
+    else if (!part->globstar)
+      glob_compile_part(part);
+  }
+  free(copy);
+  return g;
+}
+
+void glob_free(struct glob_pattern *g) {
+  for (int i = 0; i < g->count; i++) {
+    free(g->parts[i].text);
+    free(g->parts[i].tokens);
+  }
+  free(g->parts);
+  free(g);
+}
+
+struct glob_results {
+  char **paths;
+  int count, cap;
+};
+
+void glob_add(struct glob_results *r, const char *path, bool slash) {
+  if (r->count == r->cap)
+    r->paths = realloc(r->paths, (r->cap = r->cap ? r->cap * 2 : 16) *
+                                     sizeof(char *));
+  size_t len = strlen(path);
+  char *copy = malloc(len + 2);
+  memcpy(copy, path, len);
+  if (slash)
+    copy[len++] = '/';
+  copy[len] = 0;
+  r->paths[r->count++] = copy;
+}
+
+/**
+ * Whether a directory entry is a directory (following symlinks, except when
+ * walking through **)
+ */
+bool glob_is_dir(const char *abs, unsigned char type, bool follow) {
+  struct stat st;
+  if (type == DT_DIR)
+    return true;
+  if (type == DT_UNKNOWN)
+    return (follow ? stat(abs, &st) : lstat(abs, &st)) == 0 &&
+           S_ISDIR(st.st_mode);
+  if (type == DT_LNK && follow)
+    return stat(abs, &st) == 0 && S_ISDIR(st.st_mode);
+  return false;
+}
+
+/**
+ * Expand pattern components from `part` on, below `path`
+ * @param rel  path as it will be printed (relative or absolute like the pattern)
+ * @param abs  the same directory as an absolute path, used for scans
+ */
+void glob_walk(struct glob_pattern *g, int part, char *rel, size_t rel_len,
+               char *abs, size_t abs_len, struct glob_results *r) {
+  if (part == g->count) {
+    struct stat st;
+    if (rel_len > 0 && lstat(abs, &st) == 0 &&
+        (!g->dirs_only || glob_is_dir(abs, DT_UNKNOWN, true)))
+      glob_add(r, rel, g->dirs_only);
+    return;
+  }
+  struct glob_part *gp = &g->parts[part];
+  bool last = part == g->count - 1;
+
+#define GLOB_JOIN(name)                                                        \
+  size_t name_len = strlen(name);                                              \
+  if (rel_len + name_len + 2 >= PATH_MAX || abs_len + name_len + 2 >= PATH_MAX) \
+    continue;                                                                  \
+  size_t new_rel = rel_len, new_abs = abs_len;                                 \
+  if (new_rel > 0 && rel[new_rel - 1] != '/')                                  \
+    rel[new_rel++] = '/';                                                      \
+  if (abs[new_abs - 1] != '/')                                                 \
+    abs[new_abs++] = '/';                                                      \
+  memcpy(rel + new_rel, name, name_len + 1);                                   \
+  memcpy(abs + new_abs, name, name_len + 1);                                   \
+  new_rel += name_len;                                                         \
+  new_abs += name_len;
+
+  if (gp->literal) {
+    for (int once = 1; once; once = 0) {
+      GLOB_JOIN(gp->text);
+      glob_walk(g, part + 1, rel, new_rel, abs, new_abs, r);
+    }
+  } else {
+    struct glob_dir *d = glob_scan(abs);
+    if (gp->globstar)
+      glob_walk(g, part + 1, rel, rel_len, abs, abs_len, r); // zero dirs
+    for (int i = 0; d && i < d->count; i++) {
+      const char *name = d->names[i];
+      if (name[0] == '.' && (gp->globstar || !gp->dot))
+        continue;
+      if (!gp->globstar && !glob_match_tokens(gp->tokens, gp->count, name))
+        continue;
+      GLOB_JOIN(name);
+      if (gp->globstar) {
+        if (glob_is_dir(abs, (unsigned char)d->names[i][-1], false))
+          glob_walk(g, part, rel, new_rel, abs, new_abs, r); // one level more
+      } else if (last) {
+        if (!g->dirs_only || glob_is_dir(abs, (unsigned char)d->names[i][-1], true))
+          glob_add(r, rel, g->dirs_only);
+      } else if (glob_is_dir(abs, (unsigned char)d->names[i][-1], true)) {
+        glob_walk(g, part + 1, rel, new_rel, abs, new_abs, r);
+      }
+    }
+  }
+#undef GLOB_JOIN
+  rel[rel_len] = 0;
+  abs[abs_len] = 0;
+}
+
+/**
+ * Expand a glob pattern
+ * @param  pattern pattern
+ * @param  count   number of matches
+ * @return         sorted, malloc'd array of matches (NULL if none)
+ */
+char **glob_expand(const char *pattern, int *count) {
+  struct glob_pattern *g = glob_compile(pattern);
+  struct glob_results r = {0};
+  char rel[PATH_MAX], abs[PATH_MAX];
+  size_t rel_len = 0, abs_len;
+  if (g->absolute) {
+    strcpy(rel, "/");
+    strcpy(abs, "/");
+    rel_len = abs_len = 1;
+  } else {
+    if (!getcwd(abs, sizeof(abs))) {
+      glob_free(g);
+      *count = 0;
+      return NULL;
+    }
+    abs_len = strlen(abs);
+    rel[0] = 0;
+  }
+  glob_walk(g, 0, rel, rel_len, abs, abs_len, &r);
+  glob_free(g);
+  // listings are sorted, so the walk usually emits sorted paths already
+  // (** and names that prefix their siblings can break the order)
+  for (int i = 1; i < r.count; i++) {
+    if (strcmp(r.paths[i - 1], r.paths[i]) > 0) {
+      qsort(r.paths, r.count, sizeof(char *), compare_strings);
+      break;
+    }
+  }
+  *count = r.count;
+  return r.paths;
+}
+
+/**
+ * Replace the glob patterns among a command's arguments with their matches;
+ * patterns without matches are kept as they are. Backslash escapes (left by
+ * quoting) are removed from every argument and redirection target.
+ */
+void expand_globs(struct command_t *command) {
+  bool any = false;
+  for (int i = 1; i < command->arg_count - 1; i++)
+    any |= has_glob_chars(command->args[i]);
+  if (strchr(command->args[0], '\\')) {
+    unescape(command->args[0]);
+    strcpy(command->name, command->args[0]);
+  }
+  for (int i = 0; i < 3; i++)
+    if (command->redirects[i] && strchr(command->redirects[i], '\\'))
+      unescape(command->redirects[i]);
+  if (!any) {
+    for (int i = 1; i < command->arg_count - 1; i++)
+      if (strchr(command->args[i], '\\'))
+        unescape(command->args[i]);
+    return;
+  }
+  int count = 1, cap = command->arg_count + 8;
+  char **args = malloc(cap * sizeof(char *));
+  args[0] = command->args[0];
+  for (int i = 1; i < command->arg_count - 1; i++) {
+    int matches = 0;
+    char **paths = has_glob_chars(command->args[i])
+                       ? glob_expand(command->args[i], &matches)
+                       : NULL;
+    if (count + matches + 2 > cap)
+      args = realloc(args, (cap = (count + matches) * 2 + 2) * sizeof(char *));
+    if (matches == 0) {
+      unescape(command->args[i]);
+      args[count++] = command->args[i];
+    } else {
+      free(command->args[i]);
+      memcpy(args + count, paths, matches * sizeof(char *));
+      count += matches;
+    }
+    free(paths);
+  }
+  args[count++] = NULL;
+  free(command->args);
+  command->args = args;
+  command->arg_count = count;
+}
+
+/*
+ * Timer scheduler: `every`, `at`, `timers` and `cancel`.
+ * Every timer owns a timerfd that is polled together with stdin while the
+ * shell waits for input in prompt(), so jobs fire from the shell's own event
+ * loop. A fired job is run by a forked copy of the shell through
+ * process_command(), i.e. the same executor interactive commands use.
+ */
+#define MAX_TIMERS 32
+
+struct timer_job {
+  int id;                    // 0 when the slot is free
+  int fd;                    // timerfd
+  bool repeat;               // `every` (true) or one-shot `at` (false)
+  bool wall_clock;           // armed against CLOCK_REALTIME
+  struct timespec interval;
+  unsigned long runs;
+  pid_t pid;                 // last launched job, 0 when reaped
+  char *cmdline;
+};
+
+struct timer_job timers[MAX_TIMERS];
+int next_timer_id = 1;
+
+// jobs that outlived their timer slot (a one-shot that fired, a cancelled
+// timer, an `every` run still going when the next one starts); they are
+// still our children and wait here to be reaped
+pid_t *detached_jobs = NULL;
+int detached_count = 0, detached_capacity = 0;
+
+/**
+ * Parse an interval such as 250ms, 1.5s, 10m, 2h or 1d (bare numbers are
+ * seconds)
+ * @param  str interval string
+ * @param  ts  parsed interval
+ * @return     0 on success, -1 if the interval is malformed or not positive
+ */
+int parse_interval(const char *str, struct timespec *ts) {
+  char *unit;
+  double seconds = strtod(str, &unit);
+  if (unit == str)
+    return -1;
+  if (strcmp(unit, "ms") == 0)
+    seconds /= 1000;
+  else if (strcmp(unit, "m") == 0 || strcmp(unit, "min") == 0)
+    seconds *= 60;
+  else if (strcmp(unit, "h") == 0)
+    seconds *= 3600;
+  else if (strcmp(unit, "d") == 0)
+    seconds *= 86400;
+  else if (strcmp(unit, "") != 0 && strcmp(unit, "s") != 0)
+    return -1;
+  if (!(seconds > 0))
+    return -1;
+  ts->tv_sec = (time_t)seconds;
+  ts->tv_nsec = (long)((seconds - ts->tv_sec) * 1e9);
+  if (ts->tv_sec == 0 && ts->tv_nsec == 0)
+    ts->tv_nsec = 1; // an all-zero it_value would disarm the timer
+  return 0;
+}
+
+/**
+ * Create and arm a timer
+ * @param  first      first expiration (relative, or absolute for wall_clock)
+ * @param  interval   repeat interval, NULL for a one-shot timer
+ * @param  wall_clock arm `first` as an absolute CLOCK_REALTIME time
+ * @param  cmdline    command line to run, ownership is taken
+ * @return            timer id, or -1 on error
+ */
+int add_timer(struct timespec first, const struct timespec *interval,
+              bool wall_clock, char *cmdline) {
+  struct timer_job *t = NULL;
+  for (int i = 0; i < MAX_TIMERS && !t; i++)
+    if (timers[i].id == 0)
+      t = &timers[i];
+  if (!t) {
+    printf("-%s: too many timers (max %d)\n", sysname, MAX_TIMERS);
+    free(cmdline);
+    return -1;
+  }
+  int fd = timerfd_create(wall_clock ? CLOCK_REALTIME : CLOCK_MONOTONIC,
+                          TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1) {
+    printf("-%s: timerfd_create: %s\n", sysname, strerror(errno));
+    free(cmdline);
+    return -1;
+  }
+  struct itimerspec spec = {0};
+  spec.it_value = first;
+  if (interval)
+    spec.it_interval = *interval;
+  if (timerfd_settime(fd, wall_clock ? TFD_TIMER_ABSTIME : 0, &spec, NULL) ==
+      -1) {
+    printf("-%s: timerfd_settime: %s\n", sysname, strerror(errno));
+    close(fd);
+    free(cmdline);
+    return -1;
+  }
+  memset(t, 0, sizeof(*t));
+  t->id = next_timer_id++;
+  t->fd = fd;
+  t->repeat = interval != NULL;
+  t->wall_clock = wall_clock;
+  if (interval)
+    t->interval = *interval;
+  t->cmdline = cmdline;
+  return t->id;
+}
+
+/**
+ * Keep a timer job's pid for reap_timer_jobs() once no slot refers to it
+ * @param pid job to reap later
+ */
+void detach_timer_job(pid_t pid) {
+  if (pid <= 0 || waitpid(pid, NULL, WNOHANG) != 0)
+    return;
+  if (detached_count == detached_capacity) {
+    int capacity = detached_capacity ? 2 * detached_capacity : 16;
+    pid_t *grown = realloc(detached_jobs, capacity * sizeof(*grown));
+    if (!grown) {
+      waitpid(pid, NULL, 0); // nowhere to keep it: reap it now
+      return;
+    }
+    detached_jobs = grown;
+    detached_capacity = capacity;
+  }
+  detached_jobs[detached_count++] = pid;
+}
+
+/**
+ * Stop a timer and release its slot. A job that is still running is left
+ * alone and reaped by reap_timer_jobs() when it finishes.
+ * @param t timer to cancel
+ */
+void cancel_timer(struct timer_job *t) {
+  detach_timer_job(t->pid);
+  close(t->fd);
+  free(t->cmdline);
+  memset(t, 0, sizeof(*t));
+}
+
+/**
+ * Reap finished timer jobs without blocking
+ * @return true while some job is still running
+ */
+bool reap_timer_jobs() {
+  bool running = false;
+  for (int i = 0; i < MAX_TIMERS; i++) {
+    if (timers[i].id && timers[i].pid > 0 &&
+        waitpid(timers[i].pid, NULL, WNOHANG) != 0)
+      timers[i].pid = 0;
+    running |= timers[i].id && timers[i].pid > 0;
+  }
+  int kept = 0;
+  for (int i = 0; i < detached_count; i++)
+    if (waitpid(detached_jobs[i], NULL, WNOHANG) == 0)
+      detached_jobs[kept++] = detached_jobs[i];
+  detached_count = kept;
+  return running || kept > 0;
+}
+
+/**
+ * Run a timer's command line in a forked copy of the shell
+ * @param t expired timer
+ */
+void run_timer_job(struct timer_job *t) {
+  uint64_t expirations;
+  if (read(t->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return; // spurious wakeup
+  t->runs++;
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+  } else if (pid == 0) {
+    // keep the job away from the keystrokes of the interactive prompt
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull != -1) {
+      dup2(devnull, STDIN_FILENO);
+      close(devnull);
+    }
+    struct node_t *tree;
+    parse_line(t->cmdline, &tree);
+    run_node(tree);
+    fflush(stdout);
+    _exit(0);
+  } else {
+    detach_timer_job(t->pid); // the previous run may not be done yet
+    t->pid = pid;
+  }
+  if (!t->repeat) // one-shot: the slot goes, the job is reaped later
+    cancel_timer(t);
+}
+
+/*
+ * The prompt: user@host:cwd (branch) [status] duration shellax$
+ * The hostname is read once and the cwd again only when cd changes it, so
+ * drawing the prompt costs one write(). The git branch can take a while to
+ * find (network file systems, deep trees), so a background thread looks it
+ * up: the prompt is drawn at once with the branch last seen for this
+ * directory, and drawn again in place, with the line typed so far, when the
+ * worker reports a different one through an eventfd polled by
+ * prompt_getchar. The status shows when it is not 0, the duration when the
+ * command took PROMPT_DURATION_MIN or more.
+ */
+#define PROMPT_DURATION_MIN 1000000 // us
+
+struct prompt_state {
+  bool started;
+  char hostname[256];
+  char cwd[PATH_MAX];
+  uint64_t duration; // us, of the last command
+  bool stale;        // a command ran since the branch was looked up
+  int event;         // eventfd, readable when the branch changed
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  char lookup[PATH_MAX];     // directory the worker should look at, "" if none
+  char branch_dir[PATH_MAX]; // directory `branch` was found for
+  char branch[256];
+  const char *line; // line being edited, NULL outside of prompt()
+  const int *line_len;
+} prompt_state = {.stale = true,
+                  .event = -1,
+                  .lock = PTHREAD_MUTEX_INITIALIZER,
+                  .wake = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Find the git branch (or the short commit when detached) of a directory
+ * @param branch set to "" outside of a repository
+ */
+void git_branch(const char *dir, char *branch, size_t size) {
+  char path[PATH_MAX + 16], head[PATH_MAX + 16];
+  snprintf(path, sizeof(path), "%s", dir);
+  branch[0] = 0;
+  for (;;) {
+    size_t len = strlen(path);
+    snprintf(path + len, sizeof(path) - len, "/.git/HEAD");
+    FILE *file = fopen(path, "re");
+    if (!file) { // a worktree or submodule: .git is a file naming the gitdir
+      snprintf(path + len, sizeof(path) - len, "/.git");
+      file = fopen(path, "re");
+      if (file && fscanf(file, "gitdir: %4095s", head) == 1) {
+        fclose(file);
+        if (head[0] == '/')
+          snprintf(path, sizeof(path), "%.4000s/HEAD", head);
+        else {
+          path[len] = 0;
+          snprintf(path + len, sizeof(path) - len, "/%.4000s/HEAD", head);
+        }
+        file = fopen(path, "re");
+      } else if (file) {
+        fclose(file);
+        file = NULL;
+      }
+    }
+    if (file) {
+      if (fgets(head, sizeof(head), file)) {
+        head[strcspn(head, "\n")] = 0;
+        if (strncmp(head, "ref: refs/heads/", 16) == 0)
+          snprintf(branch, size, "%s", head + 16);
+        else
+          snprintf(branch, size, "%.7s", head);
+      }
+      fclose(file);
+      return;
+    }
+    path[len] = 0;
+    char *slash = strrchr(path, '/');
+    if (!slash || slash == path)
+      return;
+    *slash = 0;
+  }
+}
+
+void *prompt_worker(void *arg) {
+  struct prompt_state *p = arg;
+  char dir[PATH_MAX], branch[256];
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->lookup[0])
+      pthread_cond_wait(&p->wake, &p->lock);
+    strcpy(dir, p->lookup);
+    p->lookup[0] = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    git_branch(dir, branch, sizeof(branch));
+
+    pthread_mutex_lock(&p->lock);
+    // redraw only if the prompt shows something else (no repository: nothing)
+    const char *shown = strcmp(p->branch_dir, dir) == 0 ? p->branch : "";
+    bool changed = strcmp(shown, branch) != 0;
+    strcpy(p->branch_dir, dir);
+    strcpy(p->branch, branch);
+    pthread_mutex_unlock(&p->lock);
+    uint64_t one = 1;
+    if (changed && write(p->event, &one, sizeof(one)) == -1)
+      continue;
+  }
+  return NULL;
+}
+
+/**
+ * Track the working directory after a successful chdir
+ */
+void prompt_chdir() {
+  if (!getcwd(prompt_state.cwd, sizeof(prompt_state.cwd)))
+    prompt_state.cwd[0] = 0;
+}
+
+/**
+ * Format the prompt, asking the worker to look the branch up again if a
+ * command ran since the last time
+ * @param lookup false to only format it (redraw after a lookup)
+ * @return length of the prompt
+ */
+int format_prompt(char *buf, size_t size, bool lookup) {
+  struct prompt_state *p = &prompt_state;
+  if (!p->started) {
+    p->started = true;
+    gethostname(p->hostname, sizeof(p->hostname) - 1);
+    prompt_chdir();
+    p->event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pthread_t worker;
+    if (p->event != -1 &&
+        pthread_create(&worker, NULL, prompt_worker, p) == 0)
+      pthread_detach(worker);
+    else
+      lookup = false;
+  }
+  const char *user = getenv("USER");
+  int len = snprintf(buf, size, "%s@%s:%s", user ? user : "", p->hostname, p->cwd);
+
+  pthread_mutex_lock(&p->lock);
+  if (p->branch[0] && strcmp(p->branch_dir, p->cwd) == 0)
+    len += snprintf(buf + len, size - len, " (%s)", p->branch);
+  if (lookup && p->stale && p->event != -1) {
+    strcpy(p->lookup, p->cwd);
+    pthread_cond_signal(&p->wake);
+    p->stale = false;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if (last_status != 0)
+    len += snprintf(buf + len, size - len, " [%d]", last_status);
+  if (p->duration >= PROMPT_DURATION_MIN)
+    len += snprintf(buf + len, size - len, " %.1fs", p->duration / 1e6);
+  len += snprintf(buf + len, size - len, " %s$ ", sysname);
+  return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * Show the command prompt
+ * @return 0
+ */
+int show_prompt() {
+  char buf[2 * PATH_MAX];
+  int len = format_prompt(buf, sizeof(buf), true);
+  fflush(stdout);
+  if (write(STDOUT_FILENO, buf, len) == -1)
+    return -1;
+  return 0;
+}
+
+/**
+ * Draw the prompt and the line typed so far again, after the branch changed.
+ * Only on a terminal, and not when the line wraps (\r reaches only the last
+ * row).
+ */
+void redraw_prompt() {
+  struct prompt_state *p = &prompt_state;
+  uint64_t count;
+  if (read(p->event, &count, sizeof(count)) == -1 || !p->line ||
+      !isatty(STDOUT_FILENO))
+    return;
+  char buf[2 * PATH_MAX + 4096] = "\r\033[K";
+  int len = 4 + format_prompt(buf + 4, 2 * PATH_MAX, false);
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 &&
+      len - 4 + *p->line_len >= ws.ws_col)
+    return;
+  memcpy(buf + len, p->line, *p->line_len);
+  len += *p->line_len;
+  fflush(stdout);
+  if (write(STDOUT_FILENO, buf, len) == -1)
+    return;
+}
+
+/**
+ * Read one character of user input, running expired timers while waiting.
+ * This is the shell's event loop: stdin, every timerfd and the prompt's
+ * eventfd are polled together.
+ * @return the character read, or 4 (Ctrl+D) on end of input
+ */
+int prompt_getchar() {
+  static char inbuf[4096];
+  static int inpos = 0, inlen = 0;
+  struct pollfd fds[MAX_TIMERS + 2];
+  struct timer_job *owners[MAX_TIMERS + 2];
+
+  while (inpos >= inlen) {
+    fflush(stdout);
+    // there is no SIGCHLD handler: while jobs run, wake up now and then to
+    // reap them so they do not linger as zombies at an idle prompt
+    int timeout = reap_timer_jobs() ? 100 : -1;
+    int nfds = 0;
+    fds[nfds].fd = STDIN_FILENO;
+    fds[nfds].events = POLLIN;
+    owners[nfds++] = NULL;
+    fds[nfds].fd = prompt_state.event; // ignored by poll when -1
+    fds[nfds].events = POLLIN;
+    owners[nfds++] = NULL;
+    for (int i = 0; i < MAX_TIMERS; i++) {
+      if (timers[i].id == 0)
+        continue;
+      fds[nfds].fd = timers[i].fd;
+      fds[nfds].events = POLLIN;
+      owners[nfds++] = &timers[i];
+    }
+    if (poll(fds, nfds, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      return 4;
+    }
+    if (fds[1].revents & POLLIN)
+      redraw_prompt();
+    for (int i = 2; i < nfds; i++)
+      if (fds[i].revents & POLLIN)
+        run_timer_job(owners[i]);
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(STDIN_FILENO, inbuf, sizeof(inbuf));
+      if (n <= 0 && !(n == -1 && errno == EINTR))
+        return 4;
+      inpos = 0;
+      inlen = n > 0 ? n : 0;
+    }
+  }
+  return (unsigned char)inbuf[inpos++];
+}
+
+/**
+ * Compute the next wall-clock occurrence of HH:MM[:SS]
+ * @param  str time of day
+ * @param  ts  absolute CLOCK_REALTIME time
+ * @return     0 on success, -1 if str is not a time of day
+ */
+int parse_time_of_day(const char *str, struct timespec *ts) {
+  int hour, min, sec = 0;
+  if (sscanf(str, "%d:%d:%d", &hour, &min, &sec) < 2 || hour < 0 ||
+      hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 59)
+    return -1;
+  time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  tm.tm_hour = hour;
+  tm.tm_min = min;
+  tm.tm_sec = sec;
+  tm.tm_isdst = -1;
+  time_t when = mktime(&tm);
+  if (when <= now) {
+    tm.tm_mday++; // already passed today, run tomorrow
+    tm.tm_isdst = -1;
+    when = mktime(&tm);
+  }
+  ts->tv_sec = when;
+  ts->tv_nsec = 0;
+  return 0;
+}
+
+/**
+ * Builtins of the timer scheduler:
+ *   every <interval> <command...>   run command repeatedly
+ *   at <HH:MM[:SS]|+interval> <command...>   run command once
+ *   timers                          list scheduled timers
+ *   cancel <id|all>                 remove timers
+ * @param  command parsed command
+ * @return         SUCCESS
+ */
+int scheduler_command(struct command_t *command) {
+  int argc = command->arg_count - 2; // arguments besides the name
+  struct timespec ts;
+
+  if (strcmp(command->name, "every") == 0 || strcmp(command->name, "at") == 0) {
+    bool every = command->name[0] == 'e';
+    if (argc < 2) {
+      printf("usage: %s\n", every ? "every <interval> <command...>"
+                                  : "at <HH:MM[:SS]|+interval> <command...>");
+      return SUCCESS;
+    }
+    const char *when = command->args[1];
+    bool wall_clock = false;
+    if (every || when[0] == '+') {
+      if (parse_interval(when + (when[0] == '+'), &ts) == -1) {
+        printf("-%s: %s: invalid interval '%s'\n", sysname, command->name, when);
+        return SUCCESS;
+      }
+    } else if (parse_time_of_day(when, &ts) == 0) {
+      wall_clock = true;
+    } else if (parse_interval(when, &ts) == -1) {
+      printf("-%s: at: invalid time '%s'\n", sysname, when);
+      return SUCCESS;
+    }
+    int id = add_timer(ts, every ? &ts : NULL, wall_clock,
+                       command_to_string(command, 2));
+    if (id != -1)
+      printf("[timer %d]\n", id);
+    return SUCCESS;
+  }
+
+  if (strcmp(command->name, "timers") == 0) {
+    for (int i = 0; i < MAX_TIMERS; i++) {
+      struct timer_job *t = &timers[i];
+      if (t->id == 0)
+        continue;
+      struct itimerspec cur;
+      timerfd_gettime(t->fd, &cur);
+      printf("%3d  %-5s  next in %.3fs", t->id, t->repeat ? "every" : "at",
+             cur.it_value.tv_sec + cur.it_value.tv_nsec / 1e9);
+      if (t->repeat)
+        printf("  interval %.3fs",
+               t->interval.tv_sec + t->interval.tv_nsec / 1e9);
+      printf("  runs %lu  %s\n", t->runs, t->cmdline);
+    }
+    return SUCCESS;
+  }
+
+  // cancel
+  if (argc < 1) {
+    printf("usage: cancel <id|all>\n");
+    return SUCCESS;
+  }
+  bool all = strcmp(command->args[1], "all") == 0;
+  int id = atoi(command->args[1]), found = 0;
+  for (int i = 0; i < MAX_TIMERS; i++) {
+    if (timers[i].id && (all || timers[i].id == id)) {
+      cancel_timer(&timers[i]);
+      found++;
+    }
+  }
+  if (!found && !all)
+    printf("-%s: cancel: no such timer: %s\n", sysname, command->args[1]);
+  return SUCCESS;
+}
+
+/*
+ * Command lists: `;`, `&&`, `||`, `for NAME in WORDS; do LIST; done` and
+ * `while LIST; do LIST; done`.
+ * A line is parsed once into a tree of nodes whose leaves are pipelines
+ * already parsed by parse_command(); loops run their bodies from the tree.
+ * A leaf that uses variables ($?, $$, $NAME, ${NAME}) or globs is copied and
+ * expanded each time it runs, any other leaf runs as it is.
+ */
+enum node_type { NODE_PIPELINE, NODE_SEQUENCE, NODE_AND, NODE_OR, NODE_FOR, NODE_WHILE };
+
+struct node_t {
+  enum node_type type;
+  struct command_t *pipeline; // NODE_PIPELINE
+  bool instantiate;           // the pipeline needs expanding before it runs
+  struct node_t *left, *right; // lists: both sides; while: condition, body
+  char *var;                  // NODE_FOR: loop variable, words and body (right)
+  char **words;
+  int word_count;
+};
+
+enum token_type { TOKEN_WORD, TOKEN_SEMI, TOKEN_AND, TOKEN_OR, TOKEN_END };
+
+struct token {
+  enum token_type type;
+  const char *start;
+  int len;
+};
+
+struct parser {
+  struct token *tokens;
+  int pos;
+  const char *error; // first syntax error
+};
+
+/*
+ * Shell variables (loop variables), looked up before the environment
+ */
+struct shell_var {
+  char *name, *value;
+  struct shell_var *next;
+};
+
+struct shell_var *shell_vars = NULL;
+
+void set_var(const char *name, const char *value) {
+  struct shell_var *v;
+  for (v = shell_vars; v; v = v->next)
+    if (strcmp(v->name, name) == 0)
+      break;
+  if (!v) {
+    v = calloc(1, sizeof(struct shell_var));
+    v->name = strdup(name);
+    v->next = shell_vars;
+    shell_vars = v;
+  }
+  free(v->value);
+  v->value = strdup(value);
+}
+
+const char *get_var(const char *name) {
+  for (struct shell_var *v = shell_vars; v; v = v->next)
+    if (strcmp(v->name, name) == 0)
+      return v->value;
+  return getenv(name);
+}
+
+char *command_substitution(const char *text, size_t len);
+
+/**
+ * Expand $?, $$, $NAME, ${NAME} and $(command) in a word; \$ is not expanded
+ * @return malloc'd expansion
+ */
+char *expand_vars(const char *word) {
+  struct buffer out = {0};
+  char name[256], number[24];
+  for (const char *p = word; *p;) {
+    const char *dollar = strpbrk(p, "$\\");
+    if (!dollar) {
+      buffer_append(&out, p, strlen(p));
+      break;
+    }
+    buffer_append(&out, p, dollar - p);
+    p = dollar + 1;
+    if (*dollar == '\\') { // escaped characters are left for expand_globs
+      buffer_append(&out, dollar, *p ? 2 : 1);
+      p += *p != 0;
+      continue;
+    }
+    const char *value = NULL;
+    if (*p == '(') {
+      const char *end = skip_quoted(dollar);
+      if (end[-1] != ')' || end - 1 == p) {
+        buffer_append(&out, "$", 1); // unterminated
+        continue;
+      }
+      char *output = command_substitution(p + 1, end - p - 2);
+      buffer_append(&out, output, strlen(output));
+      free(output);
+      p = end;
+      continue;
+    }
+    if (*p == '?' || *p == '$') {
+      snprintf(number, sizeof(number), "%d", *p == '?' ? last_status : getpid());
+      value = number;
+      p++;
+    } else {
+      bool braced = *p == '{';
+      const char *start = p + braced, *end = start;
+      while (is_name_char(*end, end == start))
+        end++;
+      if (end == start || end - start >= (long)sizeof(name) ||
+          (braced && *end != '}')) {
+        buffer_append(&out, "$", 1); // not a variable: keep it literally
+        continue;
+      }
+      memcpy(name, start, end - start);
+      name[end - start] = 0;
+      value = get_var(name);
+      p = end + braced;
+    }
+    if (value)
+      buffer_append(&out, value, strlen(value));
+  }
+  buffer_append(&out, "", 1);
+  return out.data;
+}
+
+/**
+ * Copy a pipeline with the variables of its arguments and redirections
+ * expanded (an expanded value stays one argument)
+ */
+struct command_t *instantiate_command(struct command_t *command) {
+  struct command_t *copy = copy_command(command, 0);
+  for (struct command_t *c = copy; c; c = c->next) {
+    char *value;
+    for (int i = 0; i < c->arg_count - 1; i++) {
+      value = expand_vars(c->args[i]);
+      free(c->args[i]);
+      c->args[i] = value;
+    }
+    free(c->name);
+    c->name = strdup(c->args[0]);
+    for (int i = 0; i < 3; i++) {
+      if (c->redirects[i]) {
+        value = expand_vars(c->redirects[i]);
+        free(c->redirects[i]);
+        c->redirects[i] = value;
+      }
+    }
+    if (c->here_doc && c->here_expand) {
+      value = expand_vars(c->here_doc);
+      free(c->here_doc);
+      c->here_doc = value;
+    }
+  }
+  return copy;
+}
+
+/**
+ * Split a line into words and list operators. Quotes keep operators and
+ * blanks inside a word; `|`, `&` and redirections stay in the words and are
+ * left to parse_command().
+ */
+struct token *tokenize_line(const char *line) {
+  int count = 0, cap = 16;
+  struct token *tokens = malloc(cap * sizeof(struct token));
+  const char *p = line;
+  while (1) {
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+      p++;
+    if (count + 1 >= cap)
+      tokens = realloc(tokens, (cap *= 2) * sizeof(struct token));
+    struct token *t = &tokens[count++];
+    t->start = p;
+    if (*p == 0) {
+      t->type = TOKEN_END;
+      t->len = 0;
+      return tokens;
+    }
+    if (*p == ';' || (p[0] == '&' && p[1] == '&') || (p[0] == '|' && p[1] == '|')) {
+      t->type = *p == ';' ? TOKEN_SEMI : *p == '&' ? TOKEN_AND : TOKEN_OR;
+      t->len = *p == ';' ? 1 : 2;
+      p += t->len;
+      continue;
+    }
+    t->type = TOKEN_WORD;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != ';' &&
+           !(p[0] == '&' && p[1] == '&') && !(p[0] == '|' && p[1] == '|')) {
+      if (*p == '\\' && p[1])
+        p += 2;
+      else
+        p = starts_quoted(p) ? skip_quoted(p) : p + 1;
+    }
+    t->len = p - t->start;
+  }
+}
+
+bool token_is(struct token *t, const char *word) {
+  return t->type == TOKEN_WORD && t->len == (int)strlen(word) &&
+         memcmp(t->start, word, t->len) == 0;
+}
+
+void free_node(struct node_t *node) {
+  if (!node)
+    return;
+  if (node->pipeline)
+    free_command(node->pipeline);
+  free_node(node->left);
+  free_node(node->right);
+  free(node->var);
+  for (int i = 0; i < node->word_count; i++)
+    free(node->words[i]);
+  free(node->words);
+  free(node);
+}
+
+struct node_t *parse_list(struct parser *p, const char *stop);
+
+struct node_t *syntax_error(struct parser *p) {
+  if (!p->error)
+    p->error = p->tokens[p->pos].start;
+  return NULL;
+}
+
+bool expect_word(struct parser *p, const char *word) {
+  if (!token_is(&p->tokens[p->pos], word)) {
+    syntax_error(p);
+    return false;
+  }
+  p->pos++;
+  return true;
+}
+
+struct node_t *parse_loop(struct parser *p) {
+  struct node_t *node = calloc(1, sizeof(struct node_t));
+  if (token_is(&p->tokens[p->pos++], "while")) {
+    node->type = NODE_WHILE;
+    if ((node->left = parse_list(p, "do")) && expect_word(p, "do") &&
+        (node->right = parse_list(p, "done")) && expect_word(p, "done"))
+      return node;
+    free_node(node);
+    return NULL;
+  }
+  node->type = NODE_FOR;
+  struct token *t = &p->tokens[p->pos];
+  bool valid = t->type == TOKEN_WORD && t->len < 256;
+  for (int i = 0; valid && i < t->len; i++)
+    valid = is_name_char(t->start[i], i == 0);
+  if (!valid) {
+    free_node(node);
+    return syntax_error(p);
+  }
+  node->var = strndup(t->start, t->len);
+  p->pos++;
+  if (!expect_word(p, "in")) {
+    free_node(node);
+    return NULL;
+  }
+  node->words = malloc(sizeof(char *));
+  for (t = &p->tokens[p->pos]; t->type == TOKEN_WORD && !token_is(t, "do");
+       t = &p->tokens[++p->pos]) {
+    node->words = realloc(node->words, (node->word_count + 1) * sizeof(char *));
+    node->words[node->word_count++] = strndup(t->start, t->len);
+  }
+  if (t->type == TOKEN_SEMI)
+    p->pos++;
+  if (expect_word(p, "do") && (node->right = parse_list(p, "done")) &&
+      expect_word(p, "done"))
+    return node;
+  free_node(node);
+  return NULL;
+}
+
+struct node_t *parse_pipeline(struct parser *p) {
+  struct token *first = &p->tokens[p->pos];
+  if (token_is(first, "for") || token_is(first, "while"))
+    return parse_loop(p);
+  if (first->type != TOKEN_WORD || token_is(first, "do") ||
+      token_is(first, "done") || token_is(first, "in"))
+    return syntax_error(p);
+  struct token *last = first;
+  while (p->tokens[p->pos].type == TOKEN_WORD)
+    last = &p->tokens[p->pos++];
+  struct node_t *node = calloc(1, sizeof(struct node_t));
+  node->type = NODE_PIPELINE;
+  char *text = strndup(first->start, last->start + last->len - first->start);
+  node->instantiate = strchr(text, '$') || has_glob_chars(text);
+  node->pipeline = calloc(1, sizeof(struct command_t));
+  parse_command(text, node->pipeline);
+  for (struct command_t *c = node->pipeline; c; c = c->next)
+    node->instantiate |= c->here_expand && c->here_doc && strchr(c->here_doc, '$');
+  free(text);
+  return node;
+}
+
+struct node_t *parse_and_or(struct parser *p) {
+  struct node_t *left = parse_pipeline(p);
+  while (left && (p->tokens[p->pos].type == TOKEN_AND ||
+                  p->tokens[p->pos].type == TOKEN_OR)) {
+    struct node_t *node = calloc(1, sizeof(struct node_t));
+    node->type = p->tokens[p->pos++].type == TOKEN_AND ? NODE_AND : NODE_OR;
+    node->left = left;
+    if (!(node->right = parse_pipeline(p))) {
+      free_node(node);
+      return NULL;
+    }
+    left = node;
+  }
+  return left;
+}
+
+/**
+ * Parse `;`-separated items up to the end of the line or, inside a loop, up to
+ * the keyword `stop` at the start of an item
+ */
+struct node_t *parse_list(struct parser *p, const char *stop) {
+  struct node_t *list = NULL;
+  while (1) {
+    struct token *t = &p->tokens[p->pos];
+    if (t->type == TOKEN_END || (stop && token_is(t, stop)))
+      break;
+    struct node_t *item = parse_and_or(p);
+    if (!item) {
+      free_node(list);
+      return NULL;
+    }
+    if (list) {
+      struct node_t *node = calloc(1, sizeof(struct node_t));
+      node->type = NODE_SEQUENCE;
+      node->left = list;
+      node->right = item;
+      item = node;
+    }
+    list = item;
+    if (p->tokens[p->pos].type == TOKEN_SEMI)
+      p->pos++;
+    else if (p->tokens[p->pos].type != TOKEN_END &&
+             !(stop && token_is(&p->tokens[p->pos], stop))) {
+      free_node(list);
+      return syntax_error(p);
+    }
+  }
+  if (!list && stop)
+    return syntax_error(p); // empty loop body or condition
+  return list;
+}
+
+/**
+ * Parse a command line
+ * @param  line command line
+ * @param  tree parsed line, NULL for an empty line
+ * @return      0 on success, -1 on a syntax error (reported on stderr)
+ */
+int parse_line(const char *line, struct node_t **tree) {
+  struct parser p = {tokenize_line(line), 0, NULL};
+  *tree = parse_list(&p, NULL);
+  if (!p.error && p.tokens[p.pos].type != TOKEN_END)
+    syntax_error(&p);
+  if (p.error && *p.error == 0) {
+    fprintf(stderr, "-%s: syntax error: unexpected end of line\n", sysname);
+  } else if (p.error) {
+    int len = strcspn(p.error, " \t");
+    fprintf(stderr, "-%s: syntax error near '%.*s'\n", sysname, len, p.error);
+  }
+  if (p.error) {
+    free_node(*tree);
+    *tree = NULL;
+  }
+  free(p.tokens);
+  return p.error ? -1 : 0;
+}
+
+/**
+ * Words of a for loop after quote removal and variable, {N..M} range and glob
+ * expansion; the output of an unquoted $(...) is split at blanks
+ */
+char **expand_words(struct node_t *node, int *count) {
+  int n = 0, cap = node->word_count + 8;
+  char **words = malloc(cap * sizeof(char *));
+  for (int i = 0; i < node->word_count; i++) {
+    const char *raw = node->words[i];
+    size_t raw_len = strlen(raw);
+    if (raw_len >= 2 && (raw[0] == '"' || raw[0] == '\'') &&
+        raw[raw_len - 1] == raw[0]) {
+      char *inner = strndup(raw + 1, raw_len - 2);
+      if (n + 1 >= cap)
+        words = realloc(words, (cap *= 2) * sizeof(char *));
+      words[n++] = raw[0] == '"' ? expand_vars(inner) : strdup(inner);
+      free(inner);
+      continue;
+    }
+    char *word = expand_vars(raw);
+    if (strstr(raw, "$(")) {
+      char *save;
+      for (char *field = strtok_r(word, " \t\n", &save); field;
+           field = strtok_r(NULL, " \t\n", &save)) {
+        if (n + 1 >= cap)
+          words = realloc(words, (cap *= 2) * sizeof(char *));
+        words[n++] = strdup(field);
+      }
+      free(word);
+      continue;
+    }
+    long from, to;
+    int used = 0;
+    char **matches = NULL;
+    int match_count = 0;
+    if (sscanf(word, "{%ld..%ld}%n", &from, &to, &used) == 2 &&
+        word[used] == 0) {
+      long step = from <= to ? 1 : -1, total = labs(to - from) + 1;
+      if (n + total >= cap)
+        words = realloc(words, (cap = n + total + 8) * sizeof(char *));
+      for (long v = from;; v += step) {
+        char number[24];
+        snprintf(number, sizeof(number), "%ld", v);
+        words[n++] = strdup(number);
+        if (v == to)
+          break;
+      }
+      free(word);
+      continue;
+    }
+    if (has_glob_chars(word))
+      matches = glob_expand(word, &match_count);
+    if (n + match_count + 1 >= cap)
+      words = realloc(words, (cap = (n + match_count) * 2 + 8) * sizeof(char *));
+    if (match_count) {
+      memcpy(words + n, matches, match_count * sizeof(char *));
+      n += match_count;
+      free(word);
+    } else {
+      words[n++] = word;
+    }
+    free(matches);
+  }
+  *count = n;
+  return words;
+}
+
+/**
+ * Run a parsed command line
+ * @return EXIT when the shell should exit, SUCCESS otherwise
+ */
+int run_node(struct node_t *node) {
+  int code = SUCCESS;
+  if (!node)
+    return SUCCESS;
+  switch (node->type) {
+  case NODE_PIPELINE: {
+    struct command_t *command = node->instantiate
+                                    ? instantiate_command(node->pipeline)
+                                    : node->pipeline;
+    uint64_t start = trace_now();
+    code = process_command(command);
+    trace_span(command->name, "command", start, NULL);
+    record_latency(command->name, trace_now() - start);
+    if (node->instantiate)
+      free_command(command);
+    return code;
+  }
+  case NODE_SEQUENCE:
+    code = run_node(node->left);
+    return code == EXIT ? EXIT : run_node(node->right);
+  case NODE_AND:
+  case NODE_OR:
+    code = run_node(node->left);
+    if (code == EXIT || (last_status == 0) != (node->type == NODE_AND))
+      return code;
+    return run_node(node->right);
+  case NODE_FOR: {
+    int count, status = 0;
+    char **words = expand_words(node, &count);
+    for (int i = 0; i < count && code != EXIT; i++) {
+      set_var(node->var, words[i]);
+      code = run_node(node->right);
+      status = last_status;
+    }
+    for (int i = 0; i < count; i++)
+      free(words[i]);
+    free(words);
+    last_status = status;
+    return code;
+  }
+  case NODE_WHILE: {
+    int status = 0;
+    while ((code = run_node(node->left)) != EXIT && last_status == 0) {
+      if ((code = run_node(node->right)) == EXIT)
+        break;
+      status = last_status;
+    }
+    last_status = status;
+    return code;
+  }
+  }
+  return code;
+}
+
+void prompt_backspace() {
+  putchar(8);   // go back 1
+  putchar(' '); // write empty over
+  putchar(8);   // go back 1 again
+}
+
+/**
+ * Read a continuation line (here-document body) at a "> " prompt
+ * @return length of the line, -1 on end of input
+ */
+int prompt_read_line(char *line, size_t size) {
+  size_t len = 0;
+  printf("> ");
+  while (1) {
+    int c = prompt_getchar();
+    if (c == 4 && len == 0)
+      return -1;
+    if (c == 127) {
+      if (len > 0) {
+        prompt_backspace();
+        len--;
+      }
+      continue;
+    }
+    if (c == '\n' || c == 4) {
+      putchar('\n');
+      break;
+    }
+    if (len < size - 1) {
+      putchar(c);
+      line[len++] = c;
+    }
+  }
+  line[len] = 0;
+  return len;
+}
+
+/**
+ * Read the bodies of the here-documents (<< DELIMITER) of a line into
+ * pending_here_docs, in order of appearance
+ */
+void read_here_docs(const char *buf) {
+  struct here_docs *q = &pending_here_docs;
+  char delimiter[256], line[4096];
+  for (const char *p = buf; *p; p++) {
+    if (*p == '"' || *p == '\'') { // skip quoted text
+      const char *close = strchr(p + 1, *p);
+      if (!close)
+        break;
+      p = close;
+      continue;
+    }
+    if (p[0] != '<' || p[1] != '<')
+      continue;
+    if (p[2] == '<') { // here-string
+      p += 2;
+      continue;
+    }
+    p += 2;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    size_t len = 0;
+    for (; *p && !strchr(" \t;|&<>", *p); p++)
+      if (*p != '"' && *p != '\'' && len < sizeof(delimiter) - 1)
+        delimiter[len++] = *p;
+    delimiter[len] = 0;
+    p--;
+    struct buffer body = {0};
+    while (prompt_read_line(line, sizeof(line)) != -1 &&
+           strcmp(line, delimiter) != 0) {
+      buffer_append(&body, line, strlen(line));
+      buffer_append(&body, "\n", 1);
+    }
+    buffer_append(&body, "", 1);
+    q->bodies = realloc(q->bodies, (q->count + 1) * sizeof(char *));
+    q->bodies[q->count++] = body.data;
+  }
+}
+
+void free_here_docs() {
+  struct here_docs *q = &pending_here_docs;
+  for (int i = 0; i < q->count; i++)
+    free(q->bodies[i]);
+  free(q->bodies);
+  memset(q, 0, sizeof(*q));
+}
+/**
+ * Prompt a command from the user
+ * @param  buf      [description]
+ * @param  buf_size [description]
+ * @return          [description]
+ */
+int prompt(struct node_t **tree) {
+  int index = 0;
+  int c;
+  char buf[4096];
+  static char oldbuf[4096];
+
+  // tcgetattr gets the parameters of the current terminal
+  // STDIN_FILENO will tell tcgetattr that it should write the settings
+  // of stdin to oldt
+  static struct termios backup_termios, new_termios;
+  tcgetattr(STDIN_FILENO, &backup_termios);
+  new_termios = backup_termios;
+  // ICANON normally takes care that one line at a time will be processed
+  // that means it will return if it sees a "\n" or an EOF or an EOL
+  new_termios.c_lflag &=
+      ~(ICANON |
+        ECHO); // Also disable automatic echo. We manually echo each char.
+  // Those new settings will be set to STDIN
+  // TCSANOW tells tcsetattr to change attributes immediately.
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+  uint64_t prompt_start = trace_now();
+  show_prompt();
+  buf[0] = 0;
+  prompt_state.line = buf;
+  prompt_state.line_len = &index;
+  while (1) {
+    c = prompt_getchar();
+    // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+    if (c == 9) // handle tab
+    {
+      buf[index++] = '?'; // autocomplete
+      break;
+    }
+
+    if (c == 127) // handle backspace
+    {
+      if (index > 0) {
+        prompt_backspace();
+        index--;
+      }
+      continue;
+    }
+
+    if (c == 27) // escape sequence: only ESC [ A (up arrow) is handled
+    {
+      if (prompt_getchar() != '[')
+        continue;
+      c = prompt_getchar();
+      while ((c >= '0' && c <= '9') || c == ';') // parameters: ESC [ 1 ; 5 C
+        c = prompt_getchar();
+      if (c != 'A')
+        continue;
+
+      while (index > 0) {
+        prompt_backspace();
+        index--;
+      }
+
+      char tmpbuf[4096];
+      printf("%s", oldbuf);
+      strcpy(tmpbuf, buf);
+      strcpy(buf, oldbuf);
+      strcpy(oldbuf, tmpbuf);
+      index += strlen(buf);
+      continue;
+    }
+
+    putchar(c); // echo the character
+    buf[index++] = c;
+    if (index >= sizeof(buf) - 1)
+      break;
+    if (c == '\n') // enter key
+      break;
+    if (c == 4) // Ctrl+D
+      return EXIT;
+  }
+  prompt_state.line = NULL;
+  if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
+    index--;
+  buf[index++] = '\0'; // null terminate string
+
+  strcpy(oldbuf, buf);
+  read_here_docs(buf);
+  trace_span("prompt", "shell", prompt_start, NULL);
+
+  uint64_t parse_start = trace_now();
+  char parse_args[sizeof(buf) + 16] = "";
+  if (trace_fd != -1) {
+    char line[sizeof(buf) / 2];
+    json_escape(buf, line, sizeof(line));
+    snprintf(parse_args, sizeof(parse_args), "\"line\": \"%s\"", line);
+  }
+  parse_line(buf, tree);
+  free_here_docs();
+  trace_span("parse", "shell", parse_start, parse_args);
+
+  // restore the old settings
+  tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+  return SUCCESS;
+}
+/*
+ * Server mode, so that tools that run many commands pay for process startup
+ * and cold caches once:
+ *   shellax --server SOCKET        serve requests on a Unix socket
+ *   shellax --client SOCKET cmd... run a command line through the server
+ * A request is one frame on its own connection: the working directory, the
+ * command line and the environment, NUL-separated, sent together with the
+ * client's stdin, stdout and stderr (SCM_RIGHTS). The server parses the line
+ * and resolves its commands into its own PATH cache, then forks: the child
+ * takes the client's directory, environment and descriptors, so output
+ * streams straight to the client, and runs the line. The child answers with
+ * a FRAME_STARTED frame (its pid, which is also the process group the client
+ * forwards signals to) and a FRAME_STATUS frame with the exit status. The
+ * caches (PATH, directory listings, memo) stay warm in the server and every
+ * child shares them copy-on-write. Only the user running the server may
+ * connect.
+ */
+#define SERVER_REQUEST_MAX (4 << 20)
+#define SERVER_READ_TIMEOUT 5 // seconds a client has to send its request
+
+enum frame_type { FRAME_REQUEST = 'R', FRAME_STARTED = 'P', FRAME_STATUS = 'X' };
+
+struct frame {
+  uint32_t type, len; // len bytes of payload follow
+};
+
+/**
+ * Write a whole buffer to a socket, without SIGPIPE if the peer went away
+ * @return 0, -1 on error
+ */
+int send_full(int fd, const void *buf, size_t len) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+/**
+ * @return 0, -1 on error or end of file before len bytes
+ */
+int recv_full(int fd, void *buf, size_t len) {
+  for (size_t done = 0; done < len;) {
+    ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += n;
+  }
+  return 0;
+}
+
+int send_frame(int fd, uint32_t type, int32_t value) {
+  struct {
+    struct frame header;
+    int32_t value;
+  } f = {{type, sizeof(int32_t)}, value};
+  return send_full(fd, &f, sizeof(f));
+}
+
+/**
+ * Resolve the commands of a parsed line ahead of the child
+ */
+void server_prime(struct node_t *node, const char *dirs) {
+  char path[PATH_MAX];
+  if (!node)
+    return;
+  if (node->type == NODE_PIPELINE)
+    for (struct command_t *c = node->pipeline; c; c = c->next)
+      if (!is_stream_builtin(c) && !strpbrk(c->name, "$\\'\""))
+        resolve_in(dirs, c->name, path, sizeof(path));
+  server_prime(node->left, dirs);
+  server_prime(node->right, dirs);
+}
+
+/**
+ * Run one request in a child process
+ * @param request cwd, line, then environment entries, each NUL-terminated
+ * @param fds     the client's stdin, stdout and stderr
+ */
+void server_run(int conn, char *request, size_t len, int fds[3]) {
+  char *cwd = request, *line = cwd + strlen(cwd) + 1, *env = line + strlen(line) + 1;
+  const char *dirs = "/usr/local/bin:/usr/bin:/bin";
+  for (char *e = env; e < request + len; e += strlen(e) + 1)
+    if (strncmp(e, "PATH=", 5) == 0)
+      dirs = e + 5;
+
+  // parse here, so the tree and the resolved commands stay in the server;
+  // syntax errors go to the client
+  int saved_stderr = dup(STDERR_FILENO);
+  fflush(stderr);
+  dup2(fds[2], STDERR_FILENO);
+  struct node_t *tree;
+  int parsed = parse_line(line, &tree);
+  fflush(stderr);
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  if (parsed == -1) {
+    send_frame(conn, FRAME_STATUS, 2);
+    return;
+  }
+  server_prime(tree, dirs);
+  if (cwd[0] == '/' && strpbrk(line, "*?["))
+    glob_scan(cwd);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    dprintf(fds[2], "-%s: fork: %s\n", sysname, strerror(errno));
+    send_frame(conn, FRAME_STATUS, 1);
+  } else if (pid == 0) {
+    // the request starts from default dispositions, whatever the server's
+    int defaults[] = {SIGCHLD, SIGINT, SIGQUIT, SIGTERM, SIGHUP, SIGPIPE};
+    for (int i = 0; i < 6; i++)
+      signal(defaults[i], SIG_DFL);
+    setpgid(0, 0);
+    for (int i = 0; i < 3; i++)
+      dup2(fds[i], i);
+    for (int i = 0; i < 3; i++)
+      if (fds[i] > STDERR_FILENO)
+        close(fds[i]);
+    clearenv();
+    for (char *e = env; e < request + len; e += strlen(e) + 1)
+      if (strchr(e, '='))
+        putenv(e);
+    send_frame(conn, FRAME_STARTED, getpid());
+    last_status = 0;
+    if (chdir(cwd) == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname, cwd, strerror(errno));
+      last_status = 1;
+    } else {
+      run_node(tree);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    send_frame(conn, FRAME_STATUS, last_status);
+    _exit(0);
+  }
+  free_node(tree);
+}
+
+/**
+ * Read a request from a new connection and run it
+ */
+void server_accept(int conn) {
+  struct ucred peer;
+  socklen_t peer_len = sizeof(peer);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == -1 ||
+      (peer.uid != geteuid() && peer.uid != 0))
+    return;
+  struct timeval timeout = {SERVER_READ_TIMEOUT, 0};
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // the descriptors arrive with the header
+  struct frame header;
+  union {
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {&header, sizeof(header)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  int fds[3] = {-1, -1, -1}, received = 0;
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), (received < 3 ? received : 3) * sizeof(int));
+  }
+  char *request = NULL;
+  if (n == sizeof(header) && received == 3 && header.type == FRAME_REQUEST &&
+      header.len > 0 && header.len <= SERVER_REQUEST_MAX) {
+    request = malloc(header.len + 1);
+    request[header.len] = 0;
+    // cwd and line must both be there
+    if (recv_full(conn, request, header.len) == 0 &&
+        memchr(request, 0, header.len) &&
+        memchr(request + strlen(request) + 1, 0,
+               header.len - strlen(request) - 1))
+      server_run(conn, request, header.len, fds);
+  }
+  free(request);
+  for (int i = 0; i < received && i < 3; i++)
+    close(fds[i]);
+}
+
+/**
+ * @return the socket address, or -1 if the path is too long
+ */
+int socket_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "-%s: %s: socket path too long\n", sysname, path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+/**
+ * Serve requests until killed
+ * @return exit status on failure to start
+ */
+int run_server(const char *path) {
+  struct sockaddr_un addr;
+  if (socket_address(path, &addr) == -1)
+    return 1;
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  // a live server keeps its socket, a stale one is replaced
+  if (connect(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "-%s: %s: a server is already running\n", sysname, path);
+    return 1;
+  }
+  close(listener);
+  unlink(path);
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(0077);
+  int bound = bind(listener, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (bound == -1 || listen(listener, 128) == -1) {
+    fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+    return 1;
+  }
+  // finished requests are reaped by the kernel
+  struct sigaction reap = {.sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT};
+  sigaction(SIGCHLD, &reap, NULL);
+  while (1) {
+    int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1)
+      continue;
+    server_accept(conn);
+    close(conn);
+  }
+}
+
+pid_t client_request = 0; // process group of the running request
+volatile sig_atomic_t client_signal = 0;
+
+void client_forward(int sig) {
+  client_signal = sig;
+  if (client_request > 0)
+    kill(-client_request, sig);
+}
+
+/**
+ * Run a command line through a server, as if it ran here
+ * @return the exit status of the command line, 255 if the server failed
+ */
+int run_client(const char *path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  if (socket_address(path, &addr) == -1)
+    return 255;
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+    close(conn);
+    return 255;
+  }
+
+  struct buffer request = {0};
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)))
+    cwd[0] = 0;
+  buffer_append(&request, cwd, strlen(cwd) + 1);
+  for (int i = 0; i < argc; i++) { // the words make one command line
+    buffer_append(&request, argv[i], strlen(argv[i]));
+    buffer_append(&request, " ", i < argc - 1);
+  }
+  buffer_append(&request, "", 1);
+  extern char **environ;
+  for (char **e = environ; *e; e++)
+    buffer_append(&request, *e, strlen(*e) + 1);
+
+  // descriptors that are closed here are sent as /dev/null
+  int fds[3];
+  for (int i = 0; i < 3; i++)
+    fds[i] = fcntl(i, F_GETFD) != -1
+                 ? i
+                 : open("/dev/null", (i ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+  struct frame header = {FRAME_REQUEST, request.len};
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = {&header, sizeof(header)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  int sent = sendmsg(conn, &msg, MSG_NOSIGNAL) == sizeof(header) &&
+                     send_full(conn, request.data, request.len) == 0
+                 ? 0
+                 : -1;
+  free(request.data);
+  for (int i = 0; i < 3; i++)
+    if (fds[i] != i)
+      close(fds[i]);
+
+  // Ctrl-C and friends go to the request's process group
+  struct sigaction forward = {.sa_handler = client_forward,
+                              .sa_flags = SA_RESTART},
+                   saved[4];
+  int forwarded[4] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+  for (int i = 0; i < 4; i++)
+    sigaction(forwarded[i], &forward, &saved[i]);
+  int status = 255;
+  struct frame reply;
+  int32_t value;
+  while (sent == 0 && recv_full(conn, &reply, sizeof(reply)) == 0 &&
+         reply.len == sizeof(value) && recv_full(conn, &value, sizeof(value)) == 0) {
+    if (reply.type == FRAME_STARTED) {
+      client_request = value;
+      if (client_signal) // arrived before the pid
+        kill(-client_request, client_signal);
+    } else if (reply.type == FRAME_STATUS) {
+      status = value;
+      break;
+    }
+  }
+  if (status == 255 && client_signal) // the request was killed with its group
+    status = 128 + client_signal;
+  else if (status == 255)
+    fprintf(stderr, "-%s: %s: no reply from the server\n", sysname, path);
+  for (int i = 0; i < 4; i++)
+    sigaction(forwarded[i], &saved[i], NULL);
+  client_request = 0;
+  close(conn);
+  return status;
+}
+
+#ifndef SHELLAX_NO_MAIN
+int main(int argc, char **argv) {
+  if (argc >= 3 && strcmp(argv[1], "--server") == 0)
+    return run_server(argv[2]);
+  if (argc >= 3 && strcmp(argv[1], "--client") == 0)
+    return run_client(argv[2], argc - 3, argv + 3);
+  if (argc > 1) {
+    fprintf(stderr, "usage: %s [--server SOCKET | --client SOCKET command...]\n",
+            sysname);
+    return 2;
+  }
+  trace_open();
+  while (1) {
+    struct node_t *tree = NULL;
+
+    int code;
+    code = prompt(&tree);
+    if (code == EXIT)
+      break;
+
+    uint64_t start = trace_now();
+    code = run_node(tree);
+    prompt_state.duration = trace_now() - start;
+    prompt_state.stale = true;
+    free_node(tree);
+    if (code == EXIT)
+      break;
+  }
+
+  printf("\n");
+  return 0;
+}
+#endif
+
+ /* int count_command(struct command_t *command) { The other way to calculate number of process:
+
+  if (command->next) {
+      i = i + 1;
+      count_command(command->next);
+  }
+  return i;
+} */
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Our second solution for the wiseman question:
+
+  /* void wiseman(struct command_t *command){
+     
+    int exit_value;
+    int infd;
+    int pipefd[2];
+    // char *crontab_args[] = {"crontab", "-", NULL};
+    // char str1[1000] = //*/;
+ /*      strcat(str1,command->args[1]);
+    char str2[] = " * * * * fortune | espeak";
+    strcat(str1,str2);
+    // strcat(str1,"\n"); //end of the file ?????
+    
+
+      if (pipe(pipefd) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        //fork child to handle cmd
+        pid_t pid;
+        pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            return;
+        } else if(pid == 0) { // child process
+
+               close(pipefd[1]);
+               dup2(pipefd[0], 0);
+	       char *crontab_args[] = {"crontab", "-", NULL};
+	       execvp("crontab",crontab_args);
+	       printf("errno: %d\f", errno);
+	       exit(0);
+	       
+	}else{
+
+               write(pipefd[1],&str1,strlen(str1)+1);
+	       close(pipefd[0]);
+	       close(pipefd[1]);
+       }
+              
+ }  */
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+
+// Question 3 part d starts: our first custom command: last_x_lines // last fileName number_of_lines
+// (and the second one, first_x_lines // first fileName number_of_lines)
+#define LINES_BLOCK (64 * 1024)
+
+/**
+ * Write the last n lines of a descriptor. Regular files are scanned backwards
+ * from the end with pread, so the cost depends on n and not on the file size;
+ * anything else is read through while the last n lines are kept.
+ * @param  end if not NULL, set to the offset the output stops at
+ * @return 0 on success, -1 on error
+ */
+int write_last_lines(int fd, long n, FILE *out, off_t *end) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    if (end)
+      *end = st.st_size;
+    if (n <= 0)
+      return 0;
+    char *buf = malloc(LINES_BLOCK);
+    off_t size = st.st_size, pos = size, start = 0;
+    long found = 0;
+    while (pos > 0 && found < n) {
+      off_t block = pos < LINES_BLOCK ? pos : LINES_BLOCK;
+      pos -= block;
+      if (pread(fd, buf, block, pos) != block) {
+        free(buf);
+        return -1;
+      }
+      for (off_t i = block - 1; i >= 0; i--) {
+        if (buf[i] != '\n' || pos + i == size - 1) // skip the final newline
+          continue;
+        if (++found == n) {
+          start = pos + i + 1;
+          break;
+        }
+      }
+    }
+    for (off_t at = start; at < size;) {
+      ssize_t got = pread(fd, buf, LINES_BLOCK, at);
+      if (got <= 0)
+        break;
+      fwrite(buf, 1, got, out);
+      at += got;
+    }
+    free(buf);
+    return 0;
+  }
+
+  // not seekable: keep a ring of the last n lines
+  if (n <= 0)
+    return 0;
+  FILE *in = fdopen(fcntl(fd, F_DUPFD_CLOEXEC, 0), "r");
+  if (!in)
+    return -1;
+  char **ring = calloc(n, sizeof(char *));
+  size_t *caps = calloc(n, sizeof(size_t));
+  long total = 0;
+  while (getline(&ring[total % n], &caps[total % n], in) != -1)
+    total++;
+  for (long i = total > n ? total - n : 0; i < total; i++)
+    fputs(ring[i % n], out);
+  for (long i = 0; i < n; i++)
+    free(ring[i]);
+  free(ring);
+  free(caps);
+  fclose(in);
+  return 0;
+}
+
+/**
+ * Write the first n lines of a descriptor, reading no further than needed
+ * @return 0 on success, -1 on error
+ */
+int write_first_lines(int fd, long n, FILE *out) {
+  char *buf = malloc(LINES_BLOCK);
+  ssize_t got = 0;
+  while (n > 0 && (got = read(fd, buf, LINES_BLOCK)) > 0) {
+    char *p = buf, *end = buf + got;
+    while (n > 0 && p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      if (!nl) {
+        p = end;
+        break;
+      }
+      p = nl + 1;
+      n--;
+    }
+    fwrite(buf, 1, p - buf, out);
+  }
+  free(buf);
+  return got < 0 ? -1 : 0;
+}
+
+/*
+ * last -f: after the last lines, stream what is appended to the file.
+ * The file and its directory are watched with inotify, so an idle follow
+ * sleeps in poll() and a write is picked up as soon as it lands. Only the new
+ * bytes are read, with pread from the offset reached so far. A size below
+ * that offset means the file was truncated (start over from 0); a different
+ * inode behind the name means it was rotated (finish the old file, then
+ * switch to the new one). Ctrl-C ends the follow, not the shell: while one
+ * runs, SIGINT only writes to a pipe that the followers poll.
+ */
+int follow_stop[2] = {-1, -1};
+int follow_count = 0;
+struct sigaction follow_saved_sigint;
+pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void follow_interrupt(int sig) {
+  int saved = errno;
+  if (write(follow_stop[1], "", 1) == -1) {
+    // the pipe is full: a stop is already pending
+  }
+  errno = saved;
+}
+
+/**
+ * Register a follower; the first one takes over SIGINT
+ * @return read end of the stop pipe, -1 on error
+ */
+int follow_begin() {
+  pthread_mutex_lock(&follow_lock);
+  if (follow_stop[0] == -1 && pipe2(follow_stop, O_CLOEXEC | O_NONBLOCK) == -1) {
+    pthread_mutex_unlock(&follow_lock);
+    return -1;
+  }
+  if (follow_count++ == 0) {
+    char drain[64];
+    while (read(follow_stop[0], drain, sizeof(drain)) > 0)
+      ; // stale stop from an earlier follow
+    struct sigaction sa = {.sa_handler = follow_interrupt};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &follow_saved_sigint);
+  }
+  pthread_mutex_unlock(&follow_lock);
+  return follow_stop[0];
+}
+
+void follow_end() {
+  pthread_mutex_lock(&follow_lock);
+  if (--follow_count == 0)
+    sigaction(SIGINT, &follow_saved_sigint, NULL);
+  pthread_mutex_unlock(&follow_lock);
+}
+
+/**
+ * Watch a file by name (for writes, truncation and removal) and its directory
+ * (for a new file taking the name)
+ * @return watch descriptor of the file, -1 if it is gone
+ */
+int follow_watch(int inotify_fd, const char *path) {
+  char dir[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  if (!slash)
+    strcpy(dir, ".");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path),
+             path);
+  inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_MOVED_TO);
+  return inotify_add_watch(inotify_fd, path,
+                           IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF |
+                               IN_MOVE_SELF);
+}
+
+/**
+ * Stream what is appended to a file from `offset` on, until Ctrl-C or until
+ * the output is closed
+ * @param  fd descriptor of the file; closed by the caller, even when the
+ *            follow moved on to a rotated file
+ * @return    0 when stopped, -1 on error
+ */
+int follow_file(const char *path, int fd, off_t offset, FILE *out) {
+  int stop = follow_begin();
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (stop == -1 || inotify_fd == -1) {
+    if (stop != -1)
+      follow_end();
+    return -1;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  dev_t dev = st.st_dev;
+  ino_t ino = st.st_ino;
+  int watch = follow_watch(inotify_fd, path), current = fd, r = 0;
+  char *buf = malloc(LINES_BLOCK);
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    // catch up: truncation, appended bytes, then a rotated file
+    if (fstat(current, &st) == 0 && st.st_size < offset) {
+      fprintf(stderr, "%s: %s: file truncated\n", sysname, path);
+      offset = 0;
+    }
+    ssize_t got;
+    while ((got = pread(current, buf, LINES_BLOCK, offset)) > 0) {
+      offset += got;
+      if (fwrite(buf, 1, got, out) != (size_t)got)
+        goto done;
+    }
+    if (fflush(out) == EOF)
+      goto done;
+    struct stat now;
+    if (stat(path, &now) == 0 && (now.st_ino != ino || now.st_dev != dev)) {
+      int next = open(path, O_RDONLY | O_CLOEXEC);
+      if (next != -1) {
+        fprintf(stderr, "%s: %s: file replaced, following the new file\n",
+                sysname, path);
+        if (current != fd)
+          close(current);
+        current = next;
+        dev = now.st_dev;
+        ino = now.st_ino;
+        offset = 0;
+        if (watch != -1)
+          inotify_rm_watch(inotify_fd, watch);
+        watch = follow_watch(inotify_fd, path);
+        continue; // read the new file right away
+      }
+    }
+
+    struct pollfd fds[2] = {{.fd = inotify_fd, .events = POLLIN},
+                            {.fd = stop, .events = POLLIN}};
+    if (poll(fds, 2, -1) == -1 && errno != EINTR) {
+      r = -1;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    while (read(inotify_fd, events, sizeof(events)) > 0)
+      ; // the events only say "look again"
+  }
+done:
+  if (current != fd)
+    close(current);
+  free(buf);
+  close(inotify_fd);
+  follow_end();
+  return r;
+}
+
+/*
+ * With several files, first and last run on a pool of threads (one per
+ * allowed CPU, at most one per file). Workers take the next file from a
+ * shared index and render its lines into a memory stream; the calling thread
+ * writes the results in argument order, each as soon as it and the ones
+ * before it are done.
+ */
+struct lines_job {
+  const char *path;
+  char *data;
+  size_t size;
+  int error; // errno of a failed open or read, 0 on success
+  bool done;
+};
+
+struct lines_pool {
+  struct lines_job *jobs;
+  int count;
+  int next; // next job to take, shared by the workers
+  long lines;
+  bool last;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+};
+
+void *lines_worker(void *arg) {
+  struct lines_pool *pool = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+    struct lines_job *job = &pool->jobs[i];
+    FILE *memory = open_memstream(&job->data, &job->size);
+    int fd = memory ? open(job->path, O_RDONLY | O_CLOEXEC) : -1, r = -1;
+    if (fd != -1) {
+      r = pool->last ? write_last_lines(fd, pool->lines, memory, NULL)
+                     : write_first_lines(fd, pool->lines, memory);
+      close(fd);
+    }
+    // a failure must not pass for an empty file, whatever errno says
+    job->error = r == -1 ? (errno ? errno : EIO) : 0;
+    if (memory)
+      fclose(memory);
+    pthread_mutex_lock(&pool->lock);
+    job->done = true;
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  return NULL;
+}
+
+/**
+ * first/last over several files, each under a "==> path <==" header
+ * @return 0 if every file was read, 1 otherwise
+ */
+int head_tail_files(struct command_t *command, char **paths, int count,
+                    long lines, FILE *out, bool last) {
+  struct lines_pool pool = {.count = count, .lines = lines, .last = last};
+  pool.jobs = calloc(count, sizeof(struct lines_job));
+  for (int i = 0; i < count; i++)
+    pool.jobs[i].path = paths[i];
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  cpu_set_t allowed;
+  int threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+                    ? CPU_COUNT(&allowed)
+                    : 1;
+  if (threads > count)
+    threads = count;
+  pthread_t workers[threads];
+  int started = 0;
+  for (int i = 0; i < threads; i++)
+    if (pthread_create(&workers[started], NULL, lines_worker, &pool) == 0)
+      started++;
+  if (started == 0)
+    lines_worker(&pool); // no thread to spare: read the files here
+
+  int status = 0;
+  bool first_output = true;
+  for (int i = 0; i < count; i++) {
+    struct lines_job *job = &pool.jobs[i];
+    pthread_mutex_lock(&pool.lock);
+    while (!job->done)
+      pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    if (job->error) {
+      fflush(out);
+      fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, job->path,
+              strerror(job->error));
+      status = 1;
+    } else {
+      fprintf(out, "%s==> %s <==\n", first_output ? "" : "\n", job->path);
+      fwrite(job->data, 1, job->size, out);
+      first_output = false;
+    }
+    free(job->data);
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.done);
+  free(pool.jobs);
+  return status;
+}
+
+/**
+ * Shared front end of first and last:
+ * first|last fileName... [number_of_lines], last -f fileName [number_of_lines]
+ * The line count is the last argument when there are several and it is a
+ * number.
+ */
+int head_tail_command(struct command_t *command, FILE *out, bool last) {
+  int arg = 1, end = command->arg_count - 1; // args[end] is NULL
+  bool follow = last && end > 2 && strcmp(command->args[1], "-f") == 0;
+  if (follow)
+    arg++;
+  long lines = 10;
+  char *number_end;
+  if (end - arg >= 2) {
+    long n = strtol(command->args[end - 1], &number_end, 10);
+    if (*command->args[end - 1] && *number_end == 0) {
+      lines = n;
+      end--;
+    }
+  }
+  if (end - arg < 1 || (follow && end - arg > 1)) {
+    fprintf(stderr, "usage: %s %sfileName%s [number_of_lines]\n", command->name,
+            last ? "[-f] " : "", follow ? "" : "...");
+    return 1;
+  }
+  if (end - arg > 1)
+    return head_tail_files(command, command->args + arg, end - arg, lines, out,
+                           last);
+
+  const char *path = command->args[arg];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, path,
+            strerror(errno));
+    return 1;
+  }
+  off_t offset = -1;
+  int r = last ? write_last_lines(fd, lines, out, &offset)
+               : write_first_lines(fd, lines, out);
+  if (r == 0 && follow) {
+    if (offset == -1) {
+      fprintf(stderr, "-%s: %s: %s: can only follow a regular file\n",
+              sysname, command->name, path);
+      close(fd);
+      return 1;
+    }
+    r = follow_file(path, fd, offset, out);
+  }
+  if (r == -1)
+    fprintf(stderr, "-%s: %s: %s: %s\n", sysname, command->name, path,
+            strerror(errno));
+  close(fd);
+  return r == -1;
+}
+
+int last_x_lines(struct command_t *command, FILE *in, FILE *out) {
+  return head_tail_command(command, out, true);
+}
+
+int first_x_lines(struct command_t *command, FILE *in, FILE *out) {
+  return head_tail_command(command, out, false);
+}
+// Question 3 part d starts: our first and second custom commands: ENDs.
+
+// Question 3 part d starts: our third custom command
+// str = streaming text transformer: str <op> [file...]
+
+/*
+ * Stream builtins read lines from `in` and write to `out` instead of touching
+ * stdin/stdout directly, so the same code runs as a standalone command (with
+ * redirections) and as a stage of a pipeline.
+ */
+#define STREAM_CHUNK (1 << 20)
+
+struct line_reader {
+  FILE *in;
+  char *buf;
+  size_t cap, start, end;
+  bool eof;
+};
+
+void line_reader_init(struct line_reader *r, FILE *in) {
+  r->in = in;
+  r->cap = STREAM_CHUNK;
+  r->buf = malloc(r->cap);
+  r->start = r->end = 0;
+  r->eof = false;
+}
+
+void line_reader_free(struct line_reader *r) {
+  free(r->buf);
+  r->buf = NULL;
+}
+
+/**
+ * Read the next block of complete lines. Only the final line of the input
+ * may lack its '\n'. The block may be modified in place and stays valid until
+ * the next call.
+ * @param  r     reader
+ * @param  block start of the block
+ * @return       length of the block, 0 at end of input
+ */
+size_t read_lines(struct line_reader *r, char **block) {
+  size_t scanned = r->start;
+  while (1) {
+    char *nl = scanned < r->end
+                   ? memrchr(r->buf + scanned, '\n', r->end - scanned)
+                   : NULL;
+    if (nl || (r->eof && r->end > r->start)) {
+      size_t stop = nl ? (size_t)(nl - r->buf) + 1 : r->end;
+      *block = r->buf + r->start;
+      size_t n = stop - r->start;
+      r->start = stop;
+      return n;
+    }
+    if (r->eof)
+      return 0;
+    // only a partial line is left: keep it and read more behind it
+    if (r->start > 0) {
+      memmove(r->buf, r->buf + r->start, r->end - r->start);
+      r->end -= r->start;
+      r->start = 0;
+    }
+    if (r->end == r->cap)
+      r->buf = realloc(r->buf, r->cap *= 2);
+    scanned = r->end;
+    size_t n = fread(r->buf + r->end, 1, r->cap - r->end, r->in);
+    if (n == 0)
+      r->eof = true;
+    r->end += n;
+  }
+}
+
+/*
+ * Case conversion kernels. AVX2 is picked at runtime when the CPU has it,
+ * SSE2 is the x86-64 baseline and everything else falls back to scalar code.
+ */
+void ascii_case_scalar(char *p, size_t n, bool upper) {
+  unsigned char lo = upper ? 'a' : 'A';
+  for (size_t i = 0; i < n; i++)
+    if ((unsigned char)(p[i] - lo) < 26)
+      p[i] ^= 0x20;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) void ascii_case_avx2(char *p, size_t n,
+                                                      bool upper) {
+  // shift [lo, lo+26) down to [-128, -102) so one signed compare finds it
+  const __m256i shift = _mm256_set1_epi8((char)(0x80 - (upper ? 'a' : 'A')));
+  const __m256i limit = _mm256_set1_epi8(-128 + 26);
+  const __m256i flip = _mm256_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((__m256i *)(p + i));
+    __m256i in_range = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(x, shift));
+    x = _mm256_xor_si256(x, _mm256_and_si256(in_range, flip));
+    _mm256_storeu_si256((__m256i *)(p + i), x);
+  }
+  ascii_case_scalar(p + i, n - i, upper);
+}
+
+void ascii_case_sse2(char *p, size_t n, bool upper) {
+  const __m128i shift = _mm_set1_epi8((char)(0x80 - (upper ? 'a' : 'A')));
+  const __m128i limit = _mm_set1_epi8(-128 + 26);
+  const __m128i flip = _mm_set1_epi8(0x20);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((__m128i *)(p + i));
+    __m128i in_range = _mm_cmplt_epi8(_mm_add_epi8(x, shift), limit);
+    x = _mm_xor_si128(x, _mm_and_si128(in_range, flip));
+    _mm_storeu_si128((__m128i *)(p + i), x);
+  }
+  ascii_case_scalar(p + i, n - i, upper);
+}
+#endif
+
+void ascii_case(char *p, size_t n, bool upper) {
+#if defined(__x86_64__)
+  static void (*kernel)(char *, size_t, bool) = NULL;
+  if (!kernel)
+    kernel = __builtin_cpu_supports("avx2") ? ascii_case_avx2 : ascii_case_sse2;
+  kernel(p, n, upper);
+#else
+  ascii_case_scalar(p, n, upper);
+#endif
+}
+
+/**
+ * Reverse n bytes in place, eight bytes at a time from both ends
+ */
+void reverse_bytes(char *p, size_t n) {
+  char *a = p, *b = p + n;
+  while (b - a >= 16) {
+    uint64_t x, y;
+    memcpy(&x, a, 8);
+    memcpy(&y, b - 8, 8);
+    x = __builtin_bswap64(x);
+    y = __builtin_bswap64(y);
+    memcpy(a, &y, 8);
+    memcpy(b - 8, &x, 8);
+    a += 8;
+    b -= 8;
+  }
+  while (b - a > 1) {
+    char t = *a;
+    *a++ = *--b;
+    *b = t;
+  }
+}
+
+/*
+ * wyrand: a small, fast 64-bit PRNG. Seeded once per shell from
+ * SHELLAX_SEED (for reproducible runs) or from getrandom().
+ */
+__thread uint64_t prng_state;
+__thread bool prng_seeded = false;
+
+uint64_t prng_next() {
+  if (!prng_seeded) {
+    char *seed = getenv("SHELLAX_SEED");
+    if (seed)
+      prng_state = strtoull(seed, NULL, 0);
+    else if (getrandom(&prng_state, sizeof(prng_state), 0) !=
+             sizeof(prng_state))
+      prng_state = time(NULL) ^ ((uint64_t)getpid() << 32);
+    prng_seeded = true;
+  }
+  prng_state += 0xa0761d6478bd642fULL;
+  __uint128_t m = (__uint128_t)prng_state * (prng_state ^ 0xe7037ed1a0b428dbULL);
+  return (uint64_t)(m >> 64) ^ (uint64_t)m;
+}
+
+/**
+ * Uniform random number in [0, bound) (Lemire's multiply-shift)
+ */
+uint64_t prng_below(uint64_t bound) {
+  return (uint64_t)(((__uint128_t)prng_next() * bound) >> 64);
+}
+
+/**
+ * Fisher-Yates shuffle of n bytes in place
+ */
+void shuffle_bytes(char *p, size_t n) {
+  for (size_t i = n; i > 1; i--) {
+    size_t j = prng_below(i);
+    char t = p[i - 1];
+    p[i - 1] = p[j];
+    p[j] = t;
+  }
+}
+
+/**
+ * Print the lines of a buffer in reverse order
+ */
+void write_lines_reversed(const char *data, size_t size, FILE *out) {
+  size_t end = size;
+  if (end > 0 && data[end - 1] == '\n')
+    end--;
+  while (size > 0) {
+    const char *nl = end > 0 ? memrchr(data, '\n', end) : NULL;
+    size_t begin = nl ? (size_t)(nl - data) + 1 : 0;
+    fwrite(data + begin, 1, end - begin, out);
+    fputc('\n', out);
+    if (!nl)
+      break;
+    end = begin - 1;
+  }
+}
+
+/**
+ * rev-lines needs the whole input: regular files are mapped, anything else
+ * (pipes, terminals) is read into memory first
+ */
+void str_rev_lines(FILE *in, FILE *out) {
+  struct stat st;
+  int fd = fileno(in);
+  if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0)
+      pos = 0;
+    char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      write_lines_reversed(data + pos, st.st_size - pos, out);
+      munmap(data, st.st_size);
+      return;
+    }
+  }
+  size_t size = 0, cap = STREAM_CHUNK, n;
+  char *data = malloc(cap);
+  while ((n = fread(data + size, 1, cap - size, in)) > 0) {
+    size += n;
+    if (size == cap)
+      data = realloc(data, cap *= 2);
+  }
+  write_lines_reversed(data, size, out);
+  free(data);
+}
+
+/**
+ * Apply one str operation to a whole stream
+ * @return 0 on success, -1 for an unknown operation
+ */
+int str_stream(const char *op, FILE *in, FILE *out) {
+  if (strcmp(op, "rev-lines") == 0) {
+    str_rev_lines(in, out);
+    return 0;
+  }
+  bool upper = strcmp(op, "upper") == 0, lower = strcmp(op, "lower") == 0;
+  bool reverse = strcmp(op, "reverse") == 0, shuffle = strcmp(op, "shuffle") == 0;
+  if (!upper && !lower && !reverse && !shuffle)
+    return -1;
+
+  struct line_reader r;
+  char *block;
+  size_t n;
+  line_reader_init(&r, in);
+  while ((n = read_lines(&r, &block)) > 0) {
+    if (upper || lower) {
+      ascii_case(block, n, upper);
+    } else {
+      for (char *line = block, *stop = block + n; line < stop;) {
+        char *nl = memchr(line, '\n', stop - line);
+        size_t len = (nl ? nl : stop) - line;
+        if (reverse)
+          reverse_bytes(line, len);
+        else
+          shuffle_bytes(line, len);
+        line += len + 1;
+      }
+    }
+    fwrite(block, 1, n, out);
+  }
+  line_reader_free(&r);
+  return 0;
+}
+
+/**
+ * str <reverse|shuffle|upper|lower|rev-lines> [file...]
+ * Transforms stdin, or each file in turn. reverse and shuffle work on the
+ * characters of every line, rev-lines prints the lines in reverse order.
+ */
+int str_command(struct command_t *command, FILE *in, FILE *out) {
+  int argc = command->arg_count - 2, status = 0;
+  if (argc < 1) {
+    fprintf(stderr, "usage: str <reverse|shuffle|upper|lower|rev-lines> [file...]\n");
+    return 1;
+  }
+  const char *op = command->args[1];
+  if (argc == 1) {
+    if (str_stream(op, in, out) == -1) {
+      fprintf(stderr, "-%s: str: unknown operation '%s'\n", sysname, op);
+      return 1;
+    }
+    return 0;
+  }
+  for (int i = 2; i <= argc; i++) {
+    FILE *file = fopen(command->args[i], "re");
+    if (!file) {
+      fprintf(stderr, "-%s: str: %s: %s\n", sysname, command->args[i],
+              strerror(errno));
+      status = 1;
+      continue;
+    }
+    int r = str_stream(op, file, out);
+    fclose(file);
+    if (r == -1) {
+      fprintf(stderr, "-%s: str: unknown operation '%s'\n", sysname, op);
+      return 1;
+    }
+  }
+  return status;
+}
+// Question 3 part d starts: our third custom command ends
+
+/*
+ * match: the in-shell grep.
+ *   match [-c] [-v] [-F] [-e pattern]... [pattern] [file...]
+ * Patterns are extended regular expressions, unless none of them has a
+ * special character (or -F is given): then they are searched as literals,
+ * one with a vectorized substring search, several with Aho-Corasick.
+ * Regular expressions are compiled once to an NFA and run as a DFA whose
+ * states are built the first time they are reached and then reused for the
+ * rest of the input. Blocks of lines are searched as a whole; line bounds
+ * are only looked up around a hit.
+ */
+
+/*
+ * Literal search: compare the first and the last byte of the needle at 32
+ * (AVX2) or 16 (SSE2) positions at once and memcmp() only where both agree.
+ */
+const char *find_literal_scalar(const char *h, size_t n, const char *s,
+                                size_t m) {
+  return memmem(h, n, s, m);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) const char *
+find_literal_avx2(const char *h, size_t n, const char *s, size_t m) {
+  const __m256i first = _mm256_set1_epi8(s[0]);
+  const __m256i last = _mm256_set1_epi8(s[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(h + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(h + i + m - 1));
+    uint32_t mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(h + at, s, m) == 0)
+        return h + at;
+    }
+  }
+  return i < n ? find_literal_scalar(h + i, n - i, s, m) : NULL;
+}
+
+const char *find_literal_sse2(const char *h, size_t n, const char *s,
+                              size_t m) {
+  const __m128i first = _mm_set1_epi8(s[0]);
+  const __m128i last = _mm_set1_epi8(s[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(h + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(h + i + m - 1));
+    uint32_t mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    for (; mask; mask &= mask - 1) {
+      size_t at = i + __builtin_ctz(mask);
+      if (memcmp(h + at, s, m) == 0)
+        return h + at;
+    }
+  }
+  return i < n ? find_literal_scalar(h + i, n - i, s, m) : NULL;
+}
+#endif
+
+/**
+ * First occurrence of s (m bytes) in h (n bytes)
+ * @return pointer to it, NULL if there is none
+ */
+const char *find_literal(const char *h, size_t n, const char *s, size_t m) {
+  if (m == 0)
+    return h;
+  if (n < m)
+    return NULL;
+#if defined(__x86_64__)
+  static const char *(*kernel)(const char *, size_t, const char *, size_t) = NULL;
+  if (!kernel)
+    kernel = __builtin_cpu_supports("avx2") ? find_literal_avx2 : find_literal_sse2;
+  return kernel(h, n, s, m);
+#else
+  return find_literal_scalar(h, n, s, m);
+#endif
+}
+
+/*
+ * Aho-Corasick automaton over several literals, with every transition filled
+ * in (256 per node), so the scan is one table lookup per byte.
+ */
+struct aho_corasick {
+  int *next;   // [node * 256 + byte]
+  bool *match; // a pattern ends at this node (or at one of its suffixes)
+  int count, capacity;
+};
+
+int ac_node(struct aho_corasick *ac) {
+  if (ac->count == ac->capacity) {
+    ac->capacity = ac->capacity ? ac->capacity * 2 : 64;
+    ac->next = realloc(ac->next, ac->capacity * 256 * sizeof(int));
+    ac->match = realloc(ac->match, ac->capacity * sizeof(bool));
+  }
+  memset(ac->next + ac->count * 256, -1, 256 * sizeof(int));
+  ac->match[ac->count] = false;
+  return ac->count++;
+}
+
+void ac_build(struct aho_corasick *ac, char **patterns, int count) {
+  ac_node(ac);
+  for (int i = 0; i < count; i++) {
+    int node = 0;
+    for (const unsigned char *p = (const unsigned char *)patterns[i]; *p; p++) {
+      if (ac->next[node * 256 + *p] == -1) {
+        int child = ac_node(ac);
+        ac->next[node * 256 + *p] = child;
+      }
+      node = ac->next[node * 256 + *p];
+    }
+    ac->match[node] = true;
+  }
+  // breadth first: complete the transitions of each node from its failure link
+  int *queue = malloc(ac->count * sizeof(int)), *fail = calloc(ac->count, sizeof(int));
+  int head = 0, tail = 0;
+  for (int c = 0; c < 256; c++) {
+    int child = ac->next[c];
+    if (child == -1) {
+      ac->next[c] = 0;
+    } else {
+      fail[child] = 0;
+      queue[tail++] = child;
+    }
+  }
+  while (head < tail) {
+    int node = queue[head++];
+    ac->match[node] |= ac->match[fail[node]];
+    for (int c = 0; c < 256; c++) {
+      int child = ac->next[node * 256 + c];
+      int via_fail = ac->next[fail[node] * 256 + c];
+      if (child == -1) {
+        ac->next[node * 256 + c] = via_fail;
+      } else {
+        fail[child] = via_fail;
+        queue[tail++] = child;
+      }
+    }
+  }
+  free(queue);
+  free(fail);
+}
+
+const char *ac_find(const struct aho_corasick *ac, const char *p,
+                    const char *stop) {
+  if (ac->match[0])
+    return p; // the empty pattern
+  for (int node = 0; p < stop; p++) {
+    node = ac->next[node * 256 + (unsigned char)*p];
+    if (ac->match[node])
+      return p;
+  }
+  return NULL;
+}
+
+/*
+ * Regular expressions: Thompson NFA, then a lazily built DFA. Besides the 256
+ * byte values the alphabet has two markers fed around every line, so that ^
+ * and $ are ordinary symbols. Supported: literals, ., [...] and [^...] with
+ * ranges, \d \w \s (and their negations), \t, \ before any other character,
+ * grouping, |, *, +, ? and {n,m}.
+ */
+#define SYM_BOL 256
+#define SYM_EOL 257
+#define DFA_SYMBOLS 258
+#define DFA_MAX_STATES 4096
+
+enum { NFA_SET, NFA_SPLIT, NFA_EPSILON, NFA_MATCH };
+
+struct nfa_state {
+  int type;
+  uint64_t set[5]; // symbols matched by NFA_SET
+  int out, out1;
+};
+
+struct nfa_fragment {
+  int start, end; // end is an NFA_EPSILON whose out is still open
+};
+
+struct regex_parser {
+  const char *p;
+  struct nfa_state *states;
+  int count, capacity;
+  const char *error;
+};
+
+int nfa_add(struct regex_parser *rp, int type, int out, int out1) {
+  if (rp->count == rp->capacity) {
+    rp->capacity = rp->capacity ? rp->capacity * 2 : 64;
+    rp->states = realloc(rp->states, rp->capacity * sizeof(struct nfa_state));
+  }
+  struct nfa_state *s = &rp->states[rp->count];
+  memset(s, 0, sizeof(*s));
+  s->type = type;
+  s->out = out;
+  s->out1 = out1;
+  return rp->count++;
+}
+
+void set_add(uint64_t *set, int symbol) { set[symbol / 64] |= 1ULL << (symbol % 64); }
+
+bool set_has(const uint64_t *set, int symbol) {
+  return set[symbol / 64] >> (symbol % 64) & 1;
+}
+
+/**
+ * Add \d, \w, \s and friends (upper case: the complement) to a set
+ * @return false if c is not a class letter
+ */
+bool add_class_escape(uint64_t *set, char c) {
+  uint64_t class[5] = {0};
+  char lower = c | 0x20;
+  if (lower != 'd' && lower != 'w' && lower != 's')
+    return false;
+  for (int b = 0; b < 256; b++)
+    if ((lower == 'd' && b >= '0' && b <= '9') ||
+        (lower == 'w' && (is_name_char(b, false))) ||
+        (lower == 's' && (b == ' ' || (b >= '\t' && b <= '\r'))))
+      set_add(class, b);
+  for (int b = 0; b < 256; b++)
+    if (set_has(class, b) != (c != lower) && b != '\n')
+      set_add(set, b);
+  return true;
+}
+
+struct nfa_fragment nfa_set_fragment(struct regex_parser *rp, const uint64_t *set) {
+  int end = nfa_add(rp, NFA_EPSILON, -1, -1);
+  int start = nfa_add(rp, NFA_SET, end, -1);
+  memcpy(rp->states[start].set, set, sizeof(rp->states[start].set));
+  return (struct nfa_fragment){start, end};
+}
+
+struct nfa_fragment parse_alternation(struct regex_parser *rp);
+
+struct nfa_fragment parse_atom(struct regex_parser *rp) {
+  uint64_t set[5] = {0};
+  char c = *rp->p++;
+  if (c == '(') {
+    struct nfa_fragment inner = parse_alternation(rp);
+    if (*rp->p != ')')
+      rp->error = "unbalanced (";
+    else
+      rp->p++;
+    return inner;
+  }
+  if (c == '.') {
+    for (int b = 0; b < 256; b++)
+      if (b != '\n')
+        set_add(set, b);
+  } else if (c == '^') {
+    set_add(set, SYM_BOL);
+  } else if (c == '$') {
+    set_add(set, SYM_EOL);
+  } else if (c == '[') {
+    bool negate = *rp->p == '^';
+    uint64_t members[5] = {0};
+    if (negate)
+      rp->p++;
+    for (bool first = true; *rp->p && (first || *rp->p != ']'); first = false) {
+      unsigned char lo = *rp->p++;
+      if (lo == '\\' && *rp->p) {
+        if (add_class_escape(members, *rp->p)) {
+          rp->p++;
+          continue;
+        }
+        lo = *rp->p == 't' ? '\t' : *rp->p;
+        rp->p++;
+      }
+      unsigned char hi = lo;
+      if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+        hi = rp->p[1];
+        rp->p += 2;
+      }
+      for (int b = lo; b <= hi; b++)
+        set_add(members, b);
+    }
+    if (*rp->p != ']')
+      rp->error = "unbalanced [";
+    else
+      rp->p++;
+    for (int b = 0; b < 256; b++)
+      if (set_has(members, b) != negate && b != '\n')
+        set_add(set, b);
+  } else if (c == '\\' && *rp->p) {
+    c = *rp->p++;
+    if (!add_class_escape(set, c))
+      set_add(set, (unsigned char)(c == 't' ? '\t' : c));
+  } else {
+    set_add(set, (unsigned char)c);
+  }
+  return nfa_set_fragment(rp, set);
+}
+
+/**
+ * Apply *, + or ? to a fragment
+ */
+struct nfa_fragment nfa_repeat(struct regex_parser *rp, struct nfa_fragment f,
+                               char op) {
+  int end = nfa_add(rp, NFA_EPSILON, -1, -1);
+  int split = nfa_add(rp, NFA_SPLIT, f.start, end);
+  rp->states[f.end].out = op == '?' ? end : split;
+  return (struct nfa_fragment){op == '+' ? f.start : split, end};
+}
+
+/**
+ * Parse the bounds of {n}, {n,} or {n,m} at rp->p
+ * @return false (and nothing consumed) if there are none
+ */
+bool parse_bounds(struct regex_parser *rp, int *min, int *max) {
+  char *end;
+  if (*rp->p != '{' || !(rp->p[1] >= '0' && rp->p[1] <= '9'))
+    return false;
+  *min = *max = strtol(rp->p + 1, &end, 10);
+  if (*end == ',' && end[1] == '}') {
+    *max = -1;
+    end++;
+  } else if (*end == ',') {
+    *max = strtol(end + 1, &end, 10);
+  }
+  if (*end != '}' || *min > 255 || *max > 255 || (*max != -1 && *max < *min))
+    return false;
+  rp->p = end + 1;
+  return true;
+}
+
+struct nfa_fragment parse_repeat(struct regex_parser *rp) {
+  const char *atom = rp->p;
+  struct nfa_fragment f = parse_atom(rp);
+  int min, max;
+  if (parse_bounds(rp, &min, &max)) {
+    // a{n,m}: n copies of the atom, then m - n optional ones (or a*)
+    const char *rest = rp->p;
+    int empty = nfa_add(rp, NFA_EPSILON, -1, -1);
+    struct nfa_fragment all = {empty, empty};
+    for (int k = 0; k < (max == -1 ? min + 1 : max); k++) {
+      struct nfa_fragment copy = f;
+      if (k > 0) {
+        rp->p = atom;
+        copy = parse_atom(rp);
+      }
+      if (k >= min)
+        copy = nfa_repeat(rp, copy, max == -1 ? '*' : '?');
+      rp->states[all.end].out = copy.start;
+      all.end = copy.end;
+    }
+    rp->p = rest;
+    f = all;
+  }
+  while (*rp->p == '*' || *rp->p == '+' || *rp->p == '?')
+    f = nfa_repeat(rp, f, *rp->p++);
+  return f;
+}
+
+struct nfa_fragment parse_concatenation(struct regex_parser *rp) {
+  int empty = nfa_add(rp, NFA_EPSILON, -1, -1);
+  struct nfa_fragment f = {empty, empty};
+  while (*rp->p && *rp->p != '|' && *rp->p != ')' && !rp->error) {
+    if (*rp->p == '*' || *rp->p == '+' || *rp->p == '?') {
+      rp->error = "repetition of nothing";
+      break;
+    }
+    struct nfa_fragment next = parse_repeat(rp);
+    rp->states[f.end].out = next.start;
+    f.end = next.end;
+  }
+  return f;
+}
+
+struct nfa_fragment parse_alternation(struct regex_parser *rp) {
+  struct nfa_fragment f = parse_concatenation(rp);
+  while (*rp->p == '|' && !rp->error) {
+    rp->p++;
+    struct nfa_fragment other = parse_concatenation(rp);
+    int end = nfa_add(rp, NFA_EPSILON, -1, -1);
+    int split = nfa_add(rp, NFA_SPLIT, f.start, other.start);
+    rp->states[f.end].out = end;
+    rp->states[other.end].out = end;
+    f = (struct nfa_fragment){split, end};
+  }
+  return f;
+}
+
+struct dfa {
+  struct nfa_state *nfa;
+  int nfa_count, nfa_start;
+  int *members;     // NFA states of every DFA state, back to back
+  int *offset, *length;
+  bool *accept;
+  int *next;        // [state * DFA_SYMBOLS + symbol], -1 until computed
+  int count, members_used, members_capacity;
+  int *slots;       // hash table of DFA states by member set
+  int line_start;   // state after the start of line marker, -1 if unknown
+  long flushes;     // times the state cache was emptied
+  int *stack, *scratch;
+  uint32_t *seen, generation;
+};
+
+/**
+ * Compile patterns (alternatives of each other) to a DFA
+ * @return NULL with *error set if a pattern is malformed
+ */
+struct dfa *dfa_compile(char **patterns, int count, const char **error) {
+  struct regex_parser rp = {0};
+  // unanchored search: any prefix, then one of the patterns
+  uint64_t any[5] = {0};
+  for (int b = 0; b < 256; b++)
+    set_add(any, b);
+  set_add(any, SYM_BOL);
+  int match = nfa_add(&rp, NFA_MATCH, -1, -1);
+  int loop = nfa_add(&rp, NFA_SPLIT, -1, -1);
+  struct nfa_fragment anything = nfa_set_fragment(&rp, any);
+  rp.states[anything.end].out = loop;
+  rp.states[loop].out1 = anything.start;
+  int alternatives = -1;
+  for (int i = 0; i < count && !rp.error; i++) {
+    rp.p = patterns[i];
+    struct nfa_fragment f = parse_alternation(&rp);
+    if (*rp.p && !rp.error)
+      rp.error = "unbalanced )";
+    rp.states[f.end].out = match;
+    alternatives = alternatives == -1 ? f.start
+                                      : nfa_add(&rp, NFA_SPLIT, alternatives, f.start);
+  }
+  if (rp.error) {
+    *error = rp.error;
+    free(rp.states);
+    return NULL;
+  }
+  rp.states[loop].out = alternatives;
+
+  struct dfa *d = calloc(1, sizeof(struct dfa));
+  d->nfa = rp.states;
+  d->nfa_count = rp.count;
+  d->nfa_start = loop;
+  d->offset = malloc(DFA_MAX_STATES * sizeof(int));
+  d->length = malloc(DFA_MAX_STATES * sizeof(int));
+  d->accept = malloc(DFA_MAX_STATES * sizeof(bool));
+  d->next = malloc((size_t)DFA_MAX_STATES * DFA_SYMBOLS * sizeof(int));
+  d->slots = malloc(2 * DFA_MAX_STATES * sizeof(int));
+  d->stack = malloc(rp.count * sizeof(int));
+  d->scratch = malloc(rp.count * sizeof(int));
+  d->seen = calloc(rp.count, sizeof(uint32_t));
+  d->members_capacity = 1024;
+  d->members = malloc(d->members_capacity * sizeof(int));
+  memset(d->slots, -1, 2 * DFA_MAX_STATES * sizeof(int));
+  d->line_start = -1;
+  return d;
+}
+
+void dfa_free(struct dfa *d) {
+  free(d->nfa);
+  free(d->members);
+  free(d->offset);
+  free(d->length);
+  free(d->accept);
+  free(d->next);
+  free(d->slots);
+  free(d->stack);
+  free(d->scratch);
+  free(d->seen);
+  free(d);
+}
+
+int compare_ints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Epsilon closure of `count` NFA states in d->scratch, in place; only the
+ * states that consume a symbol or accept are kept, sorted
+ * @return size of the closure
+ */
+int dfa_closure(struct dfa *d, int count) {
+  int depth = 0, kept = 0;
+  d->generation++;
+  for (int i = 0; i < count; i++)
+    d->stack[depth++] = d->scratch[i];
+  while (depth > 0) {
+    int s = d->stack[--depth];
+    if (s == -1 || d->seen[s] == d->generation)
+      continue;
+    d->seen[s] = d->generation;
+    struct nfa_state *n = &d->nfa[s];
+    if (n->type == NFA_SET || n->type == NFA_MATCH)
+      d->scratch[kept++] = s;
+    if (n->type == NFA_SPLIT || n->type == NFA_EPSILON)
+      d->stack[depth++] = n->out;
+    if (n->type == NFA_SPLIT)
+      d->stack[depth++] = n->out1;
+  }
+  qsort(d->scratch, kept, sizeof(int), compare_ints);
+  return kept;
+}
+
+/**
+ * DFA state for the NFA states in d->scratch (a closure), added if new.
+ * A full cache is emptied first, states are rebuilt as they are reached.
+ */
+int dfa_state(struct dfa *d, int count) {
+  uint64_t hash = hash_bytes((const char *)d->scratch, count * sizeof(int));
+  size_t mask = 2 * DFA_MAX_STATES - 1;
+  size_t slot = hash & mask;
+  for (; d->slots[slot] != -1; slot = (slot + 1) & mask) {
+    int s = d->slots[slot];
+    if (d->length[s] == count &&
+        memcmp(d->members + d->offset[s], d->scratch, count * sizeof(int)) == 0)
+      return s;
+  }
+  if (d->count == DFA_MAX_STATES) {
+    d->flushes++;
+    d->count = d->members_used = 0;
+    d->line_start = -1;
+    memset(d->slots, -1, 2 * DFA_MAX_STATES * sizeof(int));
+    slot = hash & mask;
+  }
+  if (d->members_used + count > d->members_capacity) {
+    d->members_capacity = (d->members_used + count) * 2;
+    d->members = realloc(d->members, d->members_capacity * sizeof(int));
+  }
+  int s = d->count++;
+  memcpy(d->members + d->members_used, d->scratch, count * sizeof(int));
+  d->offset[s] = d->members_used;
+  d->length[s] = count;
+  d->members_used += count;
+  d->accept[s] = false;
+  for (int i = 0; i < count; i++)
+    d->accept[s] |= d->nfa[d->scratch[i]].type == NFA_MATCH;
+  memset(d->next + (size_t)s * DFA_SYMBOLS, -1, DFA_SYMBOLS * sizeof(int));
+  d->slots[slot] = s;
+  return s;
+}
+
+int dfa_step(struct dfa *d, int s, int symbol) {
+  int t = d->next[(size_t)s * DFA_SYMBOLS + symbol];
+  if (t != -1)
+    return t;
+  int count = 0;
+  for (int i = 0; i < d->length[s]; i++) {
+    struct nfa_state *n = &d->nfa[d->members[d->offset[s] + i]];
+    if (n->type == NFA_SET && set_has(n->set, symbol))
+      d->scratch[count++] = n->out;
+  }
+  long flushes = d->flushes;
+  t = dfa_state(d, dfa_closure(d, count));
+  if (d->flushes == flushes) // else s is gone with the rest of the cache
+    d->next[(size_t)s * DFA_SYMBOLS + symbol] = t;
+  return t;
+}
+
+bool dfa_match_line(struct dfa *d, const unsigned char *p, size_t len) {
+  if (d->line_start == -1) {
+    d->scratch[0] = d->nfa_start;
+    int start = dfa_state(d, dfa_closure(d, 1));
+    d->line_start = dfa_step(d, start, SYM_BOL);
+  }
+  int s = d->line_start;
+  for (size_t i = 0; i < len; i++) {
+    if (d->accept[s])
+      return true;
+    s = dfa_step(d, s, p[i]);
+  }
+  return d->accept[s] || d->accept[dfa_step(d, s, SYM_EOL)];
+}
+
+struct matcher {
+  const char *literal; // one literal pattern
+  size_t literal_len;
+  struct aho_corasick *ac; // several literal patterns
+  struct dfa *dfa;         // regular expressions
+};
+
+/**
+ * Find a line that matches in a block of whole lines
+ * @return a position inside the first matching line, NULL if there is none
+ */
+const char *matcher_find(struct matcher *m, const char *p, const char *stop) {
+  if (m->literal)
+    return find_literal(p, stop - p, m->literal, m->literal_len);
+  if (m->ac)
+    return ac_find(m->ac, p, stop);
+  while (p < stop) {
+    const char *nl = memchr(p, '\n', stop - p);
+    size_t len = (nl ? nl : stop) - p;
+    if (dfa_match_line(m->dfa, (const unsigned char *)p, len))
+      return p;
+    p += len + 1;
+  }
+  return NULL;
+}
+
+/**
+ * Set up a matcher for patterns that are all tried on every line
+ * @param  literal search the patterns as they are (-F, or no special
+ *                 character in any of them)
+ * @return         0, -1 if a pattern is malformed (reported on stderr)
+ */
+int matcher_init(struct matcher *m, char **patterns, int count, bool literal) {
+  memset(m, 0, sizeof(*m));
+  for (int i = 0; i < count && !literal; i++)
+    if (strpbrk(patterns[i], ".[]()*+?{|^$\\"))
+      break;
+    else if (i == count - 1)
+      literal = true;
+  if (literal && count == 1) {
+    m->literal = patterns[0];
+    m->literal_len = strlen(patterns[0]);
+  } else if (literal) {
+    m->ac = calloc(1, sizeof(struct aho_corasick));
+    ac_build(m->ac, patterns, count);
+  } else {
+    const char *error = NULL;
+    m->dfa = dfa_compile(patterns, count, &error);
+    if (!m->dfa) {
+      fprintf(stderr, "-%s: match: bad pattern: %s\n", sysname, error);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void matcher_free(struct matcher *m) {
+  if (m->ac) {
+    free(m->ac->next);
+    free(m->ac->match);
+    free(m->ac);
+  }
+  if (m->dfa)
+    dfa_free(m->dfa);
+}
+
+/**
+ * Number of lines in [p, stop), the last one may lack its '\n'
+ */
+long count_lines(const char *p, const char *stop) {
+  long lines = 0;
+  for (const char *nl; p < stop && (nl = memchr(p, '\n', stop - p)); p = nl + 1)
+    lines++;
+  return lines + (p < stop);
+}
+
+/**
+ * Write whole lines, each after `prefix` if there is one; a last line
+ * without '\n' gets one
+ */
+void write_lines(const char *p, const char *stop, const char *prefix, FILE *out) {
+  if (!prefix) {
+    fwrite(p, 1, stop - p, out);
+    if (stop[-1] != '\n')
+      fputc('\n', out);
+    return;
+  }
+  while (p < stop) {
+    const char *nl = memchr(p, '\n', stop - p);
+    const char *end = nl ? nl + 1 : stop;
+    fputs(prefix, out);
+    fwrite(p, 1, end - p, out);
+    if (!nl)
+      fputc('\n', out);
+    p = end;
+  }
+}
+
+/**
+ * Filter one input
+ * @param  prefix written before every selected line (file name), or NULL
+ * @return        number of selected lines
+ */
+long match_stream(struct matcher *m, FILE *in, FILE *out, bool invert,
+                  bool count_only, const char *prefix) {
+  struct line_reader r;
+  char *block;
+  size_t n;
+  long selected = 0;
+  line_reader_init(&r, in);
+  while ((n = read_lines(&r, &block)) > 0) {
+    const char *p = block, *stop = block + n;
+    while (p < stop) {
+      const char *hit = matcher_find(m, p, stop);
+      const char *from = p, *to = stop; // selected lines
+      if (hit) {
+        const char *nl = hit > p ? memrchr(p, '\n', hit - p) : NULL;
+        const char *line = nl ? nl + 1 : p;
+        const char *end = memchr(hit, '\n', stop - hit);
+        end = end ? end + 1 : stop;
+        if (invert)
+          to = line;
+        else
+          from = line, to = end;
+        p = end;
+      } else {
+        if (!invert)
+          break;
+        p = stop;
+      }
+      if (count_only)
+        selected += count_lines(from, to);
+      else if (from < to) {
+        selected++; // only whether anything was selected matters
+        write_lines(from, to, prefix, out);
+      }
+    }
+  }
+  line_reader_free(&r);
+  return selected;
+}
+
+int match_usage() {
+  fprintf(stderr, "usage: match [-c] [-v] [-F] [-e pattern]... [pattern] [file...]\n");
+  return 2;
+}
+
+/**
+ * match [-c] [-v] [-F] [-e pattern]... [pattern] [file...]
+ * Prints the lines of stdin (or of each file) that match any of the patterns;
+ * -v prints the others, -c only counts them. With several files, lines and
+ * counts are prefixed with the file name.
+ * @return 0 if a line was selected, 1 if none, 2 on error (like grep)
+ */
+int match_command(struct command_t *command, FILE *in, FILE *out) {
+  int argc = command->arg_count - 1, i = 1, count = 0;
+  bool invert = false, count_only = false, literal = false;
+  char **patterns = malloc(argc * sizeof(char *));
+  for (; i < argc && command->args[i][0] == '-' && command->args[i][1]; i++) {
+    const char *opt = command->args[i];
+    if (strcmp(opt, "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(opt, "-e") == 0 && i + 1 < argc) {
+      patterns[count++] = command->args[++i];
+    } else if (strspn(opt + 1, "cvF") == strlen(opt + 1)) {
+      invert |= strchr(opt, 'v') != NULL;
+      count_only |= strchr(opt, 'c') != NULL;
+      literal |= strchr(opt, 'F') != NULL;
+    } else {
+      free(patterns);
+      return match_usage();
+    }
+  }
+  if (count == 0) {
+    if (i == argc) {
+      free(patterns);
+      return match_usage();
+    }
+    patterns[count++] = command->args[i++];
+  }
+  struct matcher m;
+  if (matcher_init(&m, patterns, count, literal) == -1) {
+    free(patterns);
+    return 2;
+  }
+  free(patterns);
+
+  long selected = 0;
+  int status = 0, files = argc - i;
+  if (files == 0) {
+    selected = match_stream(&m, in, out, invert, count_only, NULL);
+    if (count_only)
+      fprintf(out, "%ld\n", selected);
+  }
+  for (; i < argc; i++) {
+    const char *path = command->args[i];
+    FILE *file = fopen(path, "re");
+    if (!file) {
+      fprintf(stderr, "-%s: match: %s: %s\n", sysname, path, strerror(errno));
+      status = 2;
+      continue;
+    }
+    char *prefix = NULL;
+    if (files > 1 && asprintf(&prefix, "%s:", path) == -1)
+      prefix = NULL;
+    long n = match_stream(&m, file, out, invert, count_only, prefix);
+    if (count_only)
+      fprintf(out, "%s%ld\n", prefix ? prefix : "", n);
+    selected += n;
+    free(prefix);
+    fclose(file);
+  }
+  matcher_free(&m);
+  return status ? status : selected == 0;
+}
+
+/**
+ * Lines of `in` containing a literal, as a stream to read back
+ * @return the lines (in memory), NULL on error
+ */
+FILE *match_lines(FILE *in, const char *literal) {
+  int fd = memfd_create("shellax-match", MFD_CLOEXEC);
+  FILE *out = fd == -1 ? NULL : fdopen(fd, "w+");
+  if (!out) {
+    if (fd != -1)
+      close(fd);
+    return NULL;
+  }
+  struct matcher m = {.literal = literal, .literal_len = strlen(literal)};
+  rewind(in);
+  match_stream(&m, in, out, false, false, NULL);
+  rewind(out);
+  return out;
+}
+
+
+
+
+
+
+/*
+ * myuniq counts every distinct line in a hash table and prints them in order
+ * of first occurrence, so it does one pass over the input whatever its order.
+ */
+struct uniq_entry {
+  char *line; // including its '\n', if it had one
+  size_t len;
+  uint64_t hash;
+  long count;
+};
+
+struct uniq_table {
+  struct uniq_entry *entries; // in order of first occurrence
+  size_t count, capacity;
+  size_t *slots; // entry index + 1, 0 for an empty slot
+  size_t mask;
+};
+
+void uniq_grow(struct uniq_table *t) {
+  size_t size = t->slots ? (t->mask + 1) * 2 : 1024;
+  free(t->slots);
+  t->slots = calloc(size, sizeof(size_t));
+  t->mask = size - 1;
+  for (size_t i = 0; i < t->count; i++) {
+    size_t s = t->entries[i].hash & t->mask;
+    while (t->slots[s])
+      s = (s + 1) & t->mask;
+    t->slots[s] = i + 1;
+  }
+}
+
+void uniq_add(struct uniq_table *t, const char *line, size_t len) {
+  uint64_t hash = hash_bytes(line, len);
+  if (!t->slots || t->count * 2 >= t->mask + 1)
+    uniq_grow(t);
+  size_t s = hash & t->mask;
+  for (; t->slots[s]; s = (s + 1) & t->mask) {
+    struct uniq_entry *e = &t->entries[t->slots[s] - 1];
+    if (e->hash == hash && e->len == len && memcmp(e->line, line, len) == 0) {
+      e->count++;
+      return;
+    }
+  }
+  if (t->count == t->capacity) {
+    t->capacity = t->capacity ? t->capacity * 2 : 1024;
+    t->entries = realloc(t->entries, t->capacity * sizeof(struct uniq_entry));
+  }
+  struct uniq_entry *e = &t->entries[t->count];
+  e->line = malloc(len);
+  memcpy(e->line, line, len);
+  e->len = len;
+  e->hash = hash;
+  e->count = 1;
+  t->slots[s] = ++t->count;
+}
+
+/*
+ * myuniq -top K: approximate heavy hitters in fixed memory (Space-Saving).
+ * A fixed number of counters is found by line through an open-addressing
+ * index on the line hash. A line without a counter takes over the smallest
+ * one and inherits its count as its possible error, so for every reported
+ * line: count - error <= true count <= count, and error is never above
+ * lines / counters. Any line seen more than lines / counters times is certain
+ * to be kept. Counters with the same count share a bucket and buckets are
+ * linked in increasing order (the "stream summary"), so counting a line and
+ * finding the smallest counter are both O(1).
+ */
+#define TOP_COUNTERS_MAX (INT_MAX / 2) // counters and buckets are int indices
+
+struct top_counter {
+  char *line;
+  size_t len, cap;
+  uint64_t hash;
+  long count, error;
+  int bucket, prev, next; // siblings in the bucket, -1 at the ends
+};
+
+struct top_bucket {
+  long count;
+  int first;      // first counter, -1 for a free bucket
+  int prev, next; // neighbours in increasing count order (or the free list)
+};
+
+struct top_summary {
+  struct top_counter *counters;
+  struct top_bucket *buckets;
+  int size, capacity;
+  int smallest, free_buckets; // bucket list heads
+  int *slots; // counter index + 1, 0 for an empty slot
+  size_t mask;
+  long lines;
+};
+
+/**
+ * Take a bucket from the free list and link it after `after` (-1: first)
+ */
+int top_new_bucket(struct top_summary *t, long count, int after) {
+  int b = t->free_buckets;
+  struct top_bucket *bucket = &t->buckets[b];
+  t->free_buckets = bucket->next;
+  bucket->count = count;
+  bucket->first = -1;
+  bucket->prev = after;
+  bucket->next = after == -1 ? t->smallest : t->buckets[after].next;
+  if (bucket->next != -1)
+    t->buckets[bucket->next].prev = b;
+  if (after == -1)
+    t->smallest = b;
+  else
+    t->buckets[after].next = b;
+  return b;
+}
+
+void top_detach(struct top_summary *t, int i) {
+  struct top_counter *c = &t->counters[i];
+  struct top_bucket *bucket = &t->buckets[c->bucket];
+  if (c->prev != -1)
+    t->counters[c->prev].next = c->next;
+  else
+    bucket->first = c->next;
+  if (c->next != -1)
+    t->counters[c->next].prev = c->prev;
+  if (bucket->first != -1)
+    return;
+  // the bucket is empty: unlink it and put it on the free list
+  if (bucket->prev != -1)
+    t->buckets[bucket->prev].next = bucket->next;
+  else
+    t->smallest = bucket->next;
+  if (bucket->next != -1)
+    t->buckets[bucket->next].prev = bucket->prev;
+  bucket->next = t->free_buckets;
+  t->free_buckets = c->bucket;
+}
+
+void top_attach(struct top_summary *t, int i, int b) {
+  struct top_counter *c = &t->counters[i];
+  c->bucket = b;
+  c->count = t->buckets[b].count;
+  c->prev = -1;
+  c->next = t->buckets[b].first;
+  if (c->next != -1)
+    t->counters[c->next].prev = i;
+  t->buckets[b].first = i;
+}
+
+/**
+ * Move a counter to the bucket of count + 1
+ */
+void top_increment(struct top_summary *t, int i) {
+  int b = t->counters[i].bucket;
+  long count = t->buckets[b].count + 1;
+  int next = t->buckets[b].next;
+  if (next == -1 || t->buckets[next].count != count)
+    next = top_new_bucket(t, count, b);
+  top_detach(t, i);
+  top_attach(t, i, next);
+}
+
+/**
+ * Remove a counter from the index, shifting back the entries that probed past
+ * it so that lookups need no tombstones
+ */
+void top_unindex(struct top_summary *t, int counter) {
+  size_t s = t->counters[counter].hash & t->mask;
+  while (t->slots[s] != counter + 1)
+    s = (s + 1) & t->mask;
+  for (size_t next = (s + 1) & t->mask; t->slots[next]; next = (next + 1) & t->mask) {
+    size_t home = t->counters[t->slots[next] - 1].hash & t->mask;
+    // move the entry into the hole unless its home lies in (s, next]
+    if (((next - home) & t->mask) >= ((next - s) & t->mask)) {
+      t->slots[s] = t->slots[next];
+      s = next;
+    }
+  }
+  t->slots[s] = 0;
+}
+
+void top_add(struct top_summary *t, const char *line, size_t len) {
+  uint64_t hash = hash_bytes(line, len);
+  size_t s = hash & t->mask;
+  t->lines++;
+  for (; t->slots[s]; s = (s + 1) & t->mask) {
+    struct top_counter *c = &t->counters[t->slots[s] - 1];
+    if (c->hash == hash && c->len == len && memcmp(c->line, line, len) == 0) {
+      top_increment(t, t->slots[s] - 1);
+      return;
+    }
+  }
+  int index;
+  if (t->size < t->capacity) {
+    index = t->size++;
+    int b = t->smallest != -1 && t->buckets[t->smallest].count == 1
+                ? t->smallest
+                : top_new_bucket(t, 1, -1);
+    top_attach(t, index, b);
+    t->counters[index].error = 0;
+  } else {
+    // take over a smallest counter
+    index = t->buckets[t->smallest].first;
+    t->counters[index].error = t->counters[index].count;
+    top_unindex(t, index);
+    top_increment(t, index);
+    s = hash & t->mask;
+    while (t->slots[s])
+      s = (s + 1) & t->mask;
+  }
+  struct top_counter *c = &t->counters[index];
+  if (c->cap < len)
+    c->line = realloc(c->line, c->cap = len);
+  memcpy(c->line, line, len);
+  c->len = len;
+  c->hash = hash;
+  t->slots[s] = index + 1;
+}
+
+int compare_top_counters(const void *a, const void *b) {
+  const struct top_counter *x = a, *y = b;
+  return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+/**
+ * myuniq -top K [-m counters]: the K most frequent lines, most frequent
+ * first, as "count ±error line"; a summary with the error bound goes to
+ * stderr
+ */
+int myuniq_top(struct command_t *command, FILE *in, FILE *out) {
+  long k = command->arg_count > 3 ? atol(command->args[2]) : 0, counters = 0;
+  if (command->arg_count > 5 && strcmp(command->args[3], "-m") == 0)
+    counters = atol(command->args[4]);
+  if (k <= 0 || counters < 0 || k > TOP_COUNTERS_MAX ||
+      counters > TOP_COUNTERS_MAX || command->arg_count > (counters ? 6 : 4)) {
+    fprintf(stderr, "usage: myuniq -top K [-m counters] (at most %d)\n",
+            TOP_COUNTERS_MAX);
+    return 1;
+  }
+  if (counters < k)
+    counters = k > TOP_COUNTERS_MAX / 8 ? TOP_COUNTERS_MAX
+                                        : k * 8 > 1024 ? k * 8 : 1024;
+  struct top_summary t = {.capacity = counters, .smallest = -1};
+  t.counters = calloc(counters, sizeof(struct top_counter));
+  // a bucket per counter at most, plus the one an increment opens before it
+  // frees the old one
+  t.buckets = malloc((counters + 1) * sizeof(struct top_bucket));
+  size_t slots = 1;
+  while (slots < 2 * (size_t)counters)
+    slots <<= 1;
+  t.slots = calloc(slots, sizeof(int));
+  t.mask = slots - 1;
+  if (!t.counters || !t.buckets || !t.slots) {
+    fprintf(stderr, "-%s: myuniq: %ld counters: %s\n", sysname, counters,
+            strerror(ENOMEM));
+    free(t.counters);
+    free(t.buckets);
+    free(t.slots);
+    return 1;
+  }
+  for (int i = 0; i <= counters; i++)
+    t.buckets[i].next = i < counters ? i + 1 : -1;
+
+  struct line_reader r;
+  char *block;
+  size_t n;
+  line_reader_init(&r, in);
+  while ((n = read_lines(&r, &block)) > 0) {
+    for (char *line = block, *stop = block + n; line < stop;) {
+      char *nl = memchr(line, '\n', stop - line);
+      size_t len = nl ? (size_t)(nl - line) + 1 : (size_t)(stop - line);
+      top_add(&t, line, len);
+      line += len;
+    }
+  }
+  line_reader_free(&r);
+
+  qsort(t.counters, t.size, sizeof(struct top_counter), compare_top_counters);
+  for (int i = 0; i < t.size && i < k; i++) {
+    struct top_counter *c = &t.counters[i];
+    fprintf(out, "%ld ±%ld ", c->count, c->error);
+    fwrite(c->line, 1, c->len, out);
+    if (c->line[c->len - 1] != '\n')
+      fputc('\n', out);
+  }
+  fprintf(stderr, "myuniq: %ld lines, %ld counters: counts are high by at most "
+                  "the ± value, which is at most %ld\n",
+          t.lines, counters, t.lines / counters);
+  for (int i = 0; i < t.capacity; i++)
+    free(t.counters[i].line);
+  free(t.counters);
+  free(t.buckets);
+  free(t.slots);
+  return 0;
+}
+
+int myUniq(struct command_t *command, FILE *in, FILE *out){ // our uniq function
+  bool counts = command->args[1] && (strcmp(command->args[1], "-c") == 0 ||
+                                     strcmp(command->args[1], "-C") == 0);
+  if (command->args[1] && strcmp(command->args[1], "-top") == 0)
+    return myuniq_top(command, in, out);
+  struct uniq_table table = {0};
+  struct line_reader r;
+  char *block;
+  size_t n;
+
+  line_reader_init(&r, in);
+  while ((n = read_lines(&r, &block)) > 0) {
+    for (char *line = block, *stop = block + n; line < stop;) {
+      char *nl = memchr(line, '\n', stop - line);
+      size_t len = nl ? (size_t)(nl - line) + 1 : (size_t)(stop - line);
+      uniq_add(&table, line, len);
+      line += len;
+    }
+  }
+  line_reader_free(&r);
+
+  for (size_t i = 0; i < table.count; i++) {
+    struct uniq_entry *e = &table.entries[i];
+    if (counts)
+      fprintf(out, "%ld ", e->count);
+    fwrite(e->line, 1, e->len, out);
+    free(e->line);
+  }
+  free(table.entries);
+  free(table.slots);
+  return 0;
+}
+
+/*
+ * mysort [-n] [-r] [-u] [-k N[,M]] [-S size] [file...]
+ * Lines are copied into an arena, block by block as they are read, and
+ * sorted as records that carry the first 8 bytes of their key (or, with -n,
+ * the number) in an integer, so most of the work is a radix sort that never
+ * touches the lines. The records are cut in one chunk per CPU, each chunk is
+ * sorted on its own thread and the chunks are merged pairwise, again in
+ * parallel. Input beyond
+ * the memory budget (-S, default 1G) is sorted in runs that are spilled to
+ * unnamed temporary files and merged at the end.
+ *   -n  compare the key as a number        -r  reverse the order
+ *   -u  print only the first of equal keys -k  key from field N (to M); a
+ *                                              field starts with its blanks
+ * Lines with equal keys are ordered by the whole line, as in sort(1).
+ */
+#define SORT_DEFAULT_MEMORY (1L << 30)
+#define SORT_ARENA_CHUNK (64L << 20)
+#define SORT_PARALLEL_MIN 65536 // fewer records are sorted on one thread
+
+long parse_size(const char *value);
+
+struct sort_options {
+  bool numeric, reverse, unique;
+  int key_field, key_last; // 1-based fields, 0: whole line / to the end
+};
+
+struct sort_record {
+  uint64_t prefix; // first key bytes big-endian, or the number's bits
+  const char *key;
+  const char *line; // ends with '\n'
+  uint32_t key_len, len; // len without the '\n'
+};
+
+/**
+ * Key of a line, with its prefix
+ * @param line '\n'-terminated line
+ * @param len  length without the '\n'
+ */
+void sort_key(const struct sort_options *o, const char *line, size_t len,
+              struct sort_record *r) {
+  const char *p = line, *end = line + len;
+  r->line = line;
+  r->len = len;
+  if (o->key_field > 0) {
+    // a field is its leading blanks and what follows up to the next blank
+    for (int field = 1; field < o->key_field; field++) {
+      while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+      while (p < end && *p != ' ' && *p != '\t')
+        p++;
+    }
+    const char *stop = p;
+    if (o->key_last >= o->key_field) {
+      for (int field = o->key_field; field <= o->key_last; field++) {
+        while (stop < end && (*stop == ' ' || *stop == '\t'))
+          stop++;
+        while (stop < end && *stop != ' ' && *stop != '\t')
+          stop++;
+      }
+      end = stop;
+    }
+  }
+  r->key = p;
+  r->key_len = end - p;
+  if (o->numeric) {
+    // [blanks][-]digits[.digits]; anything else counts as 0, like sort -n
+    const char *q = p;
+    while (q < end && (*q == ' ' || *q == '\t'))
+      q++;
+    bool negative = q < end && *q == '-';
+    q += negative;
+    double value = 0, scale = 1;
+    for (; q < end && *q >= '0' && *q <= '9'; q++)
+      value = value * 10 + (*q - '0');
+    if (q < end && *q == '.')
+      for (q++; q < end && *q >= '0' && *q <= '9'; q++)
+        value += (*q - '0') * (scale /= 10);
+    if (negative)
+      value = -value;
+    uint64_t bits;
+    memcpy(&bits, &value, 8);
+    // flip so that the unsigned order of the bits is the numeric order
+    r->prefix = bits >> 63 ? ~bits : bits | 1ULL << 63;
+    if (value == 0)
+      r->prefix = 1ULL << 63; // -0 and 0
+  } else {
+    uint64_t prefix = 0;
+    memcpy(&prefix, p, r->key_len < 8 ? r->key_len : 8);
+    r->prefix = __builtin_bswap64(prefix);
+  }
+}
+
+/**
+ * Compare keys only
+ */
+int sort_compare_keys(const struct sort_record *a, const struct sort_record *b,
+                      const struct sort_options *o) {
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  if (o->numeric)
+    return 0;
+  uint32_t n = a->key_len < b->key_len ? a->key_len : b->key_len;
+  int r = n > 8 ? memcmp(a->key + 8, b->key + 8, n - 8) : 0;
+  return r ? r : (a->key_len > b->key_len) - (a->key_len < b->key_len);
+}
+
+int sort_compare(const void *x, const void *y, void *options) {
+  const struct sort_record *a = x, *b = y;
+  const struct sort_options *o = options;
+  int r = sort_compare_keys(a, b, o);
+  if (r == 0 && !o->unique && (o->numeric || o->key_field > 0)) {
+    // last resort: the whole line
+    uint32_t n = a->len < b->len ? a->len : b->len;
+    r = memcmp(a->line, b->line, n);
+    if (r == 0)
+      r = (a->len > b->len) - (a->len < b->len);
+  }
+  return o->reverse ? -r : r;
+}
+
+/**
+ * Sort records: radix sort on the prefixes (least significant byte first,
+ * skipping bytes that are the same in every record), then the records that
+ * share a prefix by the full comparison
+ */
+void sort_records(struct sort_record *records, size_t n,
+                  const struct sort_options *o) {
+  size_t (*counts)[256] = n < 256 ? NULL : calloc(8, sizeof(*counts));
+  struct sort_record *buffer =
+      counts ? malloc(n * sizeof(struct sort_record)) : NULL;
+  if (!buffer) { // few records, or no memory for the radix passes
+    free(counts);
+    qsort_r(records, n, sizeof(struct sort_record), sort_compare, (void *)o);
+    return;
+  }
+  uint64_t flip = o->reverse ? ~0ULL : 0;
+  for (size_t i = 0; i < n; i++) {
+    uint64_t key = records[i].prefix ^ flip;
+    for (int b = 0; b < 8; b++)
+      counts[b][key >> (8 * b) & 0xff]++;
+  }
+  struct sort_record *from = records, *to = buffer;
+  for (int b = 0; b < 8; b++) {
+    size_t offsets[256], sum = 0;
+    bool same = false;
+    for (int v = 0; v < 256; v++) {
+      same |= counts[b][v] == n;
+      offsets[v] = sum;
+      sum += counts[b][v];
+    }
+    if (same)
+      continue;
+    for (size_t i = 0; i < n; i++)
+      to[offsets[(from[i].prefix ^ flip) >> (8 * b) & 0xff]++] = from[i];
+    struct sort_record *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != records)
+    memcpy(records, from, n * sizeof(struct sort_record));
+  free(buffer);
+  free(counts);
+  for (size_t i = 0, j; i < n; i = j) {
+    for (j = i + 1; j < n && records[j].prefix == records[i].prefix; j++)
+      ;
+    if (j - i > 1)
+      qsort_r(records + i, j - i, sizeof(struct sort_record), sort_compare,
+              (void *)o);
+  }
+}
+
+struct sort_task {
+  struct sort_record *from, *to;
+  size_t left, right; // lengths of the two halves to merge (right 0: sort)
+  const struct sort_options *options;
+};
+
+void *sort_worker(void *arg) {
+  struct sort_task *t = arg;
+  if (t->right == 0) {
+    sort_records(t->from, t->left, t->options);
+    return NULL;
+  }
+  struct sort_record *a = t->from, *a_end = a + t->left, *b = a_end,
+                     *b_end = b + t->right, *out = t->to;
+  while (a < a_end && b < b_end)
+    *out++ = sort_compare(b, a, (void *)t->options) < 0 ? *b++ : *a++;
+  memcpy(out, a, (a_end - a) * sizeof(*a));
+  out += a_end - a;
+  memcpy(out, b, (b_end - b) * sizeof(*b));
+  return NULL;
+}
+
+/**
+ * Sort records with one thread per allowed CPU
+ */
+void parallel_sort(struct sort_record *records, size_t n,
+                   const struct sort_options *o) {
+  cpu_set_t allowed;
+  int threads = sched_getaffinity(0, sizeof(allowed), &allowed) == 0
+                    ? CPU_COUNT(&allowed)
+                    : 1;
+  if (threads > 64)
+    threads = 64;
+  struct sort_record *buffer = threads < 2 || n < SORT_PARALLEL_MIN
+                                   ? NULL
+                                   : malloc(n * sizeof(struct sort_record));
+  if (!buffer) { // one CPU, little to sort, or no memory to merge into
+    sort_records(records, n, o);
+    return;
+  }
+  size_t bounds[65];
+  for (int i = 0; i <= threads; i++)
+    bounds[i] = n * i / threads;
+  // a task whose thread cannot be started runs on this one instead
+  pthread_t workers[64];
+  bool started[64];
+  struct sort_task tasks[64];
+  for (int i = 0; i < threads; i++) {
+    tasks[i] = (struct sort_task){records + bounds[i], NULL,
+                                  bounds[i + 1] - bounds[i], 0, o};
+    started[i] = pthread_create(&workers[i], NULL, sort_worker, &tasks[i]) == 0;
+    if (!started[i])
+      sort_worker(&tasks[i]);
+  }
+  for (int i = 0; i < threads; i++)
+    if (started[i])
+      pthread_join(workers[i], NULL);
+
+  // merge neighbouring runs, every pair of a level on its own thread
+  struct sort_record *from = records, *to = buffer;
+  for (int width = 1; width < threads; width *= 2) {
+    int count = 0;
+    for (int i = 0; i < threads; i += 2 * width) {
+      size_t start = bounds[i];
+      size_t middle = bounds[i + width < threads ? i + width : threads];
+      size_t stop = bounds[i + 2 * width < threads ? i + 2 * width : threads];
+      tasks[count] = (struct sort_task){from + start, to + start, middle - start,
+                                        stop - middle, o};
+      started[count] = false;
+      if (stop == middle) // nothing to merge with: copy
+        memcpy(to + start, from + start, (middle - start) * sizeof(*from));
+      else if (pthread_create(&workers[count], NULL, sort_worker,
+                              &tasks[count]) == 0)
+        started[count] = true;
+      else
+        sort_worker(&tasks[count]);
+      count++;
+    }
+    for (int i = 0; i < count; i++)
+      if (started[i])
+        pthread_join(workers[i], NULL);
+    struct sort_record *swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != records)
+    memcpy(records, from, n * sizeof(struct sort_record));
+  free(buffer);
+}
+
+struct sort_state {
+  struct sort_options options;
+  long budget;
+  char **chunks; // arena
+  int chunk_count;
+  size_t chunk_used, chunk_size;
+  struct sort_record *records;
+  size_t count, capacity;
+  size_t bytes; // arena and records in use
+  FILE **runs;  // spilled sorted runs
+  int run_count;
+  char *last; // previous line written, for -u
+  size_t last_len, last_cap;
+  bool has_last;
+};
+
+/**
+ * Copy a block of whole lines into the arena and index them
+ * @return 0, -1 when out of memory
+ */
+int sort_add_block(struct sort_state *s, const char *block, size_t n) {
+  bool terminated = block[n - 1] == '\n';
+  size_t need = n + !terminated;
+  if (s->chunk_count == 0 || s->chunk_used + need > s->chunk_size) {
+    size_t size = need > SORT_ARENA_CHUNK ? need : SORT_ARENA_CHUNK;
+    char **chunks = realloc(s->chunks, (s->chunk_count + 1) * sizeof(char *));
+    if (!chunks)
+      return -1;
+    s->chunks = chunks;
+    if (!(s->chunks[s->chunk_count] = malloc(size)))
+      return -1;
+    s->chunk_count++;
+    s->chunk_size = size;
+    s->chunk_used = 0;
+    s->bytes += size;
+  }
+  char *copy = s->chunks[s->chunk_count - 1] + s->chunk_used;
+  memcpy(copy, block, n);
+  if (!terminated)
+    copy[n] = '\n';
+  s->chunk_used += need;
+  for (char *line = copy, *stop = copy + need; line < stop;) {
+    char *nl = memchr(line, '\n', stop - line);
+    if (s->count == s->capacity) {
+      size_t capacity = s->capacity ? s->capacity * 2 : 65536;
+      struct sort_record *records =
+          realloc(s->records, capacity * sizeof(struct sort_record));
+      if (!records)
+        return -1;
+      s->records = records;
+      s->bytes += (capacity - s->capacity) * sizeof(struct sort_record);
+      s->capacity = capacity;
+    }
+    sort_key(&s->options, line, nl - line, &s->records[s->count++]);
+    line = nl + 1;
+  }
+  return 0;
+}
+
+/**
+ * Write a line, skipping it under -u when its key equals the previous one
+ */
+void sort_emit(struct sort_state *s, const struct sort_record *r, FILE *out) {
+  if (s->options.unique) {
+    if (s->has_last) {
+      struct sort_record last;
+      sort_key(&s->options, s->last, s->last_len, &last);
+      if (sort_compare_keys(&last, r, &s->options) == 0)
+        return;
+    }
+    if (s->last_cap < r->len + 1)
+      s->last = realloc(s->last, s->last_cap = 2 * (r->len + 1));
+    memcpy(s->last, r->line, r->len + 1);
+    s->last_len = r->len;
+    s->has_last = true;
+  }
+  fwrite(r->line, 1, r->len + 1, out);
+}
+
+void sort_reset_arena(struct sort_state *s) {
+  for (int i = 0; i < s->chunk_count; i++)
+    free(s->chunks[i]);
+  s->chunk_count = 0;
+  s->count = 0;
+  s->bytes = s->capacity * sizeof(struct sort_record);
+}
+
+/**
+ * Sort what is in memory and move it to a temporary file
+ * @return 0, -1 on error
+ */
+int sort_spill(struct sort_state *s) {
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  FILE *run = fd == -1 ? NULL : fdopen(fd, "w+");
+  if (!run) {
+    fprintf(stderr, "-%s: mysort: %s: %s\n", sysname, dir, strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  parallel_sort(s->records, s->count, &s->options);
+  s->has_last = false;
+  for (size_t i = 0; i < s->count; i++)
+    sort_emit(s, &s->records[i], run);
+  s->has_last = false;
+  if (fflush(run) == EOF) {
+    fprintf(stderr, "-%s: mysort: %s: %s\n", sysname, dir, strerror(errno));
+    fclose(run);
+    return -1;
+  }
+  rewind(run);
+  FILE **runs = realloc(s->runs, (s->run_count + 1) * sizeof(FILE *));
+  if (!runs) {
+    fprintf(stderr, "-%s: mysort: %s\n", sysname, strerror(errno));
+    fclose(run);
+    return -1;
+  }
+  s->runs = runs;
+  s->runs[s->run_count++] = run;
+  sort_reset_arena(s);
+  return 0;
+}
+
+int sort_read(struct sort_state *s, FILE *in) {
+  struct line_reader r;
+  char *block;
+  size_t n;
+  line_reader_init(&r, in);
+  while ((n = read_lines(&r, &block)) > 0) {
+    if (s->bytes + n > (size_t)s->budget && s->count > 0 && sort_spill(s) == -1) {
+      line_reader_free(&r);
+      return -1;
+    }
+    if (sort_add_block(s, block, n) == -1) {
+      fprintf(stderr, "-%s: mysort: %s\n", sysname, strerror(errno));
+      line_reader_free(&r);
+      return -1;
+    }
+  }
+  line_reader_free(&r);
+  return 0;
+}
+
+/**
+ * Merge the spilled runs and what is left in memory (already sorted)
+ */
+void sort_merge(struct sort_state *s, FILE *out) {
+  int sources = s->run_count + 1;
+  struct sort_record *heads = calloc(sources, sizeof(struct sort_record));
+  char **lines = calloc(sources, sizeof(char *));
+  size_t *caps = calloc(sources, sizeof(size_t));
+  bool *live = calloc(sources, sizeof(bool));
+  size_t next_memory = 0;
+  for (int i = 0; i < sources; i++) {
+    ssize_t len;
+    if (i < s->run_count) {
+      if ((live[i] = (len = getline(&lines[i], &caps[i], s->runs[i])) > 0))
+        sort_key(&s->options, lines[i], len - 1, &heads[i]);
+    } else if ((live[i] = next_memory < s->count)) {
+      heads[i] = s->records[next_memory++];
+    }
+  }
+  for (;;) {
+    int best = -1;
+    for (int i = 0; i < sources; i++)
+      if (live[i] && (best == -1 || sort_compare(&heads[i], &heads[best],
+                                                 &s->options) < 0))
+        best = i;
+    if (best == -1)
+      break;
+    sort_emit(s, &heads[best], out);
+    ssize_t len;
+    if (best < s->run_count) {
+      if ((live[best] = (len = getline(&lines[best], &caps[best],
+                                       s->runs[best])) > 0))
+        sort_key(&s->options, lines[best], len - 1, &heads[best]);
+    } else if ((live[best] = next_memory < s->count)) {
+      heads[best] = s->records[next_memory++];
+    }
+  }
+  for (int i = 0; i < sources; i++)
+    free(lines[i]);
+  free(lines);
+  free(caps);
+  free(live);
+  free(heads);
+}
+
+int mysort_usage() {
+  fprintf(stderr, "usage: mysort [-n] [-r] [-u] [-k N[,M]] [-S size] [file...]\n");
+  return 2;
+}
+
+int mysort_command(struct command_t *command, FILE *in, FILE *out) {
+  struct sort_state s = {.budget = SORT_DEFAULT_MEMORY};
+  int argc = command->arg_count - 1, i = 1, status = 0;
+  for (; i < argc && command->args[i][0] == '-' && command->args[i][1]; i++) {
+    const char *opt = command->args[i];
+    if (strcmp(opt, "-k") == 0 && i + 1 < argc) {
+      char *end;
+      s.options.key_field = strtol(command->args[++i], &end, 10);
+      s.options.key_last = *end == ',' ? atoi(end + 1) : 0;
+      if (s.options.key_field < 1)
+        return mysort_usage();
+    } else if (strcmp(opt, "-S") == 0 && i + 1 < argc) {
+      if ((s.budget = parse_size(command->args[++i])) <= 0)
+        return mysort_usage();
+    } else if (strspn(opt + 1, "nru") == strlen(opt + 1)) {
+      s.options.numeric |= strchr(opt, 'n') != NULL;
+      s.options.reverse |= strchr(opt, 'r') != NULL;
+      s.options.unique |= strchr(opt, 'u') != NULL;
+    } else {
+      return mysort_usage();
+    }
+  }
+  if (i == argc)
+    status = sort_read(&s, in) == -1 ? 2 : 0;
+  for (; i < argc && status != 2; i++) {
+    FILE *file = fopen(command->args[i], "re");
+    if (!file) {
+      fprintf(stderr, "-%s: mysort: %s: %s\n", sysname, command->args[i],
+              strerror(errno));
+      status = 2;
+      break;
+    }
+    if (sort_read(&s, file) == -1)
+      status = 2;
+    fclose(file);
+  }
+  if (status == 0) {
+    parallel_sort(s.records, s.count, &s.options);
+    if (s.run_count == 0) {
+      for (size_t k = 0; k < s.count; k++)
+        sort_emit(&s, &s.records[k], out);
+    } else {
+      sort_merge(&s, out);
+    }
+  }
+  for (int k = 0; k < s.run_count; k++)
+    fclose(s.runs[k]);
+  free(s.runs);
+  sort_reset_arena(&s);
+  free(s.chunks);
+  free(s.records);
+  free(s.last);
+  return status;
+}
+
+/*
+ * cat [file...]: copy files (or stdin, "-") to the output through the
+ * cheapest kernel path available for each source/destination pair:
+ *   copy_file_range  file -> file (may share extents, never enters userspace)
+ *   sendfile         file -> anything else (socket, tty, ...)
+ *   splice           pipe -> anything, anything -> pipe
+ *   read/write       everything else, with a large buffer
+ */
+#define COPY_CHUNK (1 << 30) // per-call limit for the kernel copy paths
+#define COPY_BUFFER (1 << 20)
+
+enum copy_result {
+  COPY_DONE,        // reached end of input
+  COPY_UNSUPPORTED, // method not usable for this pair, nothing was copied
+  COPY_FAILED,      // error after (possibly) copying some data
+};
+
+/**
+ * Map the errno of a failed kernel copy to a copy_result
+ * @param copied bytes moved so far by this method
+ */
+enum copy_result copy_failure(size_t copied) {
+  if (copied == 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                      errno == EOPNOTSUPP || errno == EBADF))
+    return COPY_UNSUPPORTED;
+  return COPY_FAILED;
+}
+
+enum copy_result copy_with_copy_file_range(int in, int out) {
+  size_t copied = 0;
+  while (1) {
+    ssize_t n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+    if (n == 0)
+      return COPY_DONE;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return copy_failure(copied);
+    }
+    copied += n;
+  }
+}
+
+enum copy_result copy_with_sendfile(int in, int out) {
+  size_t copied = 0;
+  while (1) {
+    ssize_t n = sendfile(out, in, NULL, COPY_CHUNK);
+    if (n == 0)
+      return COPY_DONE;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return copy_failure(copied);
+    }
+    copied += n;
+  }
+}
+
+enum copy_result copy_with_splice(int in, int out) {
+  size_t copied = 0;
+  while (1) {
+    ssize_t n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+    if (n == 0)
+      return COPY_DONE;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return copy_failure(copied);
+    }
+    copied += n;
+  }
+}
+
+enum copy_result copy_with_read_write(int in, int out) {
+  static __thread char *buf = NULL;
+  if (!buf)
+    buf = malloc(COPY_BUFFER);
+  while (1) {
+    ssize_t n = read(in, buf, COPY_BUFFER);
+    if (n == 0)
+      return COPY_DONE;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return COPY_FAILED;
+    }
+    for (ssize_t done = 0; done < n;) {
+      ssize_t w = write(out, buf + done, n - done);
+      if (w < 0) {
+        if (errno == EINTR)
+          continue;
+        return COPY_FAILED;
+      }
+      done += w;
+    }
+  }
+}
+
+/**
+ * Copy everything from one descriptor to another
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int copy_fd(int in, int out) {
+  struct stat in_st, out_st;
+  if (fstat(in, &in_st) == -1 || fstat(out, &out_st) == -1)
+    return -1;
+  bool in_file = S_ISREG(in_st.st_mode), out_file = S_ISREG(out_st.st_mode);
+  bool in_pipe = S_ISFIFO(in_st.st_mode), out_pipe = S_ISFIFO(out_st.st_mode);
+  enum copy_result r = COPY_UNSUPPORTED;
+
+  if (in_file && out_file)
+    r = copy_with_copy_file_range(in, out); // not for O_APPEND outputs
+  if (r == COPY_UNSUPPORTED && in_file)
+    r = copy_with_sendfile(in, out);
+  if (r == COPY_UNSUPPORTED && (in_pipe || out_pipe))
+    r = copy_with_splice(in, out);
+  if (r == COPY_UNSUPPORTED)
+    r = copy_with_read_write(in, out);
+  return r == COPY_DONE ? 0 : -1;
+}
+
+/**
+ * Copy a stream to another, through copy_fd() when both have a descriptor
+ * (channel streams of in-process pipelines do not)
+ * @return 0 on success, -1 on error
+ */
+int copy_stream(FILE *in, FILE *out) {
+  fflush(out);
+  int in_fd = fileno(in), out_fd = fileno(out);
+  if (in_fd != -1 && out_fd != -1)
+    return copy_fd(in_fd, out_fd);
+  char *buf = malloc(COPY_BUFFER);
+  if (!buf)
+    return -1; // errno is ENOMEM
+  size_t n;
+  int status = 0;
+  while ((n = fread(buf, 1, COPY_BUFFER, in)) > 0)
+    if (fwrite(buf, 1, n, out) != n) {
+      status = -1;
+      break;
+    }
+  free(buf);
+  return status;
+}
+
+int cat_command(struct command_t *command, FILE *in, FILE *out) {
+  int argc = command->arg_count - 2, status = 0;
+  for (int i = 1; i <= argc || (argc == 0 && i == 1); i++) {
+    const char *path = argc ? command->args[i] : "-";
+    if (strcmp(path, "-") == 0) {
+      if (copy_stream(in, out) == -1)
+        goto write_error;
+      continue;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "-%s: cat: %s: %s\n", sysname, path, strerror(errno));
+      status = 1;
+      continue;
+    }
+    fflush(out);
+    int r = fileno(out) != -1 ? copy_fd(fd, fileno(out)) : -2;
+    if (r == -2) {
+      FILE *file = fdopen(fd, "r");
+      if (file) {
+        r = copy_stream(file, out);
+        fclose(file);
+      } else {
+        r = -1;
+        close(fd);
+      }
+    } else {
+      close(fd);
+    }
+    if (r == -1)
+      goto write_error;
+  }
+  return status;
+
+write_error:
+  if (errno != EPIPE)
+    fprintf(stderr, "-%s: cat: %s\n", sysname, strerror(errno));
+  return 1;
+}
+
+/*
+ * parallel [-j N] [-n max_args | -X] <command...> [::: arg...]
+ * Runs command once per argument (or per batch of arguments) with at most N
+ * jobs at a time. Arguments come after ::: or, one per line, from the input.
+ * {} in the command is replaced by the arguments, otherwise they are
+ * appended. -X packs as many arguments per job as fit in ARG_MAX. Each job's
+ * stdout and stderr are buffered and written as one block when it finishes,
+ * so outputs never interleave; a failing job does not stop the others.
+ */
+struct parallel_job {
+  pid_t pid;
+  uint64_t start;
+  int fds[2];            // stdout and stderr pipes, -1 once at EOF
+  struct buffer output[2];
+};
+
+struct parallel_args {
+  char **args; // arguments after :::, or NULL to read lines from `in`
+  int count, next;
+  FILE *in;
+  char *line;
+  size_t line_cap;
+};
+
+/**
+ * Next argument of the job list, NULL when there are no more
+ */
+char *parallel_next_arg(struct parallel_args *a) {
+  if (a->args)
+    return a->next < a->count ? strdup(a->args[a->next++]) : NULL;
+  ssize_t n;
+  while ((n = getline(&a->line, &a->line_cap, a->in)) != -1) {
+    if (n > 0 && a->line[n - 1] == '\n')
+      a->line[--n] = 0;
+    if (n > 0)
+      return strdup(a->line);
+  }
+  return NULL;
+}
+
+/**
+ * Space the environment takes from ARG_MAX
+ */
+long environment_size() {
+  extern char **environ;
+  long size = 0;
+  for (char **e = environ; *e; e++)
+    size += strlen(*e) + 1 + sizeof(char *);
+  return size;
+}
+
+/**
+ * Build the argv of the next job
+ * @param  template command words (before :::)
+ * @param  words    number of command words
+ * @param  a        argument source
+ * @param  max_args arguments per job (0: pack up to ARG_MAX)
+ * @return          malloc'd NULL-terminated argv, NULL when no arguments remain
+ */
+char **parallel_build_job(char **template, int words, struct parallel_args *a,
+                          int max_args) {
+  static long budget = 0;
+  if (!budget)
+    budget = sysconf(_SC_ARG_MAX) - environment_size() - 4096;
+  char **batch = NULL, *arg;
+  int count = 0;
+  long used = 0;
+  for (int i = 0; i < words; i++)
+    used += strlen(template[i]) + 1 + sizeof(char *);
+  while ((max_args == 0 || count < max_args) && (arg = parallel_next_arg(a))) {
+    batch = realloc(batch, (count + 1) * sizeof(char *));
+    batch[count++] = arg;
+    used += strlen(arg) + 1 + sizeof(char *);
+    if (max_args == 0 && used > budget / 2)
+      break; // leave room for the arguments {} may be repeated into
+  }
+  if (count == 0)
+    return NULL;
+
+  bool placeholder = false;
+  for (int i = 0; i < words; i++)
+    placeholder |= strcmp(template[i], "{}") == 0;
+  char **argv = malloc((words + count * (placeholder ? words : 1) + 1) *
+                       sizeof(char *));
+  int n = 0;
+  for (int i = 0; i < words; i++) {
+    if (strcmp(template[i], "{}") == 0)
+      for (int k = 0; k < count; k++)
+        argv[n++] = strdup(batch[k]);
+    else
+      argv[n++] = strdup(template[i]);
+  }
+  if (!placeholder)
+    for (int k = 0; k < count; k++)
+      argv[n++] = strdup(batch[k]);
+  argv[n] = NULL;
+  for (int k = 0; k < count; k++)
+    free(batch[k]);
+  free(batch);
+  return argv;
+}
+
+void free_argv(char **argv) {
+  for (char **p = argv; *p; p++)
+    free(*p);
+  free(argv);
+}
+
+/**
+ * Start a job with its stdout and stderr captured
+ * @return 0 on success, -1 if it could not be started
+ */
+int parallel_start(struct parallel_job *job, char **argv) {
+  int out[2], err[2];
+  if (pipe2(out, O_CLOEXEC) == -1)
+    return -1;
+  if (pipe2(err, O_CLOEXEC) == -1) {
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  job->start = trace_now();
+  job->pid = fork();
+  if (job->pid == -1) {
+    close(out[0]);
+    close(out[1]);
+    close(err[0]);
+    close(err[1]);
+    return -1;
+  }
+  if (job->pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    dup2(err[1], STDERR_FILENO);
+    // never let a job read the shell's stdin
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (devnull == -1) {
+      fprintf(stderr, "-%s: parallel: /dev/null: %s\n", sysname,
+              strerror(errno));
+      _exit(127);
+    }
+    dup2(devnull, STDIN_FILENO);
+    struct command_t command = {0};
+    int argc = 0;
+    while (argv[argc])
+      argc++;
+    command.name = argv[0];
+    command.args = argv;
+    command.arg_count = argc + 1;
+    exec_command(&command);
+  }
+  close(out[1]);
+  close(err[1]);
+  job->fds[0] = out[0];
+  job->fds[1] = err[0];
+  job->output[0].len = job->output[1].len = 0;
+  return 0;
+}
+
+int parallel_command(struct command_t *command, FILE *in, FILE *out) {
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN), max_args = 1, first = 1;
+  int last = command->arg_count - 1; // args[last] is NULL
+  while (first < last && command->args[first][0] == '-') {
+    char *opt = command->args[first];
+    if (strcmp(opt, "-X") == 0) {
+      max_args = 0;
+      first++;
+    } else if ((strcmp(opt, "-j") == 0 || strcmp(opt, "-n") == 0) &&
+               first + 1 < last) {
+      int value = atoi(command->args[first + 1]);
+      if (value < 1) {
+        fprintf(stderr, "-%s: parallel: %s must be at least 1\n", sysname, opt);
+        return 1;
+      }
+      *(opt[1] == 'j' ? &jobs : &max_args) = value;
+      first += 2;
+    } else {
+      break;
+    }
+  }
+  int words = 0;
+  while (first + words < last && strcmp(command->args[first + words], ":::") != 0)
+    words++;
+  if (words == 0) {
+    fprintf(stderr, "usage: parallel [-j N] [-n max_args | -X] <command...> "
+                    "[::: arg...]\n");
+    return 1;
+  }
+  struct parallel_args source = {0};
+  source.in = in;
+  if (first + words < last) {
+    source.args = command->args + first + words + 1;
+    source.count = last - (first + words + 1);
+  }
+
+  struct parallel_job *slots = calloc(jobs, sizeof(struct parallel_job));
+  struct pollfd *fds = malloc(2 * jobs * sizeof(struct pollfd));
+  int *owners = malloc(2 * jobs * sizeof(int)); // job * 2 + stream of fds[]
+  int running = 0, failed = 0, total = 0;
+  bool exhausted = false;
+  while (1) {
+    // keep every slot busy
+    for (int i = 0; i < jobs && !exhausted; i++) {
+      if (slots[i].pid > 0)
+        continue;
+      char **argv = parallel_build_job(command->args + first, words, &source,
+                                       max_args);
+      if (!argv) {
+        exhausted = true;
+        break;
+      }
+      total++;
+      if (parallel_start(&slots[i], argv) == -1) {
+        fprintf(stderr, "-%s: parallel: %s: %s\n", sysname, argv[0],
+                strerror(errno));
+        failed++;
+      } else {
+        running++;
+      }
+      free_argv(argv);
+    }
+    if (running == 0)
+      break;
+
+    int nfds = 0;
+    for (int i = 0; i < jobs; i++)
+      for (int k = 0; k < 2; k++)
+        if (slots[i].pid > 0 && slots[i].fds[k] != -1) {
+          fds[nfds] = (struct pollfd){.fd = slots[i].fds[k], .events = POLLIN};
+          owners[nfds++] = i * 2 + k;
+        }
+    if (poll(fds, nfds, -1) == -1 && errno != EINTR)
+      break;
+
+    char chunk[65536];
+    for (int f = 0; f < nfds; f++) {
+      if (!fds[f].revents)
+        continue;
+      struct parallel_job *job = &slots[owners[f] / 2];
+      int k = owners[f] % 2;
+      ssize_t n = read(job->fds[k], chunk, sizeof(chunk));
+      if (n > 0) {
+        buffer_append(&job->output[k], chunk, n);
+      } else if (n == 0 || errno != EINTR) {
+        close(job->fds[k]);
+        job->fds[k] = -1;
+      }
+    }
+    for (int i = 0; i < jobs; i++) {
+      struct parallel_job *job = &slots[i];
+      if (job->pid <= 0 || job->fds[0] != -1 || job->fds[1] != -1)
+        continue;
+      // the job closed both outputs: collect it and print its output
+      int status;
+      wait_stage(job->pid, &status, job->start, command->args[first]);
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        failed++;
+      fwrite(job->output[0].data, 1, job->output[0].len, out);
+      fflush(out);
+      fwrite(job->output[1].data, 1, job->output[1].len, stderr);
+      job->pid = 0;
+      running--;
+    }
+  }
+  for (int i = 0; i < jobs; i++) {
+    free(slots[i].output[0].data);
+    free(slots[i].output[1].data);
+  }
+  free(slots);
+  free(fds);
+  free(owners);
+  free(source.line);
+  if (failed)
+    fprintf(stderr, "-%s: parallel: %d of %d jobs failed\n", sysname, failed,
+            total);
+  return failed != 0;
+}
+
+/*
+ * Builtins that can run as a pipeline stage: they read `in` and write `out`
+ */
+const char *stream_builtins[] = {"myuniq", "str", "first", "last", "cat", "stats", "parallel", "match", "mysort", NULL};
+
+/**
+ * Whether a command is handled by a stream builtin. cat with options is left
+ * to the external binary.
+ */
+bool is_stream_builtin(struct command_t *command) {
+  if (strcmp(command->name, "cat") == 0)
+    for (int i = 1; i < command->arg_count - 1; i++)
+      if (command->args[i][0] == '-' && command->args[i][1] != 0)
+        return false;
+  for (int i = 0; stream_builtins[i]; i++)
+    if (strcmp(command->name, stream_builtins[i]) == 0)
+      return true;
+  return false;
+}
+
+/**
+ * Run a stream builtin
+ * @param  command parsed command
+ * @param  in      input stream
+ * @param  out     output stream
+ * @return         exit status of the builtin, -1 if it is not a stream builtin
+ */
+int run_stream_builtin(struct command_t *command, FILE *in, FILE *out) {
+  if (strcmp(command->name, "myuniq") == 0)
+    return myUniq(command, in, out);
+  if (strcmp(command->name, "str") == 0)
+    return str_command(command, in, out);
+  if (strcmp(command->name, "first") == 0)
+    return first_x_lines(command, in, out);
+  if (strcmp(command->name, "last") == 0)
+    return last_x_lines(command, in, out);
+  if (strcmp(command->name, "cat") == 0 && is_stream_builtin(command))
+    return cat_command(command, in, out);
+  if (strcmp(command->name, "stats") == 0)
+    return stats_command(command, in, out);
+  if (strcmp(command->name, "parallel") == 0)
+    return parallel_command(command, in, out);
+  if (strcmp(command->name, "match") == 0)
+    return match_command(command, in, out);
+  if (strcmp(command->name, "mysort") == 0)
+    return mysort_command(command, in, out);
+  return -1;
+}
+
+/**
+ * Open a redirection target and move it onto a descriptor
+ * @param  path   file to open
+ * @param  flags  open(2) flags
+ * @param  target descriptor to replace (0 or 1)
+ * @return        0 on success, -1 on error (reported on stderr)
+ */
+int redirect_fd(const char *path, int flags, int target) {
+  int fd = open(path, flags | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    fprintf(stderr, "-%s: %s: %s\n", sysname, path, strerror(errno));
+    return -1;
+  }
+  if (fd != target) {
+    dup2(fd, target);
+    close(fd);
+  }
+  return 0;
+}
+
+/**
+ * Parse a size in bytes with an optional k, m or g suffix
+ * @return the size, 0 if it is not a valid size
+ */
+long parse_size(const char *value) {
+  char *unit;
+  long size = strtol(value, &unit, 10);
+  if (*unit == 'k' || *unit == 'K')
+    size <<= 10;
+  else if (*unit == 'm' || *unit == 'M')
+    size <<= 20;
+  else if (*unit == 'g' || *unit == 'G')
+    size <<= 30;
+  return size > 0 ? size : 0;
+}
+
+/**
+ * Pipe capacity requested through SHELLAX_PIPE_SIZE (bytes, or with a k/m
+ * suffix), 0 to keep the kernel default
+ */
+int pipe_size_setting() {
+  char *value = getenv("SHELLAX_PIPE_SIZE");
+  long size = value ? parse_size(value) : 0;
+  return size <= INT32_MAX ? size : 0;
+}
+
+/**
+ * Resize a pipe to the configured capacity. The kernel rounds the size up to
+ * a power of two pages and caps unprivileged users at
+ * /proc/sys/fs/pipe-max-size.
+ */
+void tune_pipe(int fd, int size) {
+  static bool warned = false;
+  if (size > 0 && fcntl(fd, F_SETPIPE_SZ, size) == -1 && !warned) {
+    fprintf(stderr, "-%s: SHELLAX_PIPE_SIZE=%d: %s\n", sysname, size,
+            strerror(errno));
+    warned = true;
+  }
+}
+
+/**
+ * Open the redirections of a pipeline as streams: the input redirection of its
+ * first stage and the output redirection of its last stage
+ * @param  first first stage
+ * @param  last  last stage
+ * @param  in    stdin, or the opened input file
+ * @param  out   stdout, or the opened output file
+ * @return       0 on success, -1 on error (reported on stderr)
+ */
+int open_redirect_streams(struct command_t *first, struct command_t *last,
+                          FILE **in, FILE **out) {
+  *in = stdin;
+  *out = stdout;
+  if (has_input(first)) {
+    int fd = open_input(first);
+    if (fd == -1)
+      return -1;
+    *in = fdopen(fd, "r");
+  }
+  const char *target = last->redirects[1] ? last->redirects[1]
+                                          : last->redirects[2];
+  if (target && !(*out = fopen(target, last->redirects[1] ? "we" : "ae"))) {
+    fprintf(stderr, "-%s: %s: %s\n", sysname, target, strerror(errno));
+    if (*in != stdin)
+      fclose(*in);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Close the streams opened by open_redirect_streams()
+ */
+void close_redirect_streams(FILE *in, FILE *out) {
+  if (in != stdin)
+    fclose(in);
+  else
+    clearerr(stdin); // a builtin may have consumed an interactive EOF
+  if (out != stdout)
+    fclose(out);
+  else
+    fflush(stdout);
+}
+
+/**
+ * Run a stream builtin in the shell process, honouring its redirections
+ * @param  command parsed command
+ * @return         exit status of the builtin
+ */
+int run_stream_builtin_redirected(struct command_t *command) {
+  FILE *in, *out;
+  if (open_redirect_streams(command, command, &in, &out) == -1)
+    return 1;
+  int status = run_stream_builtin(command, in, out);
+  close_redirect_streams(in, out);
+  return status;
+}
+
+/*
+ * memo: on-disk cache of a command's stdout and exit status.
+ * The key is the command line, the working directory, the environment
+ * variables that commonly change output and the identity (device, inode, size,
+ * mtime) of the executable and of every argument or input redirect naming an
+ * existing file. Each entry is one file in the memo directory: a header, the
+ * full key (compared on every hit, so a hash collision is only a miss) and the
+ * captured output, which is replayed with copy_fd() (sendfile or
+ * copy_file_range straight from the page cache). The least recently used
+ * entries are evicted once the directory grows past SHELLAX_MEMO_MAX.
+ */
+#define MEMO_MAGIC 0x314f4d45584c4853ULL // "SHLXEMO1"
+#define MEMO_DEFAULT_MAX (256L << 20)
+
+struct memo_header {
+  uint64_t magic;
+  uint64_t output_size;
+  uint32_t key_size;
+  int32_t status;
+};
+
+struct memo_entry {
+  char name[64];
+  off_t size;
+  struct timespec mtime;
+};
+
+long memo_hits = 0, memo_misses = 0, memo_evictions = 0;
+
+// variables that are part of every key, on top of SHELLAX_MEMO_ENV
+const char *memo_env[] = {"PATH",     "HOME",       "USER",     "LANG",
+                          "LC_ALL",   "LC_COLLATE", "LC_CTYPE", "LC_NUMERIC",
+                          "LC_TIME",  "TZ",         NULL};
+
+/**
+ * Directory of the memo cache, created if needed: SHELLAX_MEMO_DIR, or
+ * shellax/memo under $XDG_CACHE_HOME or ~/.cache
+ * @return 0 on success, -1 on error
+ */
+int memo_dir(char *path, size_t size) {
+  if (getenv("SHELLAX_MEMO_DIR"))
+    snprintf(path, size, "%s", getenv("SHELLAX_MEMO_DIR"));
+  else if (getenv("XDG_CACHE_HOME"))
+    snprintf(path, size, "%s/shellax/memo", getenv("XDG_CACHE_HOME"));
+  else if (getenv("HOME"))
+    snprintf(path, size, "%s/.cache/shellax/memo", getenv("HOME"));
+  else
+    return -1;
+  for (char *p = path + 1; *p; p++) {
+    if (*p == '/') {
+      *p = 0;
+      mkdir(path, 0700);
+      *p = '/';
+    }
+  }
+  return mkdir(path, 0700) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+long memo_max_size() {
+  char *value = getenv("SHELLAX_MEMO_MAX");
+  long size = value ? parse_size(value) : 0;
+  return size > 0 ? size : MEMO_DEFAULT_MAX;
+}
+
+void memo_key_file(struct buffer *key, const char *path) {
+  struct stat st;
+  char line[PATH_MAX + 128];
+  if (stat(path, &st) == -1)
+    return;
+  int n = snprintf(line, sizeof(line), "file %s %lx:%lx %lld %lld.%09ld\n",
+                   path, (long)st.st_dev, (long)st.st_ino,
+                   (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                   st.st_mtim.tv_nsec);
+  buffer_append(key, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+}
+
+void memo_key_env(struct buffer *key, const char *name) {
+  char *value = getenv(name);
+  buffer_append(key, name, strlen(name));
+  buffer_append(key, value ? "=" : "\n", 1);
+  if (value) {
+    buffer_append(key, value, strlen(value));
+    buffer_append(key, "\n", 1);
+  }
+}
+
+/**
+ * Build the cache key of a command line
+ * @param command the memo command (its arguments from index 1 on)
+ * @param line    the command line being memoized
+ */
+void memo_key(struct command_t *command, const char *line, struct buffer *key) {
+  char cwd[PATH_MAX], path[PATH_MAX];
+  buffer_append(key, line, strlen(line));
+  buffer_append(key, "\n", 1);
+  if (getcwd(cwd, sizeof(cwd))) {
+    buffer_append(key, cwd, strlen(cwd));
+    buffer_append(key, "\n", 1);
+  }
+  for (int i = 0; memo_env[i]; i++)
+    memo_key_env(key, memo_env[i]);
+  if (getenv("SHELLAX_MEMO_ENV")) {
+    char *names = strdup(getenv("SHELLAX_MEMO_ENV")), *save;
+    for (char *name = strtok_r(names, ":, ", &save); name;
+         name = strtok_r(NULL, ":, ", &save))
+      memo_key_env(key, name);
+    free(names);
+  }
+  for (struct command_t *c = command; c; c = c->next) {
+    int from = c == command ? 1 : 0;
+    if (from < c->arg_count - 1 && c->args[from] &&
+        resolve_command(c->args[from], path, sizeof(path)) == 0)
+      memo_key_file(key, path);
+    for (int i = from + 1; i < c->arg_count - 1 && c->args[i]; i++)
+      memo_key_file(key, c->args[i]);
+    if (c->redirects[0])
+      memo_key_file(key, c->redirects[0]);
+    if (c->here_doc) {
+      buffer_append(key, "here\n", 5);
+      buffer_append(key, c->here_doc, strlen(c->here_doc));
+    }
+  }
+}
+
+int compare_memo_age(const void *a, const void *b) {
+  const struct timespec *x = &((struct memo_entry *)a)->mtime,
+                        *y = &((struct memo_entry *)b)->mtime;
+  if (x->tv_sec != y->tv_sec)
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+ * List the entries of the memo directory (in-flight ".tmp" files excluded)
+ * @return number of entries, `*entries` must be freed
+ */
+int memo_list(const char *dir, struct memo_entry **entries, off_t *total) {
+  DIR *d = opendir(dir);
+  int count = 0, cap = 64;
+  char path[PATH_MAX + 80];
+  struct dirent *e;
+  struct stat st;
+  *entries = malloc(cap * sizeof(struct memo_entry));
+  *total = 0;
+  while (d && (e = readdir(d))) {
+    if (e->d_name[0] == '.' || strchr(e->d_name, '.') ||
+        strlen(e->d_name) >= sizeof((*entries)->name))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+      continue;
+    if (count == cap)
+      *entries = realloc(*entries, (cap *= 2) * sizeof(struct memo_entry));
+    strcpy((*entries)[count].name, e->d_name);
+    (*entries)[count].size = st.st_size;
+    (*entries)[count++].mtime = st.st_mtim;
+    *total += st.st_size;
+  }
+  if (d)
+    closedir(d);
+  return count;
+}
+
+/**
+ * Evict the least recently used entries (hits refresh an entry's mtime) until
+ * the cache is back under 90% of its limit
+ */
+void memo_evict(const char *dir, long max) {
+  struct memo_entry *entries;
+  off_t total;
+  int count = memo_list(dir, &entries, &total);
+  if (total > max) {
+    char path[PATH_MAX + 80];
+    qsort(entries, count, sizeof(struct memo_entry), compare_memo_age);
+    for (int i = 0; i < count && total > max / 10 * 9; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+      if (unlink(path) == 0) {
+        total -= entries[i].size;
+        memo_evictions++;
+      }
+    }
+  }
+  free(entries);
+}
+
+/**
+ * Open a cache entry and check that it belongs to `key`
+ * @return descriptor positioned at the cached output, -1 on a miss
+ */
+int memo_lookup(const char *path, struct buffer *key,
+                struct memo_header *header) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  struct stat st;
+  char *stored = malloc(key->len ? key->len : 1);
+  bool valid = read(fd, header, sizeof(*header)) == sizeof(*header) &&
+               header->magic == MEMO_MAGIC && header->key_size == key->len &&
+               read(fd, stored, key->len) == (ssize_t)key->len &&
+               memcmp(stored, key->data, key->len) == 0 &&
+               fstat(fd, &st) == 0 &&
+               (uint64_t)st.st_size ==
+                   sizeof(*header) + key->len + header->output_size;
+  free(stored);
+  if (!valid) {
+    close(fd);
+    return -1;
+  }
+  futimens(fd, NULL); // most recently used
+  return fd;
+}
+
+/**
+ * Run the memoized command line with its stdout captured in a new entry
+ * @return descriptor positioned at the captured output, -1 on error
+ */
+int memo_run(struct command_t *inner, const char *path, struct buffer *key,
+             int *status) {
+  char tmp[PATH_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return -1;
+  struct memo_header header = {MEMO_MAGIC, 0, key->len, 0};
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, key->data, key->len) != (ssize_t)key->len) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  fflush(stdout);
+  uint64_t start = trace_now();
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(fd, STDOUT_FILENO); // shares the file offset, right after the key
+    process_command(inner);
+    fflush(stdout);
+    _exit(last_status);
+  }
+  int wait_status = 0;
+  wait_stage(pid, &wait_status, start, "memo");
+  *status = exit_code(wait_status);
+  off_t data = sizeof(header) + key->len;
+  struct stat st;
+  fstat(fd, &st);
+  header.output_size = st.st_size - data;
+  header.status = *status;
+  // interrupted runs and outputs larger than the whole cache are not kept
+  if (WIFEXITED(wait_status) && st.st_size <= memo_max_size() &&
+      pwrite(fd, &header, sizeof(header), 0) == sizeof(header))
+    rename(tmp, path);
+  else
+    unlink(tmp);
+  lseek(fd, data, SEEK_SET);
+  return fd;
+}
+
+void memo_stats(const char *dir) {
+  struct memo_entry *entries;
+  off_t total;
+  int count = memo_list(dir, &entries, &total);
+  free(entries);
+  long lookups = memo_hits + memo_misses;
+  printf("memo: %ld hits, %ld misses (%.1f%% hit rate), %ld evictions\n",
+         memo_hits, memo_misses, lookups ? 100.0 * memo_hits / lookups : 0.0,
+         memo_evictions);
+  char used[32], limit[32];
+  format_size(used, sizeof(used), total);
+  format_size(limit, sizeof(limit), memo_max_size());
+  printf("memo: %d entries, %s of %s in %s\n", count, used, limit, dir);
+}
+
+/**
+ * memo <command...> | memo --stats | memo --clear
+ * Output redirections of the memoized line apply to the replayed output and
+ * are not part of the key.
+ */
+int memo_command(struct command_t *command) {
+  char dir[PATH_MAX], path[PATH_MAX + 32];
+  if (command->arg_count < 3) {
+    fprintf(stderr, "usage: memo <command...> | memo --stats | memo --clear\n");
+    return SUCCESS;
+  }
+  if (memo_dir(dir, sizeof(dir)) == -1) {
+    fprintf(stderr, "-%s: memo: no cache directory: %s\n", sysname,
+            strerror(errno));
+    return SUCCESS;
+  }
+  if (strcmp(command->args[1], "--stats") == 0) {
+    memo_stats(dir);
+    return SUCCESS;
+  }
+  if (strcmp(command->args[1], "--clear") == 0) {
+    struct memo_entry *entries;
+    off_t total;
+    int count = memo_list(dir, &entries, &total);
+    for (int i = 0; i < count; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+      unlink(path);
+    }
+    free(entries);
+    return SUCCESS;
+  }
+
+  // the output redirection is applied to the replay, not memoized
+  struct command_t *last = command;
+  while (last->next)
+    last = last->next;
+  char *truncate_to = last->redirects[1], *append_to = last->redirects[2];
+  last->redirects[1] = last->redirects[2] = NULL;
+  char *line = command_to_string(command, 1);
+  struct command_t *inner = copy_command(command, 1);
+  last->redirects[1] = truncate_to;
+  last->redirects[2] = append_to;
+
+  struct buffer key = {0};
+  memo_key(command, line, &key);
+  snprintf(path, sizeof(path), "%s/%016llx", dir,
+           (unsigned long long)hash_bytes(key.data, key.len));
+
+  int out = STDOUT_FILENO;
+  if (truncate_to || append_to) {
+    out = open(truncate_to ? truncate_to : append_to,
+               O_WRONLY | O_CREAT | O_CLOEXEC | (truncate_to ? O_TRUNC : O_APPEND),
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (out == -1) {
+      fprintf(stderr, "-%s: %s: %s\n", sysname,
+              truncate_to ? truncate_to : append_to, strerror(errno));
+      last_status = 1;
+      free_command(inner);
+      free(line);
+      free(key.data);
+      return SUCCESS;
+    }
+  }
+
+  struct memo_header header;
+  int status = 0;
+  int fd = memo_lookup(path, &key, &header);
+  if (fd != -1) {
+    memo_hits++;
+    status = header.status;
+  } else {
+    memo_misses++;
+    fd = memo_run(inner, path, &key, &status);
+    memo_evict(dir, memo_max_size());
+  }
+  if (fd != -1) {
+    fflush(stdout);
+    if (copy_fd(fd, out) == -1 && errno != EPIPE)
+      fprintf(stderr, "-%s: memo: %s\n", sysname, strerror(errno));
+    close(fd);
+  } else {
+    fprintf(stderr, "-%s: memo: %s\n", sysname, strerror(errno));
+    status = 1;
+  }
+  if (out != STDOUT_FILENO)
+    close(out);
+  last_status = status;
+  free_command(inner);
+  free(line);
+  free(key.data);
+  return SUCCESS;
+}
+
+/*
+ * pin: CPU placement and scheduling of pipeline stages.
+ *   pin [-a] [-c CPUS] [-n NICE] [-s POLICY] [-v] <pipeline...>
+ * -c, -n and -s take one value per stage separated by ':', the last value
+ * repeating for the remaining stages (`-c 0:2-3 -n 0:10 -s other:batch`).
+ * -a places the stages automatically: the allowed CPUs are ordered so that
+ * neighbours are distinct cores sharing a last-level cache (SMT siblings come
+ * last), and stage i gets the i-th CPU, so a producer and its consumer exchange
+ * pipe data through a shared cache. Forked stages are placed right after fork;
+ * builtin stages running as threads place their own thread.
+ */
+#define PIN_MAX_STAGES 64
+
+struct placement {
+  struct command_t *head; // first stage of the placed pipeline
+  int cpu_count, nice_count, policy_count;
+  cpu_set_t cpus[PIN_MAX_STAGES];
+  int nice[PIN_MAX_STAGES];
+  int policy[PIN_MAX_STAGES];
+  bool verbose;
+};
+
+struct placement *placement = NULL;
+
+/**
+ * Parse a CPU list such as "0-3,8"
+ * @return 0 on success, -1 if the list is invalid
+ */
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 10), hi = lo;
+    if (end == p || lo < 0)
+      return -1;
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+      if (end == p || hi < lo)
+        return -1;
+    }
+    if (hi >= CPU_SETSIZE)
+      return -1;
+    for (long cpu = lo; cpu <= hi; cpu++)
+      CPU_SET(cpu, set);
+    if (*end == ',')
+      end++;
+    else if (*end)
+      return -1;
+    p = end;
+  }
+  return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+long read_sys_long(const char *format, int cpu, long fallback) {
+  char path[128], value[64];
+  snprintf(path, sizeof(path), format, cpu);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return fallback;
+  ssize_t n = read(fd, value, sizeof(value) - 1);
+  close(fd);
+  if (n <= 0)
+    return fallback;
+  value[n] = 0;
+  return atol(value);
+}
+
+struct cpu_info {
+  int cpu;
+  long package, llc, core, thread; // thread: rank among the core's siblings
+};
+
+int compare_cpu_info(const void *a, const void *b) {
+  const struct cpu_info *x = a, *y = b;
+  long keys[2][4] = {{x->package, x->llc, x->thread, x->core},
+                     {y->package, y->llc, y->thread, y->core}};
+  for (int i = 0; i < 4; i++)
+    if (keys[0][i] != keys[1][i])
+      return keys[0][i] < keys[1][i] ? -1 : 1;
+  return x->cpu - y->cpu;
+}
+
+/**
+ * Order the CPUs this shell may run on for automatic placement
+ * @return number of CPUs written to `cpus`
+ */
+int auto_cpu_order(int *cpus, int max) {
+  cpu_set_t allowed;
+  struct cpu_info info[CPU_SETSIZE];
+  int count = 0;
+  char path[128], list[256];
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    struct cpu_info *c = &info[count++];
+    c->cpu = cpu;
+    c->package = read_sys_long(
+        "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu, 0);
+    c->llc = read_sys_long("/sys/devices/system/cpu/cpu%d/cache/index3/id", cpu,
+                           c->package);
+    c->core =
+        read_sys_long("/sys/devices/system/cpu/cpu%d/topology/core_id", cpu, cpu);
+    c->thread = 0;
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd == -1 ? -1 : read(fd, list, sizeof(list) - 1);
+    if (fd != -1)
+      close(fd);
+    cpu_set_t siblings;
+    if (n > 0) {
+      list[n] = 0;
+      list[strcspn(list, "\n")] = 0;
+      if (parse_cpu_list(list, &siblings) == 0)
+        for (int s = 0; s < cpu; s++)
+          c->thread += CPU_ISSET(s, &siblings) != 0;
+    }
+  }
+  qsort(info, count, sizeof(struct cpu_info), compare_cpu_info);
+  for (int i = 0; i < count && i < max; i++)
+    cpus[i] = info[i].cpu;
+  return count < max ? count : max;
+}
+
+int parse_policy(const char *name) {
+  if (strcmp(name, "other") == 0 || strcmp(name, "normal") == 0)
+    return SCHED_OTHER;
+  if (strcmp(name, "batch") == 0)
+    return SCHED_BATCH;
+  if (strcmp(name, "idle") == 0)
+    return SCHED_IDLE;
+  return -1;
+}
+
+/**
+ * Apply the placement of a stage to the calling thread
+ * @param stage a stage of the placed pipeline
+ */
+void apply_placement(struct command_t *stage) {
+  if (!placement)
+    return;
+  int index = 0;
+  for (struct command_t *c = placement->head; c && c != stage; c = c->next)
+    index++;
+  pid_t tid = gettid();
+  char cpus[256] = "-";
+  if (placement->cpu_count) {
+    cpu_set_t *set = &placement->cpus[index < placement->cpu_count
+                                          ? index
+                                          : placement->cpu_count - 1];
+    if (sched_setaffinity(tid, sizeof(cpu_set_t), set) == -1)
+      fprintf(stderr, "-%s: pin: %s: sched_setaffinity: %s\n", sysname,
+              stage->name, strerror(errno));
+    int len = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < (int)sizeof(cpus) - 8; cpu++)
+      if (CPU_ISSET(cpu, set))
+        len += snprintf(cpus + len, sizeof(cpus) - len, "%s%d", len ? "," : "",
+                        cpu);
+  }
+  if (placement->policy_count) {
+    int policy = placement->policy[index < placement->policy_count
+                                       ? index
+                                       : placement->policy_count - 1];
+    struct sched_param param = {0};
+    if (sched_setscheduler(tid, policy, &param) == -1)
+      fprintf(stderr, "-%s: pin: %s: sched_setscheduler: %s\n", sysname,
+              stage->name, strerror(errno));
+  }
+  if (placement->nice_count) {
+    int nice = placement->nice[index < placement->nice_count
+                                   ? index
+                                   : placement->nice_count - 1];
+    if (setpriority(PRIO_PROCESS, tid, nice) == -1)
+      fprintf(stderr, "-%s: pin: %s: nice %d: %s\n", sysname, stage->name, nice,
+              strerror(errno));
+  }
+  if (placement->verbose)
+    fprintf(stderr, "pin: stage %d (%s, tid %d): cpus %s, nice %d, policy %d\n",
+            index, stage->name, tid, cpus,
+            getpriority(PRIO_PROCESS, tid), sched_getscheduler(tid));
+}
+
+int pin_usage() {
+  fprintf(stderr, "usage: pin [-a] [-c cpus[:cpus...]] [-n nice[:nice...]] "
+                  "[-s other|batch|idle[:...]] [-v] <command...>\n");
+  return SUCCESS;
+}
 
-    if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68) {
+int pin_command(struct command_t *command) {
+  struct placement *p = calloc(1, sizeof(struct placement));
+  bool automatic = false;
+  int i = 1;
+  for (; i < command->arg_count - 1 && command->args[i][0] == '-'; i++) {
+    const char *opt = command->args[i];
+    if (strcmp(opt, "-a") == 0) {
+      automatic = true;
       continue;
     }
-
-    if (c == 65) // up arrow
-    {
-      while (index > 0) {
-        prompt_backspace();
-        index--;
-      }
-
-      char tmpbuf[4096];
-      printf("%s", oldbuf);
-      strcpy(tmpbuf, buf);
-      strcpy(buf, oldbuf);
-      strcpy(oldbuf, tmpbuf);
-      index += strlen(buf);
+    if (strcmp(opt, "-v") == 0) {
+      p->verbose = true;
       continue;
     }
-
-    putchar(c); // echo the character
-    buf[index++] = c;
-    if (index >= sizeof(buf) - 1)
-      break;
-    if (c == '\n') // enter key
-      break;
-    if (c == 4) // Ctrl+D
-      return EXIT;
+    if ((strcmp(opt, "-c") != 0 && strcmp(opt, "-n") != 0 &&
+         strcmp(opt, "-s") != 0) ||
+        i + 1 >= command->arg_count - 1) {
+      free(p);
+      return pin_usage();
+    }
+    char *values = strdup(command->args[++i]), *save, *value;
+    bool valid = true;
+    for (value = strtok_r(values, ":", &save); value && valid;
+         value = strtok_r(NULL, ":", &save)) {
+      if (opt[1] == 'c' && p->cpu_count < PIN_MAX_STAGES)
+        valid = parse_cpu_list(value, &p->cpus[p->cpu_count++]) == 0;
+      else if (opt[1] == 'n' && p->nice_count < PIN_MAX_STAGES)
+        p->nice[p->nice_count++] = atoi(value);
+      else if (opt[1] == 's' && p->policy_count < PIN_MAX_STAGES)
+        valid = (p->policy[p->policy_count++] = parse_policy(value)) != -1;
+    }
+    free(values);
+    if (!valid) {
+      fprintf(stderr, "-%s: pin: invalid %s value '%s'\n", sysname, opt,
+              command->args[i]);
+      free(p);
+      return SUCCESS;
+    }
+  }
+  if (i >= command->arg_count - 1) {
+    free(p);
+    return pin_usage();
+  }
+  if (automatic) {
+    int cpus[PIN_MAX_STAGES];
+    p->cpu_count = auto_cpu_order(cpus, PIN_MAX_STAGES);
+    for (int k = 0; k < p->cpu_count; k++) {
+      CPU_ZERO(&p->cpus[k]);
+      CPU_SET(cpus[k], &p->cpus[k]);
+    }
   }
-  if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-    index--;
-  buf[index++] = '\0'; // null terminate string
-
-  strcpy(oldbuf, buf);
 
-  parse_command(buf, command);
+  struct command_t *inner = copy_command(command, i);
+  p->head = inner;
+  placement = p;
+  int code = process_command(inner);
+  placement = NULL;
+  free(p);
+  free_command(inner);
+  return code;
+}
 
-  // print_command(command); // DEBUG: uncomment for debugging
+/**
+ * Resident set size of the shell, from /proc/self/statm
+ * @return bytes, 0 if unknown
+ */
+long resident_bytes() {
+  long pages = 0;
+  FILE *statm = fopen("/proc/self/statm", "re");
+  if (statm) {
+    if (fscanf(statm, "%*s %ld", &pages) != 1)
+      pages = 0;
+    fclose(statm);
+  }
+  return pages * sysconf(_SC_PAGESIZE);
+}
 
-  // restore the old settings
-  tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+/**
+ * fdstat [-s]: list the descriptors the shell holds open, what they refer to
+ * and whether they are close-on-exec. Descriptors above 2 that would leak
+ * into children are flagged. -s prints one line for scripts:
+ * "fds=N inherited=N rss_kb=N".
+ */
+int fdstat_command(struct command_t *command) {
+  bool summary = command->arg_count > 2 && strcmp(command->args[1], "-s") == 0;
+  DIR *d = opendir("/proc/self/fd");
+  if (!d) {
+    fprintf(stderr, "-%s: fdstat: /proc/self/fd: %s\n", sysname, strerror(errno));
+    last_status = 1;
+    return SUCCESS;
+  }
+  int count = 0, inherited = 0;
+  struct dirent *entry;
+  if (!summary)
+    printf("%4s  %-7s  %s\n", "fd", "cloexec", "target");
+  while ((entry = readdir(d))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    int fd = atoi(entry->d_name);
+    if (fd == dirfd(d))
+      continue;
+    int flags = fcntl(fd, F_GETFD);
+    bool cloexec = flags != -1 && (flags & FD_CLOEXEC);
+    count++;
+    inherited += fd > 2 && !cloexec;
+    if (summary)
+      continue;
+    char link[64], target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    target[n > 0 ? n : 0] = 0;
+    printf("%4d  %-7s  %s%s\n", fd, cloexec ? "yes" : "no", target,
+           fd > 2 && !cloexec ? "  (inherited by children)" : "");
+  }
+  closedir(d);
+  long rss = resident_bytes();
+  if (summary) {
+    printf("fds=%d inherited=%d rss_kb=%ld\n", count, inherited, rss / 1024);
+  } else {
+    char size[32];
+    format_size(size, sizeof(size), rss);
+    printf("%d open, %d inherited by children, rss %s\n", count, inherited,
+           size);
+  }
   return SUCCESS;
 }
-int process_command(struct command_t *command);
-int main() {
-  while (1) {
-    struct command_t *command = malloc(sizeof(struct command_t));
-    memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
 
-    int code;
-    code = prompt(command);
-    if (code == EXIT)
-      break;
+/*
+ * In-process pipelines of stream builtins.
+ * Each stage runs on its own thread. Stages are connected by channels guarded
+ * by a mutex/condvar. A flush of the writer's stdio buffer offers that buffer
+ * to the reader, which copies straight out of it into its own stdio buffer;
+ * the writer waits until its buffer has been taken, then goes on filling it.
+ * That is one copy per hop and no allocation, where a pipe copies twice
+ * through the kernel, and no fork is involved.
+ */
+#define CHANNEL_CHUNK (256 * 1024)
 
-    code = process_command(command);
-    if (code == EXIT)
-      break;
+struct channel {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const char *data; // writer's buffer on offer, still to be read
+  size_t len;       // bytes of it left, 0 when nothing is on offer
+  bool writer_closed;
+  bool reader_closed;
+};
 
-    free_command(command);
+ssize_t channel_write(void *cookie, const char *buf, size_t size) {
+  struct channel *ch = cookie;
+  pthread_mutex_lock(&ch->lock);
+  ch->data = buf;
+  ch->len = size;
+  pthread_cond_broadcast(&ch->cond);
+  while (ch->len > 0 && !ch->reader_closed)
+    pthread_cond_wait(&ch->cond, &ch->lock);
+  size_t left = ch->len;
+  ch->data = NULL;
+  ch->len = 0;
+  pthread_mutex_unlock(&ch->lock);
+  if (left > 0) {
+    // nobody will read this any more: behave like a broken pipe (a cookie
+    // write reports errors with 0, stdio takes a negative count as bytes)
+    errno = EPIPE;
+    return 0;
   }
-
-  printf("\n");
-  return 0;
+  return size;
 }
 
- /* int count_command(struct command_t *command) { The other way to calculate number of process:
+ssize_t channel_read(void *cookie, char *buf, size_t size) {
+  struct channel *ch = cookie;
+  pthread_mutex_lock(&ch->lock);
+  while (ch->len == 0 && !ch->writer_closed)
+    pthread_cond_wait(&ch->cond, &ch->lock);
+  size_t n = ch->len < size ? ch->len : size;
+  memcpy(buf, ch->data, n);
+  ch->data += n;
+  ch->len -= n;
+  if (ch->len == 0)
+    pthread_cond_broadcast(&ch->cond); // the writer's buffer is free again
+  pthread_mutex_unlock(&ch->lock);
+  return n; // 0 once the writer is gone
+}
 
-  if (command->next) {
-      i = i + 1;
-      count_command(command->next);
+void channel_release(struct channel *ch) {
+  // called with the lock held, frees the channel once both ends are closed
+  if (!ch->writer_closed || !ch->reader_closed) {
+    pthread_cond_broadcast(&ch->cond);
+    pthread_mutex_unlock(&ch->lock);
+    return;
   }
-  return i;
-} */
+  pthread_mutex_unlock(&ch->lock);
+  pthread_mutex_destroy(&ch->lock);
+  pthread_cond_destroy(&ch->cond);
+  free(ch);
+}
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int channel_close_writer(void *cookie) {
+  struct channel *ch = cookie;
+  pthread_mutex_lock(&ch->lock);
+  ch->writer_closed = true;
+  channel_release(ch);
+  return 0;
+}
 
-// Our second solution for the wiseman question:
+int channel_close_reader(void *cookie) {
+  struct channel *ch = cookie;
+  pthread_mutex_lock(&ch->lock);
+  ch->reader_closed = true;
+  channel_release(ch);
+  return 0;
+}
 
-  /* void wiseman(struct command_t *command){
-     
-    int exit_value;
-    int infd;
-    int pipefd[2];
-    // char *crontab_args[] = {"crontab", "-", NULL};
-    // char str1[1000] = //*/;
- /*      strcat(str1,command->args[1]);
-    char str2[] = " * * * * fortune | espeak";
-    strcat(str1,str2);
-    // strcat(str1,"\n"); //end of the file ?????
-    
+/**
+ * Create a channel and open both of its ends as stdio streams
+ * @param reader read end
+ * @param writer write end
+ */
+void channel_open(FILE **reader, FILE **writer) {
+  struct channel *ch = calloc(1, sizeof(struct channel));
+  pthread_mutex_init(&ch->lock, NULL);
+  pthread_cond_init(&ch->cond, NULL);
+  cookie_io_functions_t read_end = {.read = channel_read,
+                                    .close = channel_close_reader};
+  cookie_io_functions_t write_end = {.write = channel_write,
+                                     .close = channel_close_writer};
+  *reader = fopencookie(ch, "r", read_end);
+  *writer = fopencookie(ch, "w", write_end);
+  setvbuf(*reader, NULL, _IOFBF, CHANNEL_CHUNK);
+  setvbuf(*writer, NULL, _IOFBF, CHANNEL_CHUNK);
+}
 
-      if (pipe(pipefd) == -1) {
-            perror("pipe");
-            exit(EXIT_FAILURE);
-        }
-        //fork child to handle cmd
-        pid_t pid;
-        pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            return;
-        } else if(pid == 0) { // child process
+struct stage {
+  pthread_t thread;
+  struct command_t *command;
+  FILE *in, *out;
+  bool close_in, close_out; // streams owned by the stage (channel ends)
+  bool started;
+  int status;
+};
 
-               close(pipefd[1]);
-               dup2(pipefd[0], 0);
-	       char *crontab_args[] = {"crontab", "-", NULL};
-	       execvp("crontab",crontab_args);
-	       printf("errno: %d\f", errno);
-	       exit(0);
-	       
-	}else{
+void *run_stage(void *arg) {
+  struct stage *st = arg;
+  apply_placement(st->command);
+  uint64_t start = trace_now();
+  st->status = run_stream_builtin(st->command, st->in, st->out);
+  if (trace_fd != -1 || stage_times) {
+    struct rusage ru;
+    char args[256];
+    getrusage(RUSAGE_THREAD, &ru);
+    trace_rusage_args(args, sizeof(args), getpid(), st->status << 8, &ru);
+    trace_span(st->command->name, "builtin", start, args);
+    record_stage_time(st->command->name, start, &ru);
+  }
+  if (st->close_out)
+    fclose(st->out); // end of stream for the next stage
+  else
+    fflush(st->out);
+  if (st->close_in)
+    fclose(st->in); // lets a blocked writer fail instead of waiting forever
+  return NULL;
+}
 
-               write(pipefd[1],&str1,strlen(str1)+1);
-	       close(pipefd[0]);
-	       close(pipefd[1]);
-       }
-              
- }  */
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Run `count` consecutive stream builtins as threads of this process
+ * @param  first first stage of the segment
+ * @param  count number of stages
+ * @param  in    input of the first stage
+ * @param  out   output of the last stage
+ * @return       exit status of the last stage
+ */
+int run_builtin_pipeline(struct command_t *first, int count, FILE *in,
+                         FILE *out) {
+  struct stage *stages = calloc(count, sizeof(struct stage));
+  struct command_t *c = first;
+  for (int i = 0; i < count; i++, c = c->next) {
+    stages[i].command = c;
+    if (i == 0) {
+      stages[i].in = in;
+    } else {
+      stages[i].close_in = true;
+      channel_open(&stages[i].in, &stages[i - 1].out);
+      stages[i - 1].close_out = true;
+    }
+  }
+  stages[count - 1].out = out;
+  fflush(out);
+  for (int i = 0; i < count; i++) {
+    struct stage *st = &stages[i];
+    int r = pthread_create(&st->thread, NULL, run_stage, st);
+    if (r == 0) {
+      st->started = true;
+      continue;
+    }
+    // a stage that cannot start fails at once: its neighbours see the end of
+    // its input and output, as if it had exited
+    fprintf(stderr, "-%s: %s: %s\n", sysname, st->command->name, strerror(r));
+    st->status = 1;
+    if (st->close_out)
+      fclose(st->out);
+    if (st->close_in)
+      fclose(st->in);
+  }
+  for (int i = 0; i < count; i++)
+    if (stages[i].started)
+      pthread_join(stages[i].thread, NULL);
+  int status = stages[count - 1].status;
+  free(stages);
+  if (in == stdin)
+    clearerr(stdin);
+  return status;
+}
 
 
 
-// Question 3 part d starts: our first custom command: last_x_lines // last fileName number_of_lines
 
-// creating stack of lines
-struct stack
-{
-          char strings[100];
+/*
+ * Command substitution: $(...) is replaced by the output of its command line,
+ * minus trailing newlines. Lines are parsed once and kept in a small cache.
+ * A line that is one pipeline of stream builtins runs inside the shell and
+ * writes straight into the result (open_memstream): no fork, no pipe. Anything
+ * else runs in a forked copy of the shell whose output is read from a pipe
+ * with large reads into a growable buffer.
+ */
+#define SUBST_CACHE_SLOTS 64
+#define SUBST_READ (64 * 1024)
+
+struct subst_entry {
+  char *text;
+  struct node_t *tree;
+  int busy; // running; a busy entry is never replaced
 };
 
+struct subst_entry subst_cache[SUBST_CACHE_SLOTS];
 
- void last_x_lines(struct command_t *command){
-
-             // stucture initialization    
-              struct stack s[100];
-
-              FILE *file;
-              char line[100];
-         
-              int n,count=0, i=0;
-
-              file  = fopen(command->args[1], "r");
-         
-              // reading line by line and push to stack
-              while(fscanf(file , "%[^\n]\n" , line)!=EOF) {
-                             strcpy(s[i].strings , line);
-                             i++;
-                             n=i; 
-               }
-               //n = i = total number of lines
-               int numberOfLines = atoi(command->args[2]);
-               // pop line by line
-               for(i=(n-1);i>=0;i--) {
-               
-                        // last numberOfLines lines  
-                         if(count == numberOfLines){
-         
-                               break;
-                         } else {
-
-                               printf("%s\n" , s[i].strings);
-                         }
-                         count++;                        
-               }
-}
-// Question 3 part d starts: our first custom command: ENDs.
-
-
-// Question 3 part d starts: our second custom command: first_x_lines // first fileName number_of_lines
- void first_x_lines(struct command_t *command){
-
-             // stucture initialization    
-              struct stack s[100];
-
-              FILE *file;
-              char line[100];
-         
-              int count=0, i=0;
-
-              file  = fopen(command->args[1], "r");
-         
-              // reading line by line and push to stack
-              while(fscanf(file , "%[^\n]\n" , line)!=EOF) {
-                             strcpy(s[i].strings , line);
-                             i++;
-               }
-               
-               int total_numberOfLines = i; //total number of lines
-               int numberOfLines = atoi(command->args[2]);
-               // pop line by line
-               for(int n=0;n < total_numberOfLines;n++) {
-                        
-                        // last numberOfLines lines  
-                         if(count == numberOfLines){                              
-                               break;
-                         } else {
-                               printf("%s\n" , s[n].strings);
-                         }
-                         count++;                        
-               }
-}
- 
- 
-// Question 3 part d starts: our second custom command: ENDs.
+/**
+ * Parsed tree of a substituted line
+ * @param entry the cache entry holding the tree, NULL if the caller owns it
+ */
+struct node_t *subst_tree(const char *text, size_t len,
+                          struct subst_entry **entry) {
+  struct subst_entry *e = &subst_cache[hash_bytes(text, len) % SUBST_CACHE_SLOTS];
+  struct node_t *tree;
+  *entry = NULL;
+  if (e->text && strlen(e->text) == len && memcmp(e->text, text, len) == 0) {
+    *entry = e;
+    return e->tree;
+  }
+  char *line = strndup(text, len);
+  parse_line(line, &tree);
+  if (e->busy) {
+    free(line);
+    return tree;
+  }
+  free(e->text);
+  free_node(e->tree);
+  e->text = line;
+  e->tree = tree;
+  *entry = e;
+  return tree;
+}
 
-// Question 3 part d starts: our third custom command
-#define MAX_MESSAGE_SIZE 30
-
-void shuffle(char str[]){
-    srand(time(NULL));   // Initialization, should only be called once.
-    int r1 = rand() % ( strlen(str)-1 ); 
-    int r2 = rand() % ( strlen(str)-1 ); 
-    char term= str[r1];
-    str[r1]=str[r2];
-    str[r2]=term;
-}
-char* shufflepoint(char* str){
-   // srand(time(NULL));   // Initialization, should only be called once.
-   // int r1 = rand() % ( strlen(str)-1 ); 
-   // int r2 = rand() % ( strlen(str)-1 ); 
-    char strnew[MAX_MESSAGE_SIZE];
-    char *temp = str;
-    int i=0;
-    while (*temp != '\0') {
-
-        strnew[i]=*temp;
-        i++;
-        temp++;
-    }
-    strnew[i]='\0';
-    shuffle(strnew);
-    str=strnew;
-    printf("\n%s\n",str);
-    return str;
-}
-
-char* reversepoint(char* str){
-    char strnew[MAX_MESSAGE_SIZE];
-    char *temp = str;
-    int i=0;
-    while (*temp != '\0') {
-        i++;
-        temp++;
-    }
-    int j=i;
-    char *temp2 = str;
-     while (*temp2 != '\0'){
-        strnew[i-1]=*temp2;
-        i--;
-        temp2++;
-    }
-    strnew[j]='\0';
-    str=strnew;
-    printf("\n%s\n",str);
-    return str;
+/**
+ * Run a pipeline of stream builtins into memory
+ */
+void subst_builtins(struct node_t *node, char **data, size_t *size) {
+  struct command_t *command = node->instantiate
+                                  ? instantiate_command(node->pipeline)
+                                  : node->pipeline, *last = command;
+  int count = 1;
+  for (struct command_t *c = command; c; c = c->next)
+    expand_globs(c);
+  for (; last->next; last = last->next)
+    count++;
+  FILE *in, *out;
+  if (open_redirect_streams(command, last, &in, &out) == 0) {
+    FILE *memory = out == stdout ? open_memstream(data, size) : NULL;
+    if (memory)
+      out = memory;
+    last_status = count == 1 ? run_stream_builtin(command, in, out)
+                             : run_builtin_pipeline(command, count, in, out);
+    if (memory) {
+      fclose(memory);
+      out = stdout;
+    }
+    close_redirect_streams(in, out);
+  } else {
+    last_status = 1;
+  }
+  if (node->instantiate)
+    free_command(command);
+}
+
+/**
+ * Run a parsed line in a child and read its output
+ */
+void subst_fork(struct node_t *tree, char **data, size_t *size) {
+  int fds[2];
+  struct buffer out = {0};
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    perror("pipe");
+    return;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    run_node(tree);
+    fflush(stdout);
+    _exit(last_status);
+  }
+  close(fds[1]);
+  while (pid > 0) {
+    if (out.cap - out.len < SUBST_READ) {
+      out.cap = out.cap * 2 + SUBST_READ;
+      out.data = realloc(out.data, out.cap);
+    }
+    ssize_t n = read(fds[0], out.data + out.len, out.cap - out.len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    out.len += n;
+  }
+  close(fds[0]);
+  int status = 0;
+  if (pid > 0)
+    waitpid(pid, &status, 0);
+  else
+    perror("fork");
+  last_status = exit_code(status);
+  *data = out.data;
+  *size = out.len;
 }
-// Question 3 part d starts: our third custom command ends
 
+/**
+ * Output of a substituted command line
+ * @param  text line between "$(" and ")"
+ * @return      malloc'd output without trailing newlines
+ */
+char *command_substitution(const char *text, size_t len) {
+  struct subst_entry *entry;
+  struct node_t *tree = subst_tree(text, len, &entry);
+  char *data = NULL;
+  size_t size = 0;
+  if (entry)
+    entry->busy++;
+  bool builtins = tree && tree->type == NODE_PIPELINE &&
+                  !tree->pipeline->background;
+  for (struct command_t *c = builtins ? tree->pipeline : NULL; c; c = c->next)
+    builtins &= is_stream_builtin(c);
+  if (builtins)
+    subst_builtins(tree, &data, &size);
+  else if (tree)
+    subst_fork(tree, &data, &size);
+  if (entry)
+    entry->busy--;
+  else
+    free_node(tree);
+  while (size > 0 && data[size - 1] == '\n')
+    size--;
+  data = realloc(data, size + 1);
+  data[size] = 0;
+  return data;
+}
 
+/*
+ * chatroom <room> <user> [N | +OFFSET]
+ * A room is a directory, /tmp/chatroom-<room>, holding an append-only log of
+ * messages and an index with one fixed-size record per message. Senders
+ * append under an flock on the index: the message goes to the log first and
+ * its record to the index after, so a record always points at a whole
+ * message. Participants never write to each other. Joining maps the log and
+ * the index and replays the last N messages (default 10) or everything from
+ * log offset OFFSET on; from then on the index is followed with inotify. A
+ * participant who left costs the senders nothing. Leaving (Ctrl-D, Ctrl-C or
+ * /quit) prints the offset to come back with.
+ */
+#define CHAT_REPLAY_DEFAULT 10
+#define CHAT_MESSAGE_MAX 4096                   // a typed line
+#define CHAT_RECORD_MAX (CHAT_MESSAGE_MAX + 256) // with its "[room] user: "
 
+struct chat_record {
+  uint64_t offset; // of the message in the log
+  uint32_t length;
+  uint32_t time; // seconds since the epoch
+};
 
+struct chat_room {
+  const char *name, *user;
+  char dir[PATH_MAX], index_path[PATH_MAX + 8];
+  int log, index; // both opened with O_APPEND
+  uint64_t next;  // next record to show
+  uint64_t seen;  // log offset after the last message shown
+};
 
+/**
+ * Open (or create) the log and the index of a room
+ * @return 0, -1 on error (reported)
+ */
+int chat_open(struct chat_room *room) {
+  char log_path[PATH_MAX + 8];
+  snprintf(room->dir, sizeof(room->dir), "/tmp/chatroom-%s", room->name);
+  snprintf(log_path, sizeof(log_path), "%s/log", room->dir);
+  snprintf(room->index_path, sizeof(room->index_path), "%s/index", room->dir);
+  int flags = O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC;
+  if ((mkdir(room->dir, 0700) == -1 && errno != EEXIST) ||
+      (room->log = open(log_path, flags, 0600)) == -1 ||
+      (room->index = open(room->index_path, flags, 0600)) == -1) {
+    fprintf(stderr, "-%s: chatroom: %s: %s\n", sysname, room->dir, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
 
-void myUniq(struct command_t *command){ // our uniq function
+/**
+ * Append a message
+ * @return 0, -1 on error
+ */
+int chat_append(struct chat_room *room, const char *message, size_t len) {
+  struct stat st;
+  int r = -1;
+  if (flock(room->index, LOCK_EX) == -1)
+    return -1;
+  // the end of the log, past any message whose record was never written
+  if (fstat(room->log, &st) == 0) {
+    struct chat_record record = {st.st_size, len, time(NULL)};
+    if (write(room->log, message, len) == (ssize_t)len &&
+        write(room->index, &record, sizeof(record)) == sizeof(record))
+      r = 0;
+  }
+  flock(room->index, LOCK_UN);
+  return r;
+}
 
-     char buffer[600];
-     char **lines = NULL;
-     int i = 0;
-    
-     while (fgets(buffer, sizeof(buffer), stdin)){
-     
-        lines = realloc(lines, (i + 1) * sizeof (char*));
-        lines[i] = strdup(buffer);
-        i++;
-     }
-     
-     int fr[i];
-     int visited = -1; // to show an element is visited or not.
+void chat_show(struct chat_room *room, const struct chat_record *record,
+               const char *message) {
+  printf("\r\033[K%.*s", (int)record->length, message);
+  room->seen = record->offset + record->length;
+}
 
-     for(int c = 0; c < i; c++){
-     
-        int count = 1;
-        for(int j = c+1; j < i; j++){
-        
-            if(strcmp(lines[c],lines[j])== 0){
-            
-                count++;
-                //To avoid counting same element again
-                fr[j] = visited;
-            }
-        }
-        if(fr[c] != visited)
-            fr[c] = count; // to determine the number of occurrences of the element.
-     }
-
-     if(command->args[1] == NULL){
-
-             for(int c = 0; c < i; c++){
-             
-                if(fr[c] != visited){
-                
-                   printf("%s",lines[c]);
-                }
-             }
-     } else if(strcmp(command->args[1],"-c")==0 || strcmp(command->args[1],"-C")==0 ){
-     
-           for(int c = 0; c < i; c++){
-           
-               if(fr[c] != visited){
-               
-                  printf("%d %s",fr[c],lines[c]);      
-               }
-           }
-
-    } 
-  
-    for (int c = 0; c < i; c++) {
-        free(lines[c]);
+/**
+ * Replay the last `last` messages, or those from log offset `since` on
+ * (since >= 0), from maps of the log and the index
+ */
+void chat_replay(struct chat_room *room, long last, long long since) {
+  struct stat index_st, log_st;
+  if (fstat(room->index, &index_st) == -1 || fstat(room->log, &log_st) == -1)
+    return;
+  uint64_t count = index_st.st_size / sizeof(struct chat_record);
+  room->next = count;
+  room->seen = log_st.st_size;
+  if (count == 0 || log_st.st_size == 0)
+    return;
+  struct chat_record *records =
+      mmap(NULL, count * sizeof(struct chat_record), PROT_READ, MAP_SHARED,
+           room->index, 0);
+  char *log = mmap(NULL, log_st.st_size, PROT_READ, MAP_SHARED, room->log, 0);
+  if (records == MAP_FAILED || log == MAP_FAILED) {
+    fprintf(stderr, "-%s: chatroom: mmap: %s\n", sysname, strerror(errno));
+    if (records != MAP_FAILED)
+      munmap(records, count * sizeof(struct chat_record));
+    if (log != MAP_FAILED)
+      munmap(log, log_st.st_size);
+    return;
+  }
+  // records are in log order: binary search for the offset
+  uint64_t first = count > (uint64_t)last ? count - last : 0;
+  if (since >= 0) {
+    uint64_t lo = 0, hi = count;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (records[mid].offset < (uint64_t)since)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
-
-    // free() the array itself
-   // free(lines);
+    first = lo;
+  }
+  if (first < count) {
+    char when[32];
+    time_t t = records[first].time;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+    printf("--- %llu earlier message%s since %s ---\n",
+           (unsigned long long)(count - first), count - first > 1 ? "s" : "",
+           when);
+  }
+  for (uint64_t i = first; i < count; i++)
+    if (records[i].offset + records[i].length <= (uint64_t)log_st.st_size)
+      chat_show(room, &records[i], log + records[i].offset);
+  munmap(records, count * sizeof(struct chat_record));
+  munmap(log, log_st.st_size);
 }
 
+/**
+ * Show the messages appended since the last look
+ * @return number of messages shown
+ */
+int chat_catch_up(struct chat_room *room) {
+  int shown = 0;
+  struct chat_record record, part;
+  char message[CHAT_RECORD_MAX];
+  while (pread(room->index, &record, sizeof(record),
+               room->next * sizeof(record)) == sizeof(record)) {
+    // no message we write is longer; anything else is shown cut short
+    part = record;
+    if (part.length > sizeof(message))
+      part.length = sizeof(message);
+    if (pread(room->log, message, part.length, record.offset) !=
+        (ssize_t)part.length)
+      break;
+    chat_show(room, &part, message);
+    room->seen = record.offset + record.length;
+    room->next++;
+    shown++;
+  }
+  return shown;
+}
 
+int chatroom_command(struct command_t *command) {
+  if (command->arg_count < 4 || strchr(command->args[1], '/') ||
+      strchr(command->args[2], '/') || command->args[1][0] == '.') {
+    fprintf(stderr, "usage: chatroom <room> <user> [N | +OFFSET]\n");
+    last_status = 2;
+    return SUCCESS;
+  }
+  struct chat_room room = {.name = command->args[1], .user = command->args[2]};
+  long last = CHAT_REPLAY_DEFAULT;
+  long long since = -1;
+  if (command->arg_count > 4) {
+    const char *arg = command->args[3];
+    if (arg[0] == '+')
+      since = atoll(arg + 1);
+    else
+      last = atol(arg);
+  }
+  if (chat_open(&room) == -1) {
+    last_status = 1;
+    return SUCCESS;
+  }
+  printf("Welcome to %s!\n", room.name);
+  chat_replay(&room, last, since);
 
+  int stop = follow_begin(); // Ctrl-C leaves the room
+  int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd != -1)
+    inotify_add_watch(inotify_fd, room.index_path, IN_MODIFY);
+  char input[CHAT_MESSAGE_MAX], message[CHAT_RECORD_MAX];
+  size_t pending = 0; // bytes of a line still being typed
+  bool open = true, prompt = true;
+  while (open) {
+    if (prompt)
+      printf("[%s] %s> ", room.name, room.user);
+    prompt = false;
+    fflush(stdout);
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                            {inotify_fd, POLLIN, 0},
+                            {stop, POLLIN, 0}};
+    if (poll(fds, 3, -1) == -1 && errno != EINTR)
+      break;
+    if (fds[2].revents)
+      break;
+    if (fds[1].revents & POLLIN) {
+      char events[4096]
+          __attribute__((aligned(__alignof__(struct inotify_event))));
+      while (read(inotify_fd, events, sizeof(events)) > 0)
+        ; // the events only say "look again"
+      prompt = chat_catch_up(&room) > 0;
+    }
+    if (!(fds[0].revents & (POLLIN | POLLHUP)))
+      continue;
+    ssize_t n = read(STDIN_FILENO, input + pending, sizeof(input) - 1 - pending);
+    if (n <= 0)
+      break;
+    pending += n;
+    if (pending == sizeof(input) - 1 && !memchr(input, '\n', pending))
+      input[pending++] = '\n'; // a line too long: send what is there
+    prompt = true;
+    char *line = input, *nl;
+    while (open && (nl = memchr(line, '\n', input + pending - line))) {
+      *nl = 0;
+      if (strcmp(line, "/quit") == 0) {
+        open = false;
+      } else {
+        printf("\033[A"); // the message comes back over the typed line
+        int len = snprintf(message, sizeof(message), "[%s] %s: %s\n", room.name,
+                           room.user, line);
+        if (len >= (int)sizeof(message)) { // long names: cut the text short
+          len = sizeof(message) - 1;
+          message[len - 1] = '\n';
+        }
+        if (chat_append(&room, message, len) == -1)
+          fprintf(stderr, "-%s: chatroom: %s: %s\n", sysname, room.dir,
+                  strerror(errno));
+      }
+      line = nl + 1;
+    }
+    pending -= line - input;
+    memmove(input, line, pending);
+  }
+  chat_catch_up(&room);
+  printf("\nleft %s; come back with: chatroom %s %s +%llu\n", room.name,
+         room.name, room.user, (unsigned long long)room.seen);
+  if (inotify_fd != -1)
+    close(inotify_fd);
+  follow_end();
+  close(room.log);
+  close(room.index);
+  return SUCCESS;
+}
 
 int process_command(struct command_t *command) {
-  int r;
   if (strcmp(command->name, "") == 0)
     return SUCCESS;
 
   if (strcmp(command->name, "exit") == 0)
     return EXIT;
+  last_status = 0; // builtins succeed unless they say otherwise
+
+  // expand globs of every stage; builtins that store a command line for
+  // later (every, at, time) leave it to the command when it runs
+  if (strcmp(command->name, "every") != 0 && strcmp(command->name, "at") != 0 &&
+      strcmp(command->name, "time") != 0)
+    for (struct command_t *c = command; c; c = c->next)
+      expand_globs(c);
 
   if (strcmp(command->name, "cd") == 0) {
-    if (command->arg_count > 0) {
-      r = chdir(command->args[0]);
-      if (r == -1)
-        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-      return SUCCESS;
+    const char *dir = command->arg_count > 2 ? command->args[1] : getenv("HOME");
+    if (!dir || chdir(dir) == -1) {
+      printf("-%s: %s: %s: %s\n", sysname, command->name, dir ? dir : "HOME",
+             dir ? strerror(errno) : "not set");
+      last_status = 1;
+    } else {
+      prompt_chdir();
     }
+    return SUCCESS;
   }
   // Question 3 part b (CHATROOM) starts:
-  struct stat st = {0};
-  if (strcmp(command->name, "chatroom") == 0){
-   if (command->arg_count > 3) { //change 0 to 3 to check the name folder
-        char path[150] = "/tmp/chatroom-";
-    	strcat(path, command->args[1]);
-   	if (stat(path, &st) == -1) { //if chatroom does not exist create one 
-    		mkdir(path, 0700);
-	}
-	printf("Welcome to %s!\n",command->args[1]);
-	
-	char dirpath[50];
-	strcpy(dirpath, path); //directory path
-
-	strcat(path, "/");
-	strcat(path, command->args[2]);
-	char  myfifo[150];
-	strcpy(myfifo,path);
-
-   	if (stat(path, &st) == -1) { //if fifo does not exist create one 
-    	 mkfifo(path, S_IWUSR | S_IRUSR |S_IRGRP | S_IROTH); // create pipe , S_IWUSR | S_IRUSR |S_IRGRP | S_IROTH
-	}
-	int fd;
-	int fd1;
-	char str1[180], str2[185],str3[180];
-	pid_t pid;
-  	pid=fork();
-  	if (pid< 0) 
-  	{ 
-            	perror("fork error happened");
-            	exit(1);
-        } 
-        else if(pid==0) //child process
-        {	
-   		while (1)
-    		{
-    			//read user pipe all the time 
-        		fd1 = open(myfifo,O_RDONLY,O_NONBLOCK);
-        		
-        		int a= read(fd1, str1, 180);
-        		str1[strlen(str1)-1]=' ';
-        		printf("\r%s                                          \n", str1);
-        		fflush(stdout);
-        		printf("[%s] %s> ", command->args[1],command->args[2]);
-        		fflush(stdout);
-        		close(fd1);
-		}
-		
-		
-	}
-	else // write the input you get from terminal PARENT
-	{	
-		
-		while(1){
-
-		fflush(stdout);
-   		fgets( str3,180,stdin);
-   		printf("\033[A");
-   		fflush(stdout);
-   		sprintf(str2,"[%s] %s: %s",command->args[1],command->args[2],str3);
- 
-		//GET PIPE COUNT 
-		char *arr[50];
-    		char **ptr = arr;
-		int file_count = 0;
-		DIR * dirp;
-		struct dirent * entry;      				
-		dirp = opendir(dirpath);
-       
-		while ((entry = readdir(dirp)) != NULL) {
-	
-   	 		if (entry->d_type == DT_FIFO  ) { /* If the entry is a named pipe */  	 
-        			ptr[file_count]=entry->d_name;
-         			file_count++;
-         		//printf("pipe count %d\n",file_count);
-    			}
-		}	
-		closedir(dirp);
-		//PIPE PATH
-		int i;
-		strcat(dirpath,"/");
-		for ( i = 0; i < file_count; i++ ){
-	
-			char *tmp = strdup(ptr[i]);
-			strcpy(ptr[i], dirpath); 
-			strcat(ptr[i], tmp);  
-			free(tmp);
-        		//printf("String %d : %s\n", i+1, ptr[i] );//DEBUG             
- 			}
-		for( i = 0; i < file_count; i++) // write to all  children
-			{
-			   		
-   			if (pid< 0) 
-  				{ 
-            			perror("fork error happened");
-            			exit(1);
-        			} 
-        		else if(pid>0) //parent process
-        			{
-				pid=fork();
-				}
-			if(pid== 0) // child process 
-        			{ 
-        			//printf("writing to file %s\n",ptr[i]);//DEBUG
-        			fd = open(ptr[i],O_WRONLY,O_NONBLOCK);
-        			write(fd, str2, strlen(str2)+1);
-        			close(fd);
-        			exit(0);
-        			}	
-			}
-		}
-	}	
-    }
-  }
+  if (strcmp(command->name, "chatroom") == 0)
+    return chatroom_command(command);
   // Question 3 part b (CHATROOM) ends.
    // Question 3 part c (WISEMAN) starts:
   if (strcmp(command->name, "wiseman") == 0){
        if (command->arg_count > 2) {
-       // wiseman(command); //Our second solution for the wiseman question.
-  	char ptr[100];
-  	sprintf(ptr,"echo '*/%s * * * * fortune | espeak -s 125 -v en-uk+m5' | crontab -",command->args[1]); // for clearer voice
-	system(ptr);
-	//return SUCCESS;
-	}
+         // a thin wrapper over the timer scheduler: one wiseman at a time
+         static int wiseman_timer = 0;
+         struct timespec ts;
+         char interval[32];
+         snprintf(interval, sizeof(interval), "%sm", command->args[1]);
+         if (parse_interval(interval, &ts) == -1) {
+           printf("-%s: wiseman: invalid number of minutes '%s'\n", sysname,
+                  command->args[1]);
+           return SUCCESS;
+         }
+         for (int i = 0; i < MAX_TIMERS; i++)
+           if (wiseman_timer && timers[i].id == wiseman_timer)
+             cancel_timer(&timers[i]);
+         wiseman_timer = add_timer(ts, &ts, false,
+                                   strdup("fortune | espeak -s 125 -v en-uk+m5")); // for clearer voice
+       }
+       return SUCCESS;
   }
+  if (strcmp(command->name, "time") == 0)
+    return time_command(command);
+  if (strcmp(command->name, "memo") == 0)
+    return memo_command(command);
+  if (strcmp(command->name, "pin") == 0)
+    return pin_command(command);
+  if (strcmp(command->name, "fdstat") == 0)
+    return fdstat_command(command);
+  if (strcmp(command->name, "hash") == 0)
+    return hash_command(command);
+  if (strcmp(command->name, "every") == 0 || strcmp(command->name, "at") == 0 ||
+      strcmp(command->name, "timers") == 0 || strcmp(command->name, "cancel") == 0)
+    return scheduler_command(command);
   // Question 3 part c (WISEMAN) ends.
   
   
-    // Question 3 part d starts: our first custom command:  //last fileName number_of_lines
-  if (strcmp(command->name,"last") == 0) {
-         
-          last_x_lines(command);
-          return SUCCESS;
-  }
-  
-  // Question 3 part d: our first custom command ENDs.
-  
-  
-  // Question 3 part d starts: our second custom command:  // first fileName number_of_lines
-   if (strcmp(command->name,"first") == 0) {
-         
-          first_x_lines(command);
-          return SUCCESS;
-  }
-  // Question 3 part d starts: our second custom command ENDs:
+    // Question 3 part d: our first and second custom commands (last, first)
+    // are stream builtins, they are dispatched together with str below.
   //Question 3 part d starts: our third custom command:  str = string manipulator//
-  
-    if (strcmp(command->name, "str") == 0) {
-	if (command->arg_count > 3) {
-
-		char *ptr;
-      		ptr = command->args[2];
-      		if(strcmp(command->args[1], "shuffle") == 0){
-		printf("Your new word after shuffle is: ");
-      		sprintf(ptr,"%s",shufflepoint(ptr));
-		}
-		else if(strcmp(command->args[1], "reverse") == 0){
-		printf("Your new word after reverse is: ");
-      		sprintf(ptr,"%s",reversepoint(ptr));
-		}
-      		return SUCCESS;
+  // (and the other stream builtins, when they are not part of a pipeline)
+  if (command->next == NULL && is_stream_builtin(command)) {
+    FILE *in, *out;
+    if (!placement) {
+      last_status = run_stream_builtin_redirected(command);
+    } else if (open_redirect_streams(command, command, &in, &out) == 0) {
+      // a placed builtin gets a thread, the shell itself is not moved
+      last_status = run_builtin_pipeline(command, 1, in, out);
+      close_redirect_streams(in, out);
     }
+    return SUCCESS;
   }
   
     //Question 3 part d starts: our third custom command ENDs:
@@ -802,9 +7713,11 @@ int process_command(struct command_t *command) {
 	printf("Module is already loaded\n");
 	}
 	
-	system("sudo dmesg | grep mymodulePID: > pid");
-	system("sudo dmesg | grep mymoduleParentPID: > ppid");
-	system("sudo dmesg | grep mymoduleTime > startTime");
+	// the kernel log is captured once in memory (memfd), not in scratch
+	// files dropped into the current directory, and filtered with match
+	FILE *kernel_log = capture_output("sudo dmesg");
+	if (kernel_log == NULL)
+		exit(EXIT_FAILURE);
 	
 	
 	// READ PID ///
@@ -816,7 +7729,7 @@ int process_command(struct command_t *command) {
 	int pidArr[1000];
     	int i=0;
     	
-    	fp = fopen("pid", "r");
+    	fp = match_lines(kernel_log, "mymodulePID:");
     	if (fp == NULL)
         	exit(EXIT_FAILURE);
 
@@ -841,7 +7754,7 @@ int process_command(struct command_t *command) {
 	int ppidArr[1000];
     	i=0;
     	
-    	fp2 = fopen("ppid", "r");
+    	fp2 = match_lines(kernel_log, "mymoduleParentPID:");
     	if (fp2 == NULL)
         	exit(EXIT_FAILURE);
 
@@ -865,7 +7778,7 @@ int process_command(struct command_t *command) {
 	long long int startArr[1000];
     	i=0;
     	
-    	fp3 = fopen("startTime", "r");
+    	fp3 = match_lines(kernel_log, "mymoduleTime");
     	if (fp3 == NULL)
         	exit(EXIT_FAILURE);
 
@@ -882,7 +7795,6 @@ int process_command(struct command_t *command) {
    	 int max=i;
    	 //FIND OLDEST CHILD 
    	 
-   	 system("sudo dmesg | grep mymoduleOLD > olds");
    	 FILE * fp4;
     	char * line4 = NULL;
     	size_t len4 = 0;
@@ -891,7 +7803,7 @@ int process_command(struct command_t *command) {
 	int oldArr[1000];
     	i=0;
     	
-    	fp4 = fopen("olds", "r");
+    	fp4 = match_lines(kernel_log, "mymoduleOLD");
     	if (fp4 == NULL)
         	exit(EXIT_FAILURE);
 
@@ -903,6 +7815,7 @@ int process_command(struct command_t *command) {
        	 	i++;
    	 }
    	 fclose(fp4);
+   	 fclose(kernel_log);
 
 	///VISUALIZATION//
 	char graphDataLine[100];
@@ -911,7 +7824,8 @@ int process_command(struct command_t *command) {
    	 
    	FILE *grp;
 
-   	grp = fopen("graph","w");
+   	int graph_fd = memfd_create("shellax-graph", MFD_CLOEXEC);
+   	grp = graph_fd == -1 ? NULL : fdopen(fcntl(graph_fd, F_DUPFD_CLOEXEC, 0), "w");
 
    	if(grp == NULL)
    	{
@@ -948,7 +7862,8 @@ int process_command(struct command_t *command) {
    	 
    	 fclose(grp);
 	
-	system("cat graph | dot -Tpng > out.png");
+	run_with_input("dot -Tpng > out.png", graph_fd);
+	close(graph_fd);
 	
 	///REMOVE MODULE 
 	
@@ -982,7 +7897,6 @@ int process_command(struct command_t *command) {
 	  new = new->next;
     }
   
-    int pipe_count = child_num - 1 ;
     int exit_value;
     int infd;
     int pipefd[2];
@@ -991,57 +7905,126 @@ int process_command(struct command_t *command) {
 // when there are pipes:
 if(child_num > 1){  //We used if to distinguish whether there are pipes or not. 
 
+    // every stage is a builtin: run the whole pipeline inside the shell
+    int builtin_stages = 0;
+    for (next_command = command; next_command; next_command = next_command->next)
+        builtin_stages += is_stream_builtin(next_command);
+    if (builtin_stages == child_num) {
+        FILE *in, *out;
+        if (open_redirect_streams(command, new, &in, &out) == -1) {
+            last_status = 1;
+            return SUCCESS;
+        }
+        last_status = run_builtin_pipeline(command, child_num, in, out);
+        close_redirect_streams(in, out);
+        return SUCCESS;
+    }
 
-    //loop through pipe commands
-    for (int i = 0; i <= pipe_count; i++) {
+    // otherwise start every stage (a run of adjacent builtins shares one
+    // process) and only then wait for them, so that stages run concurrently.
+    // Pipe ends are close-on-exec and owned by the shell until they are handed
+    // over: after each fork the parent closes the write end the child got and
+    // the read end of the previous stage, keeping only `infd` (the read end for
+    // the next stage). A child dup2()s its ends onto 0/1 and closes the rest,
+    // so no stage ever holds a stray writer of another stage's pipe.
+    pid_t pids[child_num];
+    uint64_t fork_starts[child_num];
+    struct command_t *stage_commands[child_num];
+    int pid_count = 0;
+    int pipe_size = pipe_size_setting();
+    infd = -1;
+    next_command = command;
+    fflush(stdout);
+    while (next_command) {
+        int segment = 1;
+        struct command_t *after = next_command->next;
+        if (is_stream_builtin(next_command))
+            while (after && is_stream_builtin(after)) {
+                segment++;
+                after = after->next;
+            }
     
-        //create new pipe for cmd i
-        if (pipe(pipefd) == -1) {
+        //create new pipe for every stage but the last
+        if (after && pipe2(pipefd, O_CLOEXEC) == -1) {
             perror("pipe");
-            exit(EXIT_FAILURE);
+            break;
         }
+        if (after)
+            tune_pipe(pipefd[1], pipe_size);
+        if (!is_stream_builtin(next_command))
+            prime_command(next_command);
         //fork child to handle cmd
         pid_t pid;
+        fork_starts[pid_count] = trace_now();
         pid = fork();
+        if (pid > 0)
+            trace_span("fork", "exec", fork_starts[pid_count], NULL);
         if (pid == -1) {
             perror("fork");
-            //return;
+            if (after) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+            }
+            break;
         } else if(pid == 0) { // child process
+            apply_placement(next_command);
         
-            //for all but first cmd, connect stdin with pipefd[0]          
-            if(i != 0) {
-	
+            //for all but first cmd, connect stdin with the previous pipe
+            if(infd != -1) {
                 dup2(infd, 0); //put what you read from pipe in the input of this command
+                close(infd);
             }
 
-
             //for all but last cmd, connect stdout with pipefd[1]
-            if (i != pipe_count) {
-		
+            if (after) {
                 dup2(pipefd[1], 1);//write the output of this command to pipe
+                close(pipefd[0]);
+                close(pipefd[1]);
             }
+
+            // the pipeline's own redirections: input of the first stage,
+            // output of the last one
+            if (next_command == command && has_input(command) &&
+                redirect_input(command) == -1)
+                exit(1);
+            if (!after && new->redirects[1] &&
+                redirect_fd(new->redirects[1], O_WRONLY | O_CREAT | O_TRUNC,
+                            STDOUT_FILENO) == -1)
+                exit(1);
+            if (!after && new->redirects[2] &&
+                redirect_fd(new->redirects[2], O_WRONLY | O_CREAT | O_APPEND,
+                            STDOUT_FILENO) == -1)
+                exit(1);
     
-            // Question 3 uniq command starts:  
-            if(strcmp(next_command->name, "myuniq") == 0){ //Our uniq command.
-            
-                myUniq(next_command);
+            // Question 3 uniq command starts: (myuniq, str and the other stream builtins)
+            if (segment > 1)
+                exit(run_builtin_pipeline(next_command, segment, stdin, stdout));
+            int status = run_stream_builtin(next_command, stdin, stdout);
+            if (status != -1)
+                exit(status);
             // Question 3 uniq command ends. 
-            }else{
-		  
-                execvp(next_command->name,next_command->args);
-	   }
-	   	  
-            exit(1);
+            exec_command(next_command);
         } else { //parent process
         
-            //wait and store pipefd[0] for next iteration
-            wait(&exit_value);
-            infd = pipefd[0];
-            // close(pipefd[0]);
-	    close(pipefd[1]);
-	    next_command = next_command->next;
+            // store pipefd[0] for next stage
+            stage_commands[pid_count] = next_command;
+            pids[pid_count++] = pid;
+            if (infd != -1)
+                close(infd);
+            infd = -1;
+            if (after) {
+                infd = pipefd[0];
+                close(pipefd[1]);
+            }
+            next_command = after;
         }
     }
+    if (infd != -1)
+        close(infd);
+    for (int i = 0; i < pid_count; i++)
+        wait_stage(pids[i], &exit_value, fork_starts[i], stage_commands[i]->name);
+    if (pid_count > 0) // the status of a pipeline is the one of its last stage
+        last_status = exit_code(exit_value);
      
      return SUCCESS; 
 // Question 2 Part 2 ends.
@@ -1049,10 +8032,19 @@ if(child_num > 1){  //We used if to distinguish whether there are pipes or not.
 } else if(child_num == 1){ // There are no pipes.
 
 
-
+  prime_command(command);
+  uint64_t fork_start = trace_now();
   pid_t pid = fork();
+  if (pid > 0)
+    trace_span("fork", "exec", fork_start, NULL);
+  if (pid == -1) {
+    perror("fork");
+    last_status = 1;
+    return SUCCESS;
+  }
   if (pid == 0) // child
   {
+    apply_placement(command);
     /// This shows how to do exec with environ (but is not available on MacOs)
     // extern char** environ; // environment variables
     // execvpe(command->name, command->args, environ); // exec+args+path+environ
@@ -1066,26 +8058,17 @@ if(child_num > 1){  //We used if to distinguish whether there are pipes or not.
     
     
 // Question 2 part 1: I/O redirection problem starts:
-     if(command->redirects[0] != NULL){
-     
-       int in = open(command->redirects[0], O_RDONLY);
-       dup2(in, STDIN_FILENO);         // duplicate stdin to input file
-       close(in);                      // close after use
-     }
-     if(command->redirects[1] != NULL){
-    
-       int out =open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC,
-                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); // open(command->redirects[1],O_CREAT | O_TRUNC | O_WRONLY);
-       dup2(out, STDOUT_FILENO);         // duplicate stdout to output file
-       close(out);                      // close after use
-     }
+     if(has_input(command) && redirect_input(command) == -1)
+       exit(1);
+     if(command->redirects[1] != NULL &&
+        redirect_fd(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC,
+                    STDOUT_FILENO) == -1)
+       exit(1);
 
-     if(command->redirects[2] != NULL){
-     
-         int out2 = open(command->redirects[2], O_CREAT | O_RDWR | O_APPEND);
-         dup2(out2, STDOUT_FILENO);         // duplicate stdout to output file
-         close(out2);
-    }
+     if(command->redirects[2] != NULL &&
+        redirect_fd(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND,
+                    STDOUT_FILENO) == -1)
+       exit(1);
 // Question 2 part 1: I/O redirection problem ends.
 
 
@@ -1093,29 +8076,8 @@ if(child_num > 1){  //We used if to distinguish whether there are pipes or not.
     
     
     // Question 1: execv() problem starts:
-    char *pathVar = getenv("PATH");
-    char * token = strtok(pathVar, ":");
-    char czg[] = "/";
-    char path[100];
-    strcat(czg,command->args[0]); 
-    
-    // loop through the string to extract all other tokens
-    while( token != NULL ) {
-     
-          strcpy(path,token);
-          strcat(path,czg); // add command name to the end of path.
-          if(execv(path,command->args) != -1){
-            //perror("execv");
-              break;
-          }
-          token = strtok(NULL, ":");
-   }
+    exec_command(command);
   //Question 1:  execv() problem ends.
-  
-  
-  
-    //execvp(command->name, command->args); // exec+args+path
-    exit(0);
   } else { // Parent Process
   
 // Question 1: ampersand (&) problem starts:
@@ -1124,7 +8086,8 @@ if(child_num > 1){  //We used if to distinguish whether there are pipes or not.
       int status;
       if(command->background == false){
 
-	   waitpid(pid, &status, 0);
+	   wait_stage(pid, &status, fork_start, command->name);
+	   last_status = exit_code(status);
 
       }
       return SUCCESS;